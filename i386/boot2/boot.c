@@ -67,59 +67,6 @@
 	#include "backup/apic.h"
 #endif
 
-//==============================================================================
-// Local adler32 function.
-
-unsigned long Adler32(unsigned char *buf, long len)
-{
-	#define BASE 65521L // largest prime smaller than 65536
-	#define NMAX 5000
-	// NMAX (was 5521) the largest n such that 255n(n+1)/2 + (n+1)(BASE-1) <= 2^32-1
-	
-	#define DO1(buf, i)  {s1 += buf[i]; s2 += s1;}
-	#define DO2(buf, i)  DO1(buf, i); DO1(buf, i + 1);
-	#define DO4(buf, i)  DO2(buf, i); DO2(buf, i + 2);
-	#define DO8(buf, i)  DO4(buf, i); DO4(buf, i + 4);
-	#define DO16(buf)   DO8(buf, 0); DO8(buf, 8);
-
-	int k;
-
-	unsigned long s1 = 1;	// adler & 0xffff;
-	unsigned long s2 = 0;	// (adler >> 16) & 0xffff;
-	unsigned long result;
-
-	
-	while (len > 0)
-	{
-		k = len < NMAX ? len : NMAX;
-		len -= k;
-
-		while (k >= 16)
-		{
-			DO16(buf);
-			buf += 16;
-			k -= 16;
-		}
-
-		if (k != 0)
-		{
-			do
-			{
-				s1 += *buf++;
-				s2 += s1;
-			} while (--k);
-		}
-
-		s1 %= BASE;
-		s2 %= BASE;
-	}
-
-	result = (s2 << 16) | s1;
-
-	return OSSwapHostToBigInt32(result);
-}
-
-
 //==============================================================================
 
 static void zeroBSS()
@@ -598,7 +545,7 @@ void boot(int biosdev)
 					sprintf(adler32Key + PLATFORM_NAME_LEN, "%s", BOOT_DEVICE_PATH);
 					sprintf(adler32Key + (PLATFORM_NAME_LEN + 38), "%s", bootInfo->bootFile);
 				
-					adler32 = Adler32((unsigned char *)adler32Key, sizeof(adler32Key));
+					adler32 = OSSwapHostToBigInt32(Adler32(1, adler32Key, sizeof(adler32Key)));
 				
 					_BOOT_DEBUG_DUMP("adler32: %08X\n", adler32);
 
@@ -659,7 +606,7 @@ void boot(int biosdev)
 				sprintf(adler32Key + PLATFORM_NAME_LEN, "%s", BOOT_DEVICE_PATH);
 				sprintf(adler32Key + (PLATFORM_NAME_LEN + 38), "%s", bootInfo->bootFile);
 				
-				adler32 = Adler32((unsigned char *)adler32Key, sizeof(adler32Key));
+				adler32 = OSSwapHostToBigInt32(Adler32(1, adler32Key, sizeof(adler32Key)));
 				
 				_BOOT_DEBUG_DUMP("adler32: %08X\n", adler32); */
 				
@@ -673,9 +620,8 @@ void boot(int biosdev)
 					_BOOT_DEBUG_DUMP("Pre-linked kernel cache located!\nLoading pre-linked kernel: %s\n", preLinkedKernelPath);
 					
 					// Returns -1 on error, or the actual filesize.
-					if (LoadFile((const char *)preLinkedKernelPath))
+					if ((retStatus = LoadFile((const char *)preLinkedKernelPath)) > 0)
 					{
-						retStatus = 1;
 						fileLoadBuffer = (void *)kLoadAddr;
 						bootFile[0] = 0;
 					}
@@ -714,7 +660,7 @@ void boot(int biosdev)
 
 		_BOOT_DEBUG_DUMP("About to load: %s\n", bootFile);
 
-		retStatus = LoadThinFatFile(bootFile, &fileLoadBuffer);
+		retStatus = OpenThinFatFile(bootFile, &fileLoadBuffer);
 
 #if SUPPORT_32BIT_MODE
 		if (retStatus <= 0 && gPlatform.ArchCPUType == CPU_TYPE_X86_64)
@@ -723,7 +669,7 @@ void boot(int biosdev)
 
 			gPlatform.ArchCPUType = CPU_TYPE_I386;
 
-			retStatus = LoadThinFatFile(bootFile, &fileLoadBuffer);
+			retStatus = OpenThinFatFile(bootFile, &fileLoadBuffer);
 		}
 #endif // SUPPORT_32BIT_MODE
 
@@ -745,7 +691,7 @@ void boot(int biosdev)
 			
 			_BOOT_DEBUG_DUMP("execKernel-1\n");
 			
-			if (decodeKernel(fileLoadBuffer, &kernelEntry, (char **) &bootArgs->kaddr, (int *)&bootArgs->ksize) != 0)
+			if (decodeKernel(fileLoadBuffer, retStatus, &kernelEntry, (char **) &bootArgs->kaddr, (int *)&bootArgs->ksize) != 0)
 			{
 				stop("DecodeKernel() failed!");
 			}
@@ -766,6 +712,15 @@ void boot(int biosdev)
 				// Yes. Load boot drivers from root path.
 				loadDrivers("/");
 			}
+#if (PATCH_LOAD_EXTRA_KEXTS && ((MAKE_TARGET_OS & EL_CAPITAN) == EL_CAPITAN))
+			else
+			{
+				_BOOT_DEBUG_DUMP("Calling loadDrivers() for /Extra/Extensions\n");
+
+				// Pre-linked kernel. Only add the kexts from /Extra/Extensions.
+				loadDrivers("/");
+			}
+#endif
 			
 			_BOOT_DEBUG_DUMP("execKernel-4\n");
 			
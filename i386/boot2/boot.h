@@ -134,7 +134,7 @@ extern long HFSGetUUID(CICell ih, char *uuidStr);
 #endif
 
 extern long loadDrivers(char * dirSpec);
-extern long decodeKernel(void *binary, entry_t *rentry, char **raddr, int *rsize);
+extern long decodeKernel(void *binary, long length, entry_t *rentry, char **raddr, int *rsize);
 
 typedef long (*FileLoadDrivers_t)(char *dirSpec, long plugin);
 
@@ -146,16 +146,46 @@ typedef long (*FileLoadDrivers_t)(char *dirSpec, long plugin);
 extern long (*LoadExtraDrivers_p)(FileLoadDrivers_t FileLoadDrivers_p);
 
 /*
- * lzss.c
+ * lzss.c / lzvn.c
+ *
+ * Resumable decoders used by decodeKernel(). Each call decodes until the
+ * output window is full, the input runs out, or the end of the stream is
+ * reached, and picks up where it left off on the next call. The Adler-32
+ * of the output is updated on the fly, so that the caller does not have to
+ * read it all back.
  */
 
-extern int decompressLZSS(u_int8_t *dst, u_int8_t *src, u_int32_t srclen);
+// START_DUPLICATED_BLOCK (see util/lzvnbench.c)
 
-/*
- * lzss.c
- */
+#define kDecodeError		-1
+#define kDecodeDone			0		// End of the compressed stream (LZVN only).
+#define kDecodeNeedOutput	1		// Output window is full.
+#define kDecodeNeedInput	2		// All available input has been consumed.
+
+#define kDecodeChecksumSize	0x4000	// Output is checksummed in 16 KB blocks, while these are still cached.
+
+#define kDecodeNoChecksum	1		// LZVN: set in flags to skip the Adler-32 (lzvn_decode).
+
+typedef struct DecodeStream
+{
+	u_int8_t	* src;				// Next compressed byte.
+	u_int8_t	* srcEnd;			// End of the compressed bytes available so far.
+	u_int8_t	* dst;				// Next output byte.
+	u_int8_t	* dstStart;			// Start of the output window (oldest byte a match may use).
+	u_int8_t	* dstEnd;			// End of the output window.
+	u_int32_t	literalLength;		// LZVN: literal bytes not yet copied.
+	u_int32_t	matchLength;		// Match bytes not yet copied.
+	u_int32_t	matchDistance;		// Current match distance.
+	u_int32_t	flags;				// LZSS: flag byte, with the valid bits marked in the high byte. LZVN: kDecodeNoChecksum.
+	u_int32_t	ringIndex;			// LZSS: number of bytes written, modulo the ring buffer size.
+	u_int32_t	adler32;			// Adler-32 of the output so far (set to 1 before the first call).
+} DecodeStream;
+
+extern int decompressLZSS(DecodeStream * stream);
 
 extern int lzvn_decode(void * decompressedData, uint32_t decompressedSize, void * compressedData, uint32_t compressedSize);
+extern int lzvn_decode_stream(DecodeStream * stream);
+// END_DUPLICATED_BLOCK
 
 /*
  * options.c
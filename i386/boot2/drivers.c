@@ -37,6 +37,10 @@
 #include "bootstruct.h"
 #include "xml.h"
 
+#if DEBUG_DRIVERS
+	#include "cpu/proc_reg.h"
+#endif
+
 
 #if RAMDISK_SUPPORT
 	#include "ramdisk.h"
@@ -56,8 +60,15 @@ typedef struct Module
 	char		* executablePath;
 	char		* bundlePath;
 	long		bundlePathLength;
+	char		* bundleID;			// CFBundleIdentifier (NULL when missing).
+	char		* executable;		// CFBundleExecutable (NULL for kexts without code).
+	char		* libraries;		// OSBundleLibraries, NUL separated and ended by an empty string.
+	struct Module *nextHash;		// Next module in the same gModuleHash bucket.
+	struct Module *nextWork;		// Next module on the matchLibraries() work list.
 } Module, *ModulePtr;
 
+#define kModuleHashSize			256	// Must be a power of 2.
+
 typedef struct DriverInfo
 {
 	char	* plistAddr;
@@ -92,9 +103,63 @@ enum
 };
 // END_DUPLICATED_BLOCK
 
-// Private functions.
-static unsigned long localAdler32(unsigned char * buffer, long length);
+#if KEXT_INDEX_SUPPORT
+// START_DUPLICATED_BLOCK (see util/kextindex.c)
+
+#define kKextIndexSignature	'KIDX'
+#define kKextIndexVersion	2
+#define kKextIndexFile		"/Extra/Extensions.index"
+
+// All offsets are from the start of the file.
+typedef struct KextIndexHeader
+{
+	uint32_t	signature;
+	uint32_t	version;
+	uint32_t	length;			// Of the file.
+	uint32_t	adler32;		// Of everything after the header.
+	uint32_t	folderCount;	// Followed by the folders, the kexts and the stamps.
+	uint32_t	kextCount;
+	uint32_t	stampCount;
+} KextIndexHeader;
+
+typedef struct KextIndexFolder
+{
+	uint32_t	path;			// i.e. "/System/Library/Extensions"
+	int32_t		time;			// Modification time of the folder.
+	uint32_t	firstKext;
+	uint32_t	kextCount;
+	uint32_t	firstStamp;
+	uint32_t	stampCount;
+} KextIndexFolder;
+
+// Only kexts that the booter loads (OSBundleRequired set, but not to "Safe Boot").
+typedef struct KextIndexEntry
+{
+	uint32_t	bundlePath;		// "<folder>/Foo.kext/"
+	uint32_t	executablePath;	// "<folder>/Foo.kext/Contents/MacOS/"
+	uint32_t	executable;		// CFBundleExecutable (0 for none).
+	uint32_t	bundleID;		// CFBundleIdentifier.
+	uint32_t	required;		// OSBundleRequired.
+	uint32_t	libraries;		// OSBundleLibraries, NUL separated and ended by an empty string.
+	uint32_t	plist;			// Copy of the Info.plist, NUL terminated.
+	uint32_t	plistLength;	// Including the NUL.
+} KextIndexEntry;
+
+// Modification times that must still match: the Info.plist of every kext in the
+// folder (indexed or not) and every PlugIns folder, which change when a kext is
+// updated or a plugin kext is added or removed.
+typedef struct KextIndexStamp
+{
+	uint32_t	folder;			// i.e. "<folder>/Foo.kext/Contents"
+	uint32_t	name;			// "Info.plist" or "PlugIns"
+	int32_t		time;
+} KextIndexStamp;
+// END_DUPLICATED_BLOCK
+
+static KextIndexHeader * gKextIndex;
+#endif
 
+// Private functions.
 #if (MAKE_TARGET_OS == SNOW_LEOPARD)
 	static int loadMultiKext(char *fileSpec);
 #endif
@@ -105,48 +170,25 @@ static long loadMatchedModules(void);
 static long matchLibraries(void);
 
 #ifdef NOTDEF
-	static ModulePtr	findModule(char *name);
 	static void			ThinFatFile(void **loadAddrP, unsigned long *lengthP);
 #endif
 
+static void addModule(ModulePtr module);
+static ModulePtr findModule(const char * bundleID);
+
 static long parseXML(char *buffer, ModulePtr *module, TagPtr *personalities);
+static long getWillLoad(const char * required);
 static long initDriverSupport(void);
 
+#if KEXT_INDEX_SUPPORT
+	static int loadIndexedKexts(char * targetFolder);
+#endif
+
 static ModulePtr gModuleHead, gModuleTail;
+static ModulePtr * gModuleHash;		// Modules by bundle ID (see addModule).
 static TagPtr    gPersonalityHead, gPersonalityTail;
 
 
-//==============================================================================
-
-static unsigned long localAdler32(unsigned char * buffer, long length)
-{
-    long          cnt;
-    unsigned long result, lowHalf, highHalf;
-    
-    lowHalf  = 1;
-    highHalf = 0;
-  
-	for (cnt = 0; cnt < length; cnt++)
-    {
-        if ((cnt % 5000) == 0)
-        {
-            lowHalf  %= 65521L;
-            highHalf %= 65521L;
-        }
-    
-        lowHalf  += buffer[cnt];
-        highHalf += lowHalf;
-    }
-
-	lowHalf  %= 65521L;
-	highHalf %= 65521L;
-  
-	result = (highHalf << 16) | lowHalf;
-  
-	return result;
-}
-
-
 //==============================================================================
 
 static long initDriverSupport(void)
@@ -154,11 +196,14 @@ static long initDriverSupport(void)
 	gPlatform.KextFileName	= (char *) malloc(MAX_KEXT_PATH_LENGTH); // Used in loadKexts()
 	gPlatform.KextPlistSpec	= (char *) malloc(MAX_KEXT_PATH_LENGTH); // Used in loadPlist()
 	gPlatform.KextFileSpec	= (char *) malloc(MAX_KEXT_PATH_LENGTH); // Used in loadKexts() and loadMatchedModules()
+	gModuleHash				= (ModulePtr *) malloc(kModuleHashSize * sizeof(ModulePtr)); // Used in addModule() and findModule()
 
-	if (!gPlatform.KextFileName || !gPlatform.KextPlistSpec || !gPlatform.KextFileSpec)
+	if (!gPlatform.KextFileName || !gPlatform.KextPlistSpec || !gPlatform.KextFileSpec || !gModuleHash)
 	{
 		stop("initDriverSupport error");
 	}
+
+	bzero(gModuleHash, kModuleHashSize * sizeof(ModulePtr));
 	
 	return 0;
 }
@@ -211,8 +256,10 @@ long loadDrivers(char * dirSpec)
 			_DRIVERS_DEBUG_DUMP("\n");
 		}
 #endif
-		// Now progress to the system kexts.
-		if ((gKextLoadStatus & 1) == 0)
+		// Now progress to the system kexts, unless we use a pre-linked kernel (these
+		// are already in it). The kexts from /Extra/Extensions are then linked by the
+		// patched KLDBootstrap::readStartupExtensions() (see PATCH_LOAD_EXTRA_KEXTS).
+		if (((gKextLoadStatus & 1) == 0) && gLoadKernelDrivers)
 		{
 #if ((MAKE_TARGET_OS & MAVERICKS) == MAVERICKS) // Mavericks, Yosemite and El Capitan specifics.
 			_DRIVERS_DEBUG_DUMP("\nCalling loadKexts(\"/Library/Extensions\");\n");
@@ -308,7 +355,7 @@ static int loadMultiKext(char * path)
 			(_GET_PE(signature2) != kDriverPackageSignature2)	||
 			(_GET_PE(length)      > kLoadSize)					||
 			(_GET_PE(adler32)    !=
-			 localAdler32((unsigned char *)&package->version, _GET_PE(length) - 0x10)))
+			 Adler32(1, &package->version, _GET_PE(length) - 0x10)))
 		{
 			_DRIVERS_DEBUG_DUMP("loadMultiKext(Verification Error : -3)\n");
 	
@@ -347,6 +394,14 @@ static int loadKexts(char * targetFolder, bool isPluginRun)
     long dirEntryFlags, dirEntryTime, dirEntryIndex = 0;
 	
     const char * dirEntryName;
+
+#if KEXT_INDEX_SUPPORT
+	// Use the kext index instead, when it is up to date for this folder.
+	if (!isPluginRun && (loadIndexedKexts(targetFolder) == EFI_SUCCESS))
+	{
+		return EFI_SUCCESS;
+	}
+#endif
 	
 	while (1)
 	{
@@ -483,67 +538,54 @@ static int loadPlist(char * targetFolder, bool isBundleType2)
 				if (plistBuffer)
 				{
 					_DRIVERS_DEBUG_DUMP("1");
+					// Keep this copy for the kernel, and parse the plist at kLoadAddr
+					// instead (the parser writes into the buffer).
 					strlcpy(plistBuffer, (char *)kLoadAddr, plistLength);
+					((char *)kLoadAddr)[plistLength - 1] = '\0';
 
 					// parseXML returns 0 on success so we check that here.
-					if (parseXML(plistBuffer, &module, &personalities) == 0)
+					if (parseXML((char *)kLoadAddr, &module, &personalities) == 0)
 					{
 						_DRIVERS_DEBUG_DUMP("2");
-						// Allocate memory for the driver path and the plist.
 						module->executablePath = tmpExecutablePath;
 						module->bundlePath = tmpBundlePath;
 						module->bundlePathLength = bundlePathLength;
-						module->plistAddr = (void *)malloc(plistLength);
+						module->plistAddr = plistBuffer;
+						module->plistLength = plistLength;
 
-						if (module->plistAddr)
-						{
-							_DRIVERS_DEBUG_DUMP("3");
-							// Tell free() to take no action for these two (by passing 0 as argument).
-							tmpBundlePath = tmpExecutablePath = 0;
+						_DRIVERS_DEBUG_DUMP("3");
+						// Tell free() to take no action for these three (by passing 0 as argument).
+						tmpBundlePath = tmpExecutablePath = plistBuffer = 0;
 
-							// Add the plist to the module.
-							strlcpy(module->plistAddr, (char *)kLoadAddr, plistLength);
-							module->plistLength = plistLength;
+						addModule(module);
 
-							// Add the module to the end of the module list.
-							if (gModuleHead == 0)
+						// Add the personalities to the personalities list.
+						if (personalities)
+						{
+							personalities = personalities->tag;
+						}
+
+						while (personalities != 0)
+						{
+							if (gPersonalityHead == 0)
 							{
-								gModuleHead = module;
+								gPersonalityHead = personalities->tag;
 							}
 							else
 							{
-								gModuleTail->nextModule = module;			
+								gPersonalityTail->tagNext = personalities->tag;
 							}
 
-							gModuleTail = module;
-	
-							// Add the personalities to the personalities list.
-							if (personalities)
-							{
-								personalities = personalities->tag;
-							}
-
-							while (personalities != 0)
-							{
-								if (gPersonalityHead == 0)
-								{
-									gPersonalityHead = personalities->tag;
-								}
-								else
-								{
-									gPersonalityTail->tagNext = personalities->tag;
-								}
-
-								gPersonalityTail = personalities->tag;
-								personalities = personalities->tagNext;
-							}
+							gPersonalityTail = personalities->tag;
+							personalities = personalities->tagNext;
+						}
 
-							result = 0;
+						result = 0;
 
-							_DRIVERS_DEBUG_DUMP(".");
-						}
+						_DRIVERS_DEBUG_DUMP(".");
 					}
 
+					// Free on failure only.
 					free(plistBuffer);
 				}
 			}
@@ -560,28 +602,182 @@ static int loadPlist(char * targetFolder, bool isBundleType2)
 }
 
 
+#if KEXT_INDEX_SUPPORT
+//==============================================================================
+// Loads and checks /Extra/Extensions.index (made by util/kextindex). Returns 0
+// when the index is usable, or -1 when it is missing or invalid.
+
+static long loadKextIndex(void)
+{
+	static bool checked = false;
+
+	KextIndexHeader * header = (KextIndexHeader *)kLoadAddr;
+
+	if (checked)
+	{
+		return (gKextIndex ? EFI_SUCCESS : -1);
+	}
+
+	checked = true;
+
+	long length = LoadFile(kKextIndexFile);
+
+	if ((length < (long)sizeof(KextIndexHeader))			||
+		(header->signature != kKextIndexSignature)			||
+		(header->version != kKextIndexVersion)				||
+		(header->length != length)							||
+		(header->adler32 != Adler32(1, header + 1, length - sizeof(KextIndexHeader))))
+	{
+		_DRIVERS_DEBUG_DUMP("loadKextIndex(%s not found or invalid)\n", kKextIndexFile);
+
+		return -1;
+	}
+
+	// Copy it, since kLoadAddr is used for the kext executables.
+	gKextIndex = malloc(length);
+
+	if (gKextIndex == NULL)
+	{
+		return -1;
+	}
+
+	memcpy(gKextIndex, header, length);
+
+	_DRIVERS_DEBUG_DUMP("loadKextIndex(%d kexts in %d folders)\n", gKextIndex->kextCount, gKextIndex->folderCount);
+
+	return EFI_SUCCESS;
+}
+
+
+//==============================================================================
+// Adds the kexts of 'targetFolder' from the kext index, instead of walking the
+// folder and parsing each Info.plist. The index is only used when the times of
+// the folder, each PlugIns folder and the Info.plist of each kext (indexed or
+// not) match. OS X updates the time of a folder when kexts are added to it or
+// removed from it.
+
+static int loadIndexedKexts(char * targetFolder)
+{
+	char * base, * parent, * name;
+
+	uint32_t index;
+
+	long flags, time;
+
+	KextIndexFolder * folder;
+	KextIndexEntry * kext;
+	KextIndexStamp * stamp;
+	ModulePtr module;
+
+	if (loadKextIndex() != EFI_SUCCESS)
+	{
+		return -1;
+	}
+
+	base = (char *)gKextIndex;
+	folder = (KextIndexFolder *)(gKextIndex + 1);
+
+	for (index = 0; (index < gKextIndex->folderCount) && strcmp(base + folder->path, targetFolder); index++, folder++);
+
+	if (index == gKextIndex->folderCount)
+	{
+		return -1;
+	}
+
+	// Split the folder into the parent folder and name, for GetFileInfo.
+	strcpy(gPlatform.KextFileSpec, targetFolder);
+
+	for (name = gPlatform.KextFileSpec + strlen(gPlatform.KextFileSpec); (name > gPlatform.KextFileSpec) && (name[-1] != '/'); name--);
+
+	if (name > (gPlatform.KextFileSpec + 1))
+	{
+		name[-1] = '\0';
+		parent = gPlatform.KextFileSpec;
+	}
+	else
+	{
+		parent = "/";
+	}
+
+	if ((GetFileInfo(parent, name, &flags, &time) != 0) || (time != folder->time))
+	{
+		_DRIVERS_DEBUG_DUMP("loadIndexedKexts(%s changed)\n", targetFolder);
+
+		return -1;
+	}
+
+	kext = (KextIndexEntry *)((KextIndexFolder *)(gKextIndex + 1) + gKextIndex->folderCount);
+	stamp = (KextIndexStamp *)(kext + gKextIndex->kextCount) + folder->firstStamp;
+	kext += folder->firstKext;
+
+	for (index = 0; index < folder->stampCount; index++, stamp++)
+	{
+		if ((GetFileInfo(base + stamp->folder, base + stamp->name, &flags, &time) != 0) || (time != stamp->time))
+		{
+			_DRIVERS_DEBUG_DUMP("loadIndexedKexts(%s/%s changed)\n", base + stamp->folder, base + stamp->name);
+
+			return -1;
+		}
+	}
+
+	for (index = 0; index < folder->kextCount; index++, kext++)
+	{
+		module = malloc(sizeof(Module));
+
+		if (module == NULL)
+		{
+			return -1;
+		}
+
+		bzero(module, sizeof(Module));
+
+		module->willLoad			= getWillLoad(base + kext->required);
+		module->plistAddr			= base + kext->plist;
+		module->plistLength			= kext->plistLength;
+		module->executablePath		= base + kext->executablePath;
+		module->bundlePath			= base + kext->bundlePath;
+		module->bundlePathLength	= strlen(module->bundlePath) + 1;
+		module->bundleID			= base + kext->bundleID;
+		module->executable			= kext->executable ? (base + kext->executable) : 0;
+		module->libraries			= kext->libraries ? (base + kext->libraries) : 0;
+
+		addModule(module);
+	}
+
+	_DRIVERS_DEBUG_DUMP("loadIndexedKexts(%s: %d kexts)\n", targetFolder, folder->kextCount);
+
+	return EFI_SUCCESS;
+}
+#endif
+
+
 //==============================================================================
 
 static long loadMatchedModules(void)
 {
-    TagPtr        prop;
     ModulePtr     module;
     char          *fileName, segName[32];
     DriverInfoPtr driver;
     long          length, driverAddr, driverLength;
+    unsigned long size, loaded;
     void          *executableAddr = 0;
 
+#if MINIMAL_ROOT_KEXT_SET
+    int           loadedCount = 0, skippedCount = 0;
+    long          loadedBytes = 0, skippedBytes = 0;
+#endif
+
     module = gModuleHead;
 
     while (module != 0)
     {
         if (module->willLoad)
         {
-            prop = XMLGetProperty(module->dict, kPropCFBundleExecutable);
+            size = loaded = 0;
 
-            if (prop != 0)
+            if (module->executable != 0)
             {
-                fileName = prop->string;
+                fileName = module->executable;
 
                 sprintf(gPlatform.KextFileSpec, "%s%s", module->executablePath, fileName);
 // #if DEBUG_DRIVERS
@@ -590,9 +786,21 @@ static long loadMatchedModules(void)
 					stop("Error: gPlatform.KextFileSpec >= %d chars. Change MAX_KEXT_PATH_LENGTH!", MAX_KEXT_PATH_LENGTH);
 				}
 // #endif
-                length = LoadThinFatFile(gPlatform.KextFileSpec, &executableAddr);
+				// Reads the first 4 KB (the rest is read straight into the DriverInfo
+				// block below) or the whole file, when the size cannot be queried.
+                length = OpenThinFatFile(gPlatform.KextFileSpec, &executableAddr);
 
-				if (length == 0)
+				if (length > 0)
+				{
+					loaded = length;
+					size = GetThinFatFileSize();
+
+					if (size != 0)
+					{
+						length = size;
+					}
+				}
+				else if (length == 0)
 				{
 					length = LoadFile(gPlatform.KextFileSpec);
 					executableAddr = (void *)kLoadAddr;
@@ -605,12 +813,6 @@ static long loadMatchedModules(void)
 
             if (length != -1)
             {
-                //driverModuleAddr = (void *)kLoadAddr;
-                //if (length != 0)
-                //{
-                //    ThinFatFile(&driverModuleAddr, &length);
-                //}
-
                 // Make room in the image area.
                 driverLength = sizeof(DriverInfo) + module->plistLength + length + module->bundlePathLength;
                 driverAddr = AllocateKernelMemory(driverLength);
@@ -635,109 +837,179 @@ static long loadMatchedModules(void)
                 driver->bundlePathLength = module->bundlePathLength;
 
                 // Save the plist, module and bundle.
-                strcpy(driver->plistAddr, module->plistAddr);
+                memcpy(driver->plistAddr, module->plistAddr, module->plistLength);
 
-				if (length != 0)
+				if (size != 0)
+				{
+					// Copy what we have already, and read the rest in place.
+					loaded = min(loaded, size);
+					memcpy(driver->executableAddr, executableAddr, loaded);
+
+					if ((size > loaded) && (ReadThinFatFile((char *)driver->executableAddr + loaded, loaded, size - loaded) != (long)(size - loaded)))
+					{
+						// Drop the module, since the kernel would use a truncated executable as is.
+						error("Failed to read: %s (skipped)\n", gPlatform.KextFileSpec);
+						driverLength = 0;
+					}
+				}
+				else if (length != 0)
 				{
 					memcpy(driver->executableAddr, executableAddr, length);
 				}
 
-                strcpy(driver->bundlePathAddr, module->bundlePath);
-
-                // Add an entry to the memory map.
-				sprintf(segName, "Driver-%lx", (unsigned long)driver);
-				AllocateMemoryRange(segName, driverAddr, driverLength);
+				if (driverLength != 0)
+				{
+					strcpy(driver->bundlePathAddr, module->bundlePath);
+
+					// Add an entry to the memory map.
+					sprintf(segName, "Driver-%lx", (unsigned long)driver);
+					AllocateMemoryRange(segName, driverAddr, driverLength);
+#if MINIMAL_ROOT_KEXT_SET
+					loadedCount++;
+					loadedBytes += driverLength;
+#endif
+				}
             }
+
+			CloseThinFatFile();
         }
+#if MINIMAL_ROOT_KEXT_SET
+		else
+		{
+			// Not needed. Only the plist size is known here, since the executable is never opened.
+			skippedCount++;
+			skippedBytes += module->plistLength;
+		}
+#endif
 
         module = module->nextModule;
     }
 
+#if MINIMAL_ROOT_KEXT_SET
+	verbose("Kexts: %d loaded (%ld bytes), %d skipped (%ld plist bytes, executables not opened)\n",
+			loadedCount, loadedBytes, skippedCount, skippedBytes);
+#endif
+
     return 0;
 }
 
 
 //==============================================================================
+// Returns the FNV-1a hash of a bundle ID (for gModuleHash).
 
-static long matchLibraries(void)
+static uint32_t hashBundleID(const char * bundleID)
+{
+	uint32_t hash = 2166136261UL;
+
+	while (*bundleID)
+	{
+		hash = ((hash ^ (uint8_t)*bundleID++) * 16777619UL);
+	}
+
+	return hash;
+}
+
+
+//==============================================================================
+// Adds a module to the end of the module list, and to gModuleHash. Only the
+// first module with a given bundle ID is hashed (findModule returns that one).
+
+static void addModule(ModulePtr module)
 {
-	// printf("in MatchLibraries()\n");
+	ModulePtr * bucket;
 
-    TagPtr     prop, prop2;
-    ModulePtr  module, module2;
-    long       done;
+	module->nextModule	= 0;
+	module->nextHash	= 0;
+	module->nextWork	= 0;
 
-    do
+	if (gModuleHead == 0)
 	{
-        done = 1;
-        module = gModuleHead;
-        
-        while (module != 0)
-        {
-            if (module->willLoad == 1)
-            {
-                prop = XMLGetProperty(module->dict, kPropOSBundleLibraries);
+		gModuleHead = module;
+	}
+	else
+	{
+		gModuleTail->nextModule = module;
+	}
 
-                if (prop != 0)
-                {
-                    prop = prop->tag;
-
-                    while (prop != 0)
-                    {
-                        module2 = gModuleHead;
-
-                        while (module2 != 0)
-                        {
-                            prop2 = XMLGetProperty(module2->dict, kPropCFBundleIdentifier);
-
-                            if ((prop2 != 0) && (!strcmp(prop->string, prop2->string)))
-                            {
-                                if (module2->willLoad == 0)
-								{
-                                    module2->willLoad = 1;
-								}
-                                break;
-                            }
-                            module2 = module2->nextModule;
-                        }
-                        prop = prop->tagNext;
-                    }
-                }
-                module->willLoad = 2;
-                done = 0;
-            }
-            module = module->nextModule;
-        }
-    }
-    while (!done);
+	gModuleTail = module;
 
-    return 0;
+	if (module->bundleID != 0)
+	{
+		bucket = &gModuleHash[hashBundleID(module->bundleID) & (kModuleHashSize - 1)];
+
+		while (*bucket != 0)
+		{
+			if (strcmp((*bucket)->bundleID, module->bundleID) == 0)
+			{
+				return;
+			}
+
+			bucket = &(*bucket)->nextHash;
+		}
+
+		*bucket = module;
+	}
 }
 
 
 //==============================================================================
 
-#if NOTDEF
-static ModulePtr FindModule(char * name)
+static ModulePtr findModule(const char * bundleID)
 {
-	TagPtr    prop;
-	ModulePtr module = gModuleHead;
+	ModulePtr module = gModuleHash[hashBundleID(bundleID) & (kModuleHashSize - 1)];
 
-	while (module != 0)
+	while ((module != 0) && strcmp(module->bundleID, bundleID))
 	{
-		prop = GetProperty(module->dict, kPropCFBundleIdentifier);
+		module = module->nextHash;
+	}
+
+	return module;
+}
+
+
+//==============================================================================
+// Marks the libraries of each module that will load (willLoad == 1), and their
+// libraries, as loading. Each module is processed once (willLoad is set to 2)
+// and each library is looked up once in gModuleHash, so that the work is linear
+// in the number of library references.
+
+static long matchLibraries(void)
+{
+	ModulePtr	module, work, library;
+	char		* name;
 
-		if ((prop != 0) && !strcmp(name, prop->string))
+	for (module = gModuleHead; module != 0; module = module->nextModule)
+	{
+		if (module->willLoad != 1)
 		{
-			break;
+			continue;
 		}
 
-		module = module->nextModule;
+		module->nextWork = 0;
+
+		for (work = module; work != 0; )
+		{
+			ModulePtr current = work;
+			work = work->nextWork;
+			current->willLoad = 2;
+
+			for (name = current->libraries; (name != 0) && (*name != '\0'); name += strlen(name) + 1)
+			{
+				library = findModule(name);
+
+				// Not yet marked? Then push it on the work list.
+				if ((library != 0) && (library->willLoad == 0))
+				{
+					library->willLoad = 1;
+					library->nextWork = work;
+					work = library;
+				}
+			}
+		}
 	}
-    
-	return module;
+
+	return 0;
 }
-#endif /* NOTDEF */
 
 
 //==============================================================================
@@ -798,13 +1070,32 @@ static bool isLoadableInSafeBoot(char * OSBundleRequired)
 } */
 
 
+//==============================================================================
+// Returns the initial willLoad value for a kext, from its OSBundleRequired value.
+// With MINIMAL_ROOT_KEXT_SET only the kexts required to mount root and to start
+// the console are loaded, plus their libraries (see matchLibraries). The kernel
+// loads the others itself, later on.
+
+static long getWillLoad(const char * required)
+{
+#if MINIMAL_ROOT_KEXT_SET
+	return ((strcmp(required, kOSBundleRequiredRoot) == 0)		||
+			(strcmp(required, kOSBundleRequiredLocalRoot) == 0)	||
+			(strcmp(required, kOSBundleRequiredConsole) == 0));
+#else
+	return 1;
+#endif
+}
+
+
 //==============================================================================
 
 static long parseXML(char * buffer, ModulePtr * module, TagPtr * personalities)
 {
 	long       length, pos = 0;
-	TagPtr     moduleDict, required;
+	TagPtr     moduleDict, required, prop, tag;
 	ModulePtr  tmpModule;
+	char       * library;
   
 	while (1)
 	{
@@ -897,9 +1188,40 @@ static long parseXML(char * buffer, ModulePtr * module, TagPtr * personalities)
 
 	tmpModule->dict = moduleDict;
 
-	// For now, load any module that has OSBundleRequired != "Safe Boot".
+	prop = XMLGetProperty(moduleDict, kPropCFBundleIdentifier);
+	tmpModule->bundleID = ((prop != 0) && (prop->type == kTagTypeString)) ? prop->string : 0;
+
+	prop = XMLGetProperty(moduleDict, kPropCFBundleExecutable);
+	tmpModule->executable = ((prop != 0) && (prop->type == kTagTypeString)) ? prop->string : 0;
+
+	// Convert the keys of the OSBundleLibraries dictionary into a string list.
+	prop = XMLGetProperty(moduleDict, kPropOSBundleLibraries);
+	tmpModule->libraries = 0;
+
+	if ((prop != 0) && (prop->type == kTagTypeDict))
+	{
+		for (length = 1, tag = prop->tag; tag != 0; tag = tag->tagNext)
+		{
+			length += strlen(tag->string) + 1;
+		}
+
+		tmpModule->libraries = library = malloc(length);
+
+		if (library)
+		{
+			for (tag = prop->tag; tag != 0; tag = tag->tagNext)
+			{
+				strcpy(library, tag->string);
+				library += strlen(library) + 1;
+			}
+
+			*library = '\0';
+		}
+	}
 
-	tmpModule->willLoad = 1;
+	// For now, load any module that has OSBundleRequired != "Safe Boot" (see getWillLoad).
+
+	tmpModule->willLoad = getWillLoad(required->string);
 
 	*module = tmpModule;
 
@@ -912,14 +1234,172 @@ static long parseXML(char * buffer, ModulePtr * module, TagPtr * personalities)
 
 
 //==============================================================================
+// Decompresses a kernelcache through a bounded window. Each time the window is
+// full, the new output is passed on to DecodeMachOChunk() (which copies it to
+// the segments) and the last kKernelHistorySize bytes are moved to the start of
+// the window, for the matches that may still refer to them. The decoder itself
+// keeps track of the Adler-32, while the output is still in the cache.
+//
+// Only the first 'loaded' bytes of the file are in memory when we get here. The
+// rest is read (behind it) in chunks of kKernelReadSize, whenever the decoder
+// runs out of input, so that decompression starts right after the first read.
+
+#define kKernelWindowSize	0x100000	// 1 MB (must hold the Mach-O header and load commands).
+#define kKernelHistorySize	0x10000		// 64 KB (the maximum LZVN match distance, LZSS needs 4 KB).
+#define kKernelReadSize		0x100000	// 1 MB
+
+static long decompressKernel(compressed_kernel_header * kernel_header, long loaded, entry_t *rentry, char **raddr, int *rsize)
+{
+	long ret = -1;
+	long count;
+	int status;
+	bool done = false;
+
+	u_int8_t * srcLimit = &kernel_header->data[0] + OSSwapBigToHostInt32(kernel_header->compressedSize);
+
+	u_int32_t windowOffset = 0;	// Uncompressed offset of window[0].
+	u_int32_t length = 0;
+	u_int32_t flushed = 0;
+	u_int32_t uncompressedSize = OSSwapBigToHostInt32(kernel_header->uncompressedSize);
+
+	int (*decode)(DecodeStream *) = decompressLZSS;
 
-long decodeKernel(void *fileLoadBuffer, entry_t *rentry, char **raddr, int *rsize)
+	DecodeStream stream;
+
+	u_int8_t * window = malloc(kKernelWindowSize);
+
+	if (window == NULL)
+	{
+		return -1;
+	}
+
+#if ((MAKE_TARGET_OS & YOSEMITE) == YOSEMITE) // Yosemite and El Capitan
+	if (kernel_header->compressType == OSSwapBigToHostConstInt32('lzvn'))
+	{
+		decode = lzvn_decode_stream;
+	}
+#endif
+
+	bzero(&stream, sizeof(stream));
+
+	stream.adler32	= 1;
+	stream.src		= &kernel_header->data[0];
+	stream.srcEnd	= min((u_int8_t *)kernel_header + loaded, srcLimit);
+	stream.dst		= window;
+	stream.dstStart	= window;
+
+	if ((srcLimit - (u_int8_t *)kernel_header) > kLoadSize)
+	{
+		error("Kernelcache too large!\n");
+		goto cleanup;
+	}
+
+#if DEBUG_DRIVERS
+	uint64_t ioTime = 0, decodeTime = 0, startTime;
+#endif
+
+	while (!done)
+	{
+		stream.dstEnd = window + min(kKernelWindowSize, uncompressedSize - windowOffset);
+#if DEBUG_DRIVERS
+		startTime = rdtsc64();
+#endif
+		status = decode(&stream);
+#if DEBUG_DRIVERS
+		decodeTime += (rdtsc64() - startTime);
+#endif
+
+		if (status == kDecodeError)
+		{
+			error("Kernel decompression failed at offset 0x%x!\n", windowOffset + (stream.dst - window));
+			goto cleanup;
+		}
+
+		if ((status == kDecodeNeedInput) && (stream.srcEnd < srcLimit))
+		{
+#if DEBUG_DRIVERS
+			startTime = rdtsc64();
+#endif
+			// Read the next chunk, right behind the data that we already have.
+			count = ReadThinFatFile((u_int8_t *)kernel_header + loaded, loaded, min(kKernelReadSize, srcLimit - stream.srcEnd));
+#if DEBUG_DRIVERS
+			ioTime += (rdtsc64() - startTime);
+#endif
+			if (count <= 0)
+			{
+				error("Kernelcache read failed at offset 0x%x!\n", loaded);
+				goto cleanup;
+			}
+
+			loaded += count;
+			stream.srcEnd = min((u_int8_t *)kernel_header + loaded, srcLimit);
+
+			continue;
+		}
+
+		length = (stream.dst - window);
+
+		// All input was used, so anything but a full window means that we're done.
+		done = ((status != kDecodeNeedOutput) || ((windowOffset + length) == uncompressedSize));
+
+		if (length > flushed)
+		{
+			if (DecodeMachOChunk(window + flushed, windowOffset + flushed, length - flushed) != 0)
+			{
+				goto cleanup;
+			}
+
+			flushed = length;
+		}
+
+		if (!done)
+		{
+			bcopy(window + length - kKernelHistorySize, window, kKernelHistorySize);
+
+			windowOffset += (length - kKernelHistorySize);
+			stream.dst = window + kKernelHistorySize;
+			flushed = kKernelHistorySize;
+		}
+	}
+
+	if ((windowOffset + length) != uncompressedSize)
+	{
+		error("Size mismatch, is 0x%x but 0x%x is expected!\n", windowOffset + length, uncompressedSize);
+	}
+	else if (OSSwapBigToHostInt32(kernel_header->adler32) != stream.adler32)
+	{
+		printf("Adler mismatch, is 0x%x but 0x%x is expected\n", OSSwapBigToHostInt32(kernel_header->adler32), stream.adler32);
+	}
+	else
+	{
+		ret = DecodeMachOFinish(rentry, raddr, rsize);
+	}
+
+#if DEBUG_DRIVERS
+	if (gPlatform.CPU.TSCFrequency)
+	{
+		printf("Kernelcache: %d ms reading, %d ms decompressing\n", (uint32_t)(ioTime / (gPlatform.CPU.TSCFrequency / 1000)),
+			   (uint32_t)(decodeTime / (gPlatform.CPU.TSCFrequency / 1000)));
+	}
+#endif
+
+cleanup:
+	free(window);
+
+	return ret;
+}
+
+
+//==============================================================================
+
+// Called with the first 'loaded' bytes of the (thin) file at fileLoadBuffer. The
+// rest is read from the file that OpenThinFatFile() left open, if any.
+
+long decodeKernel(void *fileLoadBuffer, long loaded, entry_t *rentry, char **raddr, int *rsize)
 {
 	// return DecodeMachO(binary, rentry, raddr, rsize);
 	long ret;
-	unsigned long len;
 
-	u_int32_t compressedSize, uncompressedSize, size = 0;
 	compressed_kernel_header * kernel_header = (compressed_kernel_header *) fileLoadBuffer;
 
 #if DEBUG_DRIVERS
@@ -959,52 +1439,22 @@ long decodeKernel(void *fileLoadBuffer, entry_t *rentry, char **raddr, int *rsiz
 			return -1;
 		}
 #endif
-		compressedSize = OSSwapBigToHostInt32(kernel_header->compressedSize);
-		uncompressedSize = OSSwapBigToHostInt32(kernel_header->uncompressedSize);
-		fileLoadBuffer = malloc(uncompressedSize);
+		// Decompressed straight into the kernel segments (no full size buffers).
+		ret = decompressKernel(kernel_header, loaded, rentry, raddr, rsize);
 
-#if ((MAKE_TARGET_OS & YOSEMITE) == YOSEMITE) // Yosemite and El Capitan
-		if (kernel_header->compressType == OSSwapBigToHostConstInt32('lzvn'))
-		{
-			void *tmpBuffer = malloc(uncompressedSize);
-			size = lzvn_decode(tmpBuffer, uncompressedSize, &kernel_header->data[0], compressedSize);
-			memcpy(fileLoadBuffer, tmpBuffer, uncompressedSize);
-			free(tmpBuffer);
-		} else
-#endif
-		if (kernel_header->compressType == OSSwapBigToHostConstInt32('lzss'))
-		{
-			size = decompressLZSS((u_int8_t *) fileLoadBuffer, &kernel_header->data[0], compressedSize);
-		}
+		CloseThinFatFile();
 
-		if (uncompressedSize != size)
-        {
-			error("Size mismatch, is 0x%x but 0x%x is expected!\n", size, uncompressedSize);
-			return -1;
-		}
-
-		if (OSSwapBigToHostInt32(kernel_header->adler32) != localAdler32(fileLoadBuffer, uncompressedSize))
-		{
-			printf("Adler mismatch, is 0x%x but 0x%x is expected\n", OSSwapBigToHostInt32(kernel_header->adler32), localAdler32(fileLoadBuffer, uncompressedSize));
-			return -1;
-		}
-	}
-
-	ret = ThinFatFile(&fileLoadBuffer, &len);
-
-	if (ret == 0 && len == 0 && gPlatform.ArchCPUType == CPU_TYPE_X86_64)
-	{
-		gPlatform.ArchCPUType = CPU_TYPE_I386;
-		ret = ThinFatFile(&fileLoadBuffer, &len);
+#if DEBUG_DRIVERS
+		printf("decodeKernel(ret = %d)\n", ret);
+		sleep(5);
+#endif
+		return ret;
 	}
 
-	ret = DecodeMachO(fileLoadBuffer, rentry, raddr, rsize);
+	// Not compressed. The segments are read from disk, straight to their address.
+	ret = DecodeMachOFile(fileLoadBuffer, loaded, rentry, raddr, rsize);
 
-	if (ret < 0 && gPlatform.ArchCPUType == CPU_TYPE_X86_64)
-	{
-		gPlatform.ArchCPUType = CPU_TYPE_I386;
-		ret = DecodeMachO(fileLoadBuffer, rentry, raddr, rsize);
-	}
+	CloseThinFatFile();
 
 #if DEBUG_DRIVERS
 	printf("decodeKernel(ret = %d)\n", ret);
@@ -41,67 +41,184 @@
  */
 
 #include <sl.h>
+#include "boot.h"
 
 #define N			4096	// Size of ring buffer - must be power of 2.
 #define N_MIN_1		4095
 #define F			18		// Upper limit for match_length.
-#define R			N - F
+#define R			(N - F)
 #define THRESHOLD	2		// Encode string into position and length, 
 							// if match_length is greater than this.
 #define NIL			N		// Index for root of binary search trees.
 
 
+// Room required for the fast loop: one flag byte with eight matches, and the
+// slack needed by the word sized match copies.
+#define FAST_INPUT	(1 + (8 * 2))
+#define FAST_OUTPUT	((8 * F) + 4)
+
+typedef u_int32_t __attribute__((may_alias, aligned(1))) lzss_word_t;
+
+
 //==============================================================================
 // Refactoring and bug fix Copyright (c) 2010 by DHP.
+// Made resumable for decodeKernel(), which streams the kernelcache through a
+// bounded output window. All state lives in the DecodeStream.
+//
+// The output itself is used as the ring buffer. Ring index r holds output
+// byte n when (R + n) & N_MIN_1 == r, so ring index i is (r - i) bytes back,
+// or N bytes back when both are equal. Bytes in front of the output are the
+// spaces that the ring buffer is initialised with. Note that this requires
+// the caller to keep at least N bytes of history in front of stream->dst.
 
-int decompressLZSS(u_int8_t * dst, u_int8_t * src, u_int32_t srclen)
+int decompressLZSS(DecodeStream * stream)
 {
-	// Four KB ring buffer with 17 extra bytes added to aid string comparisons.
-	u_int8_t text_buf[N_MIN_1 + F];
-	u_int8_t * dststart = dst;
-	const u_int8_t * srcend = (src + srclen);
+	u_int8_t * src = stream->src;
+	u_int8_t * dst = stream->dst;
+	u_int8_t * sum = dst;
+	const u_int8_t * srcend = stream->srcEnd;
+	const u_int8_t * dststart = stream->dstStart;
+	const u_int8_t * dstend = stream->dstEnd;
 	
-	int r = R;
-	int  i, j, k, c;
-	unsigned int flags = 0;
+	int r, i, j, c, k, status;
+	unsigned int d;
+	unsigned int flags = stream->flags;
 	
-	for (i = 0; i < R; i++)
-	{
-		text_buf[i] = ' ';
-	}
+	r = (R + stream->ringIndex);
+	d = stream->matchDistance;
+	j = stream->matchLength;
 	
-	while (src < srcend)
+	for (;;)
 	{
+		if ((dst - sum) >= kDecodeChecksumSize)
+		{
+			stream->adler32 = Adler32(stream->adler32, sum, (dst - sum));
+			sum = dst;
+		}
+		
+		// Fast loop, taking one flag byte (eight tokens) at a time, for as long
+		// as those tokens cannot run out of input or output, and the current
+		// checksum block is not full.
+		while ((j == 0) && ((flags & 0x200) == 0) && ((srcend - src) >= FAST_INPUT) && ((dstend - dst) >= FAST_OUTPUT) &&
+			   ((dst - sum) < kDecodeChecksumSize))
+		{
+			c = *src++;
+			
+			for (k = 0; k < 8; k++, c >>= 1)
+			{
+				if (c & 1)
+				{
+					*dst++ = *src++;
+					r++;
+					continue;
+				}
+				
+				i = (src[0] | ((src[1] & 0xF0) << 4));
+				j = ((src[1] & 0x0F) + THRESHOLD + 1);
+				src += 2;
+				
+				d = (((r - i - 1) & N_MIN_1) + 1);
+				r += j;
+				
+				if (d > (unsigned int)(dst - dststart))
+				{
+					do
+					{
+						*dst = ((unsigned int)(dst - dststart) < d) ? ' ' : *(dst - d);
+						dst++;
+					} while (--j);
+				}
+				else if (d >= 4)
+				{
+					// Overlapping word copies are fine, as long as a word is never
+					// read before it is written.
+					for (i = 0; i < j; i += 4)
+					{
+						*(lzss_word_t *)(dst + i) = *(const lzss_word_t *)(dst + i - d);
+					}
+					
+					dst += j;
+					j = 0;
+				}
+				else
+				{
+					do
+					{
+						*dst = *(dst - d);
+						dst++;
+					} while (--j);
+				}
+			}
+			
+			flags = 0;
+		}
+		
+		// Copy what is left of the current match.
+		while (j)
+		{
+			if (dst == dstend)
+			{
+				status = kDecodeNeedOutput;
+				goto done;
+			}
+			
+			*dst = ((unsigned int)(dst - dststart) < d) ? ' ' : *(dst - d);
+			dst++;
+			r++;
+			j--;
+		}
+		
 		if (((flags >>= 1) & 0x100) == 0)
 		{
+			if (src == srcend)
+			{
+				status = kDecodeNeedInput;
+				break;
+			}
+			
 			c = *src++;
 			flags = c | 0xFF00;  // Clever use of the high byte.
-        }
+		}
 		
-        if ((src < srcend) && (flags & 1))
+		if (flags & 1)
 		{
-			c = *src++;
-			*dst++ = c;
-			text_buf[r++] = c;
-			r &= N_MIN_1;
+			if ((src == srcend) || (dst == dstend))
+			{
+				status = (src == srcend) ? kDecodeNeedInput : kDecodeNeedOutput;
+				break;
+			}
+			
+			*dst++ = *src++;
+			r++;
 		}
-		else if ((src + 2) <= srcend)
+		else
 		{
+			if ((src + 2) > srcend)
+			{
+				status = kDecodeNeedInput;
+				break;
+			}
+			
 			i = *src++;
 			j = *src++;
-
+			
 			i |= ((j & 0xF0) << 4);
-			j = (j & 0x0F) + THRESHOLD;
-				
-			for (k = 0; k <= j; k++)
-			{
-				c = text_buf[(i + k) & N_MIN_1];
-				*dst++ = c;
-				text_buf[r++] = c;
-				r &= N_MIN_1;
-			}
+			j = (j & 0x0F) + THRESHOLD + 1;
+			d = (((r - i - 1) & N_MIN_1) + 1);
 		}
 	}
-    
-	return dst - dststart;
+	
+	// Token not consumed; shift the flags back so that we see it again.
+	flags <<= 1;
+	
+done:
+	stream->adler32 = Adler32(stream->adler32, sum, (dst - sum));
+	stream->src = src;
+	stream->dst = dst;
+	stream->flags = flags;
+	stream->ringIndex = ((r - R) & N_MIN_1);
+	stream->matchDistance = d;
+	stream->matchLength = j;
+	
+	return status;
 }
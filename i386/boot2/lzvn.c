@@ -31,526 +31,516 @@
  * that I have done, for educational purpose, to improve the readability
  * so that it is understandable for everyone.
  *
+ * Updates:
+ *			- Switch based decoder replaced by a table driven, resumable one.
+ *			- Literals and matches are copied with word sized moves.
+ *			- Fast path with a single decoder for all opcodes with a distance, and no Adler-32 for lzvn_decode().
+ *
  */
 
-#include <stdio.h>
-#include <string.h>
-
 #include <libkern/OSByteOrder.h>
 
-#define DEBUG_STATE_ENABLED			0
+#include "sl.h"
+#include "boot.h"
 
+#define LZVN_DEBUG_STATE_ENABLED			0
 
-#if DEBUG_STATE_ENABLED
+
+#if LZVN_DEBUG_STATE_ENABLED
   #define _LZVN_DEBUG_DUMP(x...)	printf(x)
 #else
   #define _LZVN_DEBUG_DUMP(x...)
 #endif
 
-#define LZVN_0		0
-#define LZVN_1		1
-#define LZVN_2		2
-#define LZVN_3		3
-#define LZVN_4		4
-#define LZVN_5		5
-#define LZVN_6		6
-#define LZVN_7		7
-#define LZVN_8		8
-#define LZVN_9		9
-#define LZVN_10		10
-#define LZVN_11		11
-
-#define CASE_TABLE	127
+// Opcode classes.
+#define SML_D		0	// 2 bytes: literals (0-3), match (3-10) and distance (11 bits).
+#define MED_D		1	// 3 bytes: literals (0-3), match (3-34) and distance (14 bits).
+#define LRG_D		2	// 3 bytes: literals (0-3), match (3-10) and distance (16 bits).
+#define PRE_D		3	// 1 byte:  literals (0-3), match (3-10) and the previous distance.
+#define SML_L		4	// 1 byte:  literals (1-15).
+#define LRG_L		5	// 2 bytes: literals (16-271).
+#define SML_M		6	// 1 byte:  match (1-15) with the previous distance.
+#define LRG_M		7	// 2 bytes: match (16-271) with the previous distance.
+#define NOP			8
+#define EOS			9
+#define UDEF		10
+
+// Slack required, in both buffers, for the word sized copies.
+#define LZVN_COPY_SLACK		16
+
+// Room required, in both buffers, for the fast loop (lrg_l/lrg_m plus slack).
+#define LZVN_FAST_MARGIN	(2 + 271 + LZVN_COPY_SLACK)
+
+static const uint8_t opcodeTable[256] =
+{
+	SML_D, SML_D, SML_D, SML_D, SML_D, SML_D, EOS, LRG_D, SML_D, SML_D, SML_D, SML_D, SML_D, SML_D, NOP, LRG_D,	// 0x00
+	SML_D, SML_D, SML_D, SML_D, SML_D, SML_D, NOP, LRG_D, SML_D, SML_D, SML_D, SML_D, SML_D, SML_D, UDEF, LRG_D,	// 0x10
+	SML_D, SML_D, SML_D, SML_D, SML_D, SML_D, UDEF, LRG_D, SML_D, SML_D, SML_D, SML_D, SML_D, SML_D, UDEF, LRG_D,	// 0x20
+	SML_D, SML_D, SML_D, SML_D, SML_D, SML_D, UDEF, LRG_D, SML_D, SML_D, SML_D, SML_D, SML_D, SML_D, UDEF, LRG_D,	// 0x30
+	SML_D, SML_D, SML_D, SML_D, SML_D, SML_D, PRE_D, LRG_D, SML_D, SML_D, SML_D, SML_D, SML_D, SML_D, PRE_D, LRG_D,	// 0x40
+	SML_D, SML_D, SML_D, SML_D, SML_D, SML_D, PRE_D, LRG_D, SML_D, SML_D, SML_D, SML_D, SML_D, SML_D, PRE_D, LRG_D,	// 0x50
+	SML_D, SML_D, SML_D, SML_D, SML_D, SML_D, PRE_D, LRG_D, SML_D, SML_D, SML_D, SML_D, SML_D, SML_D, PRE_D, LRG_D,	// 0x60
+	UDEF, UDEF, UDEF, UDEF, UDEF, UDEF, UDEF, UDEF, UDEF, UDEF, UDEF, UDEF, UDEF, UDEF, UDEF, UDEF,	// 0x70
+	SML_D, SML_D, SML_D, SML_D, SML_D, SML_D, PRE_D, LRG_D, SML_D, SML_D, SML_D, SML_D, SML_D, SML_D, PRE_D, LRG_D,	// 0x80
+	SML_D, SML_D, SML_D, SML_D, SML_D, SML_D, PRE_D, LRG_D, SML_D, SML_D, SML_D, SML_D, SML_D, SML_D, PRE_D, LRG_D,	// 0x90
+	MED_D, MED_D, MED_D, MED_D, MED_D, MED_D, MED_D, MED_D, MED_D, MED_D, MED_D, MED_D, MED_D, MED_D, MED_D, MED_D,	// 0xA0
+	MED_D, MED_D, MED_D, MED_D, MED_D, MED_D, MED_D, MED_D, MED_D, MED_D, MED_D, MED_D, MED_D, MED_D, MED_D, MED_D,	// 0xB0
+	SML_D, SML_D, SML_D, SML_D, SML_D, SML_D, PRE_D, LRG_D, SML_D, SML_D, SML_D, SML_D, SML_D, SML_D, PRE_D, LRG_D,	// 0xC0
+	UDEF, UDEF, UDEF, UDEF, UDEF, UDEF, UDEF, UDEF, UDEF, UDEF, UDEF, UDEF, UDEF, UDEF, UDEF, UDEF,	// 0xD0
+	LRG_L, SML_L, SML_L, SML_L, SML_L, SML_L, SML_L, SML_L, SML_L, SML_L, SML_L, SML_L, SML_L, SML_L, SML_L, SML_L,	// 0xE0
+	LRG_M, SML_M, SML_M, SML_M, SML_M, SML_M, SML_M, SML_M, SML_M, SML_M, SML_M, SML_M, SML_M, SML_M, SML_M, SML_M	// 0xF0
+};
+
+// The opcodes with a distance (sml_d, med_d, lrg_d and pre_d) make up most of
+// the stream, so the fast path decodes them with the same code, rather than
+// branching on their type. Read as a little endian word, the distance of such
+// an opcode is ((word >> distanceShift) & distanceMask) | ((word & distanceHigh) << 8)
+// and its match length matchBase + ((word >> 8) & matchMask).
+
+typedef struct DistanceOpcode
+{
+	uint8_t		literals;		// 0-3.
+	uint8_t		matchBase;		// Match length, or its base when matchMask is set.
+	uint8_t		length;			// Opcode length in bytes (1-3).
+	uint8_t		matchMask;		// Match length bits in the second byte (med_d).
+	uint16_t	distanceMask;	// Distance bits (0 for pre_d, which uses the previous distance).
+	uint8_t		distanceShift;
+	uint8_t		distanceHigh;	// Distance bits 8-10, in the opcode byte itself (sml_d).
+} DistanceOpcode;
+
+#define IS_MED_D(op)	(((op) & 0xE0) == 0xA0)
+#define IS_PRE_D(op)	(((op) & 7) == 6)
+#define IS_LRG_D(op)	(((op) & 7) == 7)
+
+// Only meaningful for opcodes of one of the four classes.
+#define DISTANCE_OPCODE(op)																	\
+	{																						\
+		IS_MED_D(op) ? (((op) >> 3) & 3) : ((op) >> 6),										\
+		IS_MED_D(op) ? ((((op) & 7) << 2) + 3) : ((((op) >> 3) & 7) + 3),						\
+		IS_MED_D(op) ? 3 : IS_PRE_D(op) ? 1 : IS_LRG_D(op) ? 3 : 2,							\
+		IS_MED_D(op) ? 3 : 0,																\
+		IS_MED_D(op) ? 0x3FFF : IS_PRE_D(op) ? 0 : IS_LRG_D(op) ? 0xFFFF : 0xFF,				\
+		IS_MED_D(op) ? 10 : 8,																\
+		(IS_MED_D(op) || IS_PRE_D(op) || IS_LRG_D(op)) ? 0 : 7								\
+	}
 
-//==============================================================================
+#define DISTANCE_OPCODE_4(op)	DISTANCE_OPCODE(op), DISTANCE_OPCODE((op) + 1), DISTANCE_OPCODE((op) + 2), DISTANCE_OPCODE((op) + 3)
+#define DISTANCE_OPCODE_16(op)	DISTANCE_OPCODE_4(op), DISTANCE_OPCODE_4((op) + 4), DISTANCE_OPCODE_4((op) + 8), DISTANCE_OPCODE_4((op) + 12)
+#define DISTANCE_OPCODE_64(op)	DISTANCE_OPCODE_16(op), DISTANCE_OPCODE_16((op) + 16), DISTANCE_OPCODE_16((op) + 32), DISTANCE_OPCODE_16((op) + 48)
 
-size_t lzvn_decode(void * decompressedData, size_t decompressedSize, void * compressedData, size_t compressedSize)
+static const DistanceOpcode distanceTable[256] =
 {
-	const uint64_t decompBuffer = (const uint64_t)decompressedData;
+	DISTANCE_OPCODE_64(0x00), DISTANCE_OPCODE_64(0x40), DISTANCE_OPCODE_64(0x80), DISTANCE_OPCODE_64(0xC0)
+};
 
-	size_t	length	= 0;															// xor	%rax,%rax
+// Unaligned 32-bit moves. SSE is not an option here, because the booter does not enable it (CR4.OSFXSR).
+typedef uint32_t __attribute__((may_alias, aligned(1))) lzvn_word_t;
 
-	uint64_t compBuffer	= (uint64_t)compressedData;
+#define COPY_8(dst, src)	do { ((lzvn_word_t *)(dst))[0] = ((const lzvn_word_t *)(src))[0]; \
+								 ((lzvn_word_t *)(dst))[1] = ((const lzvn_word_t *)(src))[1]; } while (0)
 
-	uint64_t compBufferPointer	= 0;												// use p(ointer)?
-	uint64_t caseTableIndex	= 0;
-	uint64_t r10			= 0;
-	uint64_t currentLength	= 0;													// xor	%r12,%r12
-	uint64_t r12			= 0;
+#define COPY_16(dst, src)	do { COPY_8((dst), (src)); COPY_8((dst) + 8, (src) + 8); } while (0)
 
-	uint64_t address		= 0;													// ((uint64_t)compBuffer + compBufferPointer)
-	unsigned char byte_data	= 0;
 
-	uint8_t jmpTo			= CASE_TABLE;
+//==============================================================================
 
-	/*
-	 * This jump table was developed by someone using the handle 'MinusZwei'
-	 * over at insanelymac.com
-	 */
-	static short caseTable[ 256 ] =
-	{
-		1,  1,  1,  1,    1,  1,  2,  3,    1,  1,  1,  1,    1,  1,  4,  3,
-		1,  1,  1,  1,    1,  1,  4,  3,    1,  1,  1,  1,    1,  1,  5,  3,
-		1,  1,  1,  1,    1,  1,  5,  3,    1,  1,  1,  1,    1,  1,  5,  3,
-		1,  1,  1,  1,    1,  1,  5,  3,    1,  1,  1,  1,    1,  1,  5,  3,
-		1,  1,  1,  1,    1,  1,  0,  3,    1,  1,  1,  1,    1,  1,  0,  3,
-		1,  1,  1,  1,    1,  1,  0,  3,    1,  1,  1,  1,    1,  1,  0,  3,
-		1,  1,  1,  1,    1,  1,  0,  3,    1,  1,  1,  1,    1,  1,  0,  3,
-		5,  5,  5,  5,    5,  5,  5,  5,    5,  5,  5,  5,    5,  5,  5,  5,
-		1,  1,  1,  1,    1,  1,  0,  3,    1,  1,  1,  1,    1,  1,  0,  3,
-		1,  1,  1,  1,    1,  1,  0,  3,    1,  1,  1,  1,    1,  1,  0,  3,
-		6,  6,  6,  6,    6,  6,  6,  6,    6,  6,  6,  6,    6,  6,  6,  6,
-		6,  6,  6,  6,    6,  6,  6,  6,    6,  6,  6,  6,    6,  6,  6,  6,
-		1,  1,  1,  1,    1,  1,  0,  3,    1,  1,  1,  1,    1,  1,  0,  3,
-		5,  5,  5,  5,    5,  5,  5,  5,    5,  5,  5,  5,    5,  5,  5,  5,
-		7,  8,  8,  8,    8,  8,  8,  8,    8,  8,  8,  8,    8,  8,  8,  8,
-		9, 10, 10, 10,   10, 10, 10, 10,   10, 10, 10, 10,   10, 10, 10, 10
-	};
+int lzvn_decode(void * decompressedData, uint32_t decompressedSize, void * compressedData, uint32_t compressedSize)
+{
+	int status;
+	DecodeStream stream;
 
-	decompressedSize -= 8;															// sub	$0x8,%rsi
+	bzero(&stream, sizeof(stream));
 
-	if (decompressedSize < 8)														// jb	Llzvn_exit
-	{
-		return 0;
-	}
+	stream.flags	= kDecodeNoChecksum;
+	stream.src		= (uint8_t *)compressedData;
+	stream.srcEnd	= (stream.src + compressedSize);
+	stream.dst		= stream.dstStart = (uint8_t *)decompressedData;
+	stream.dstEnd	= (stream.dst + decompressedSize);
 
-	compressedSize = (compBuffer + compressedSize - 8);								// lea	-0x8(%rdx,%rcx,1),%rcx
+	status = lzvn_decode_stream(&stream);
 
-	if (compBuffer > compressedSize)												// cmp	%rcx,%rdx
+	if ((status == kDecodeDone) || (status == kDecodeNeedOutput))
 	{
-		return 0;																	// ja	Llzvn_exit
+		return (int)(stream.dst - stream.dstStart);
 	}
 
-	compBufferPointer = *(uint64_t *)compBuffer;									// mov	(%rdx),%r8
-	caseTableIndex = (compBufferPointer & 255);										// movzbq	(%rdx),%r9
+	_LZVN_DEBUG_DUMP("lzvn_decode(status: %d) error!\n", status);
+
+	return 0;
+}
 
-	do																				// jmpq	*(%rbx,%r9,8)
+
+//==============================================================================
+// Fast path of lzvn_decode_stream(). Decodes whole opcodes until src or dst
+// reaches its limit, which leaves room for the largest opcode, its literals
+// and its match (plus slack) so that only the match distance is checked here.
+// Each opcode class jumps straight to its own label. The four classes with a
+// distance share one, with distanceTable, which leaves the branch predictor
+// far fewer targets to guess, and their matches of up to twelve bytes are
+// copied without a loop. Stops at nop, eos and udef opcodes, which are left
+// to the caller.
+//
+// Returns 0, or kDecodeError for an invalid match distance.
+
+static int lzvn_decode_fast(uint8_t ** srcPtr, uint8_t ** dstPtr, uint8_t * srcLimit, uint8_t * dstLimit, uint8_t * dstStart, uint32_t * distance)
+{
+	static const void * const fastTable[] =
 	{
-		switch (jmpTo)																// our jump table
-		{
-			case CASE_TABLE: /******************************************************/
+		&&distance, &&distance, &&distance, &&distance, &&sml_l, &&lrg_l, &&sml_m, &&lrg_m, &&stop, &&stop, &&stop
+	};
 
-				switch (caseTable[(uint8_t)caseTableIndex])
-				{
-					case 0: _LZVN_DEBUG_DUMP("caseTable[0]\n");
-
-							caseTableIndex >>= 6;									// shr	$0x6,%r9
-							compBuffer = (compBuffer + caseTableIndex + 1);			// lea	0x1(%rdx,%r9,1),%rdx
-						
-							if (compBuffer > compressedSize)						// cmp	%rcx,%rdx
-							{
-								return 0;											// ja	Llzvn_exit
-							}
-						
-							r10 = 56;												// mov	$0x38,%r10
-							r10 &= compBufferPointer;								// and	%r8,%r10
-							compBufferPointer >>= 8;								// shr	$0x8,%r8
-							r10 >>= 3;												// shr	$0x3,%r10
-							r10 += 3;												// add	$0x3,%r10
-						
-							jmpTo = LZVN_10;										// jmp	Llzvn_l10
-							break;
-						
-					case 1:	_LZVN_DEBUG_DUMP("caseTable[1]\n");
-
-							caseTableIndex >>= 6;									// shr	$0x6,%r9
-							compBuffer = (compBuffer + caseTableIndex + 2);			// lea	0x2(%rdx,%r9,1),%rdx
-
-							if (compBuffer > compressedSize)						// cmp	%rcx,%rdx
-							{
-								return 0;											// ja	Llzvn_exit
-							}
-						
-							r12 = compBufferPointer;								// mov	%r8,%r12
-							r12 = OSSwapInt64(r12);									// bswap	%r12
-							r10 = r12;												// mov	%r12,%r10
-							r12 <<= 5;												// shl	$0x5,%r12
-							r10 <<= 2;												// shl	$0x2,%r10
-							r12 >>= 53;												// shr	$0x35,%r12
-							r10 >>= 61;												// shr	$0x3d,%r10
-							compBufferPointer >>= 16;								// shr	$0x10,%r8
-							r10 += 3;												// add	$0x3,%r10
-
-							jmpTo = LZVN_10;										// jmp	Llzvn_l10
-							break;
-
-					case 2: _LZVN_DEBUG_DUMP("caseTable[2]\n");
-
-							return length;
-			
-					case 3: _LZVN_DEBUG_DUMP("caseTable[3]\n");
-
-							caseTableIndex >>= 6;									// shr	$0x6,%r9
-							compBuffer = (compBuffer + caseTableIndex + 3);			// lea	0x3(%rdx,%r9,1),%rdx
-
-							if (compBuffer > compressedSize)						// cmp	%rcx,%rdx
-							{
-								return 0;											// ja	Llzvn_exit
-							}
-						
-							r10 = 56;												// mov	$0x38,%r10
-							r12 = 65535;											// mov	$0xffff,%r12
-							r10 &= compBufferPointer;								// and	%r8,%r10
-							compBufferPointer >>= 8;								// shr	$0x8,%r8
-							r10 >>= 3;												// shr	$0x3,%r10
-							r12 &= compBufferPointer;								// and	%r8,%r12
-							compBufferPointer >>= 16;								// shr	$0x10,%r8
-							r10 += 3;												// add	$0x3,%r10
-						
-							jmpTo = LZVN_10;										// jmp	Llzvn_l10
-							break;
-						
-					case 4:	_LZVN_DEBUG_DUMP("caseTable[4]\n");
-
-							compBuffer += 1;										// add	$0x1,%rdx
-
-							if (compBuffer > compressedSize)						// cmp	%rcx,%rdx
-							{
-								return 0;											// ja	Llzvn_exit
-							}
-						
-							compBufferPointer = *(uint64_t *)compBuffer;			// mov	(%rdx),%r8
-							caseTableIndex = (compBufferPointer & 255);				// movzbq (%rdx),%r9
-						
-							jmpTo = CASE_TABLE;										// continue;
-							break;													// jmpq	*(%rbx,%r9,8)
-
-					case 5: _LZVN_DEBUG_DUMP("caseTable[5]\n");
-
-							return 0;												// Llzvn_table5;
-					
-					case 6: _LZVN_DEBUG_DUMP("caseTable[6]\n");
-
-							caseTableIndex >>= 3;									// shr	$0x3,%r9
-							caseTableIndex &= 3;									// and	$0x3,%r9
-							compBuffer = (compBuffer + caseTableIndex + 3);			// lea	0x3(%rdx,%r9,1),%rdx
-
-							if (compBuffer > compressedSize)						// cmp	%rcx,%rdx
-							{
-								return 0;											// ja	Llzvn_exit
-							}
-						
-							r10 = compBufferPointer;								// mov	%r8,%r10
-							r10 &= 775;												// and	$0x307,%r10
-							compBufferPointer >>= 10;								// shr	$0xa,%r8
-							r12 = (r10 & 255);										// movzbq %r10b,%r12
-							r10 >>= 8;												// shr	$0x8,%r10
-							r12 <<= 2;												// shl	$0x2,%r12
-							r10 |= r12;												// or	%r12,%r10
-							r12 = 16383;											// mov	$0x3fff,%r12
-							r10 += 3;												// add	$0x3,%r10
-							r12 &= compBufferPointer;								// and	%r8,%r12
-							compBufferPointer >>= 14;								// shr	$0xe,%r8
-
-							jmpTo = LZVN_10;										// jmp	Llzvn_l10
-							break;
-						
-					case 7:	_LZVN_DEBUG_DUMP("caseTable[7]\n");
-
-							compBufferPointer >>= 8;								// shr	$0x8,%r8
-							compBufferPointer &= 255;								// and	$0xff,%r8
-							compBufferPointer += 16;								// add	$0x10,%r8
-							compBuffer = (compBuffer + compBufferPointer + 2);		// lea	0x2(%rdx,%r8,1),%rdx
-
-							jmpTo = LZVN_0;											// jmp	Llzvn_l0
-							break;
-						
-					case 8: _LZVN_DEBUG_DUMP("caseTable[8]\n");
-
-							compBufferPointer &= 15;								// and	$0xf,%r8
-							compBuffer = (compBuffer + compBufferPointer + 1);		// lea	0x1(%rdx,%r8,1),%rdx
-						
-							jmpTo = LZVN_0;											// jmp	Llzvn_l0
-							break;
-					
-					case 9:	_LZVN_DEBUG_DUMP("caseTable[9]\n");
-
-							compBuffer += 2;										// add	$0x2,%rdx
-					
-							if (compBuffer > compressedSize)						// cmp	%rcx,%rdx
-							{
-								return 0;											// ja	Llzvn_exit
-							}
-
-							r10 = compBufferPointer;								// mov	%r8,%r10
-							r10 >>= 8;												// shr	$0x8,%r10
-							r10 &= 255;												// and	$0xff,%r10
-							r10 += 16;												// add	$0x10,%r10
-
-							jmpTo = LZVN_11;										// jmp	Llzvn_l11
-							break;
-
-					case 10:_LZVN_DEBUG_DUMP("caseTable[10]\n");
-
-							compBuffer += 1;										// add	$0x1,%rdx
-							
-							if (compBuffer > compressedSize)						// cmp	%rcx,%rdx
-							{
-								return 0;											// ja	Llzvn_exit
-							}
-						
-							r10 = compBufferPointer;								// mov	%r8,%r10
-							r10 &= 15;												// and	$0xf,%r10
-						
-							jmpTo = LZVN_11;										// jmp	Llzvn_l11
-							break;
-#if DEBUG_STATE_ENABLED
-					default:printf("default() caseTableIndex[%d]\n", (uint8_t)caseTableIndex);
-#endif
-				}																	// switch (caseTable[caseTableIndex])
+	uint8_t * src	= *srcPtr;
+	uint8_t * dst	= *dstPtr;
+	uint32_t D		= *distance;
 
-				break;
+	const DistanceOpcode * entry;
+	uint32_t i, L, M, opcode, word;
+	int status = 0;
 
-			case LZVN_0: /**********************************************************/
+#define DISPATCH()	do { if ((src >= srcLimit) || (dst >= dstLimit)) goto stop; opcode = *src; goto *fastTable[opcodeTable[opcode]]; } while (0)
 
-				_LZVN_DEBUG_DUMP("jmpTable(0)\n");
+	DISPATCH();
 
-				if (compBuffer > compressedSize)									// cmp	%rcx,%rdx
-				{
-					return 0;														// ja	Llzvn_exit
-				}
-				
-				currentLength = (length + compBufferPointer);						// lea	(%rax,%r8,1),%r11
-				compBufferPointer = -compBufferPointer;								// neg	%r8
-				
-				if (currentLength > decompressedSize)								// cmp	%rsi,%r11
-				{
-					jmpTo = LZVN_2;													// ja	Llzvn_l2
-					break;
-				}
+distance:
+	entry	= &distanceTable[opcode];
+	word	= *(const lzvn_word_t *)src;
+	L		= entry->literals;
+	M		= (entry->matchBase + ((word >> 8) & entry->matchMask));
+	D		= entry->distanceMask ? (((word >> entry->distanceShift) & entry->distanceMask) | ((word & entry->distanceHigh) << 8)) : D;
+	src		+= entry->length;
 
-				currentLength = (decompBuffer + currentLength);						// lea	(%rdi,%r11,1),%r11
+	// At most three literals.
+	*(lzvn_word_t *)dst = *(const lzvn_word_t *)src;
+	src += L;
+	dst += L;
 
-			case LZVN_1: /**********************************************************/
+	if ((M > 12) || ((D - 1) < 3) || ((D - 1) >= (uint32_t)(dst - dstStart)))
+	{
+		goto match;
+	}
 
-				do																	// Llzvn_l1:
-				{
-					_LZVN_DEBUG_DUMP("jmpTable(1)\n");
+	// Word by word, so distances from four bytes up are fine.
+	((lzvn_word_t *)dst)[0] = ((const lzvn_word_t *)(dst - D))[0];
+	((lzvn_word_t *)dst)[1] = ((const lzvn_word_t *)(dst - D))[1];
+	((lzvn_word_t *)dst)[2] = ((const lzvn_word_t *)(dst - D))[2];
+	dst += M;
+	DISPATCH();
 
-//					address = (compBuffer + compBufferPointer);						// mov	(%rdx,%r8,1),%r9
-//					caseTableIndex = *(uint64_t *)address;
-					caseTableIndex = *(uint64_t *)((uint64_t)compBuffer + compBufferPointer);
+match:
+	// A distance of zero wraps around, and is caught here as well.
+	if ((D - 1) >= (uint32_t)(dst - dstStart))
+	{
+		status = kDecodeError;
+		goto stop;
+	}
 
-//					address = (currentLength + compBufferPointer);					// mov	%r9,(%r11,%r8,1)
-//					*(uint64_t *)address = caseTableIndex;
-					*(uint64_t *)((uint64_t)currentLength + compBufferPointer) = caseTableIndex;
+	if (D >= 16)
+	{
+		for (i = 0; i < M; i += 16)
+		{
+			COPY_16(dst + i, dst + i - D);
+		}
+	}
+	else if (D >= 8)
+	{
+		for (i = 0; i < M; i += 8)
+		{
+			COPY_8(dst + i, dst + i - D);
+		}
+	}
+	else
+	{
+		for (i = 0; i < M; i++)
+		{
+			dst[i] = *(dst + i - D);
+		}
+	}
 
-					compBufferPointer += 8;											// add	$0x8,%r8
+	dst += M;
+	DISPATCH();
 
-				} while ((UINT64_MAX - (compBufferPointer - 8)) >= 8);				// jae	Llzvn_l1
+sml_l:
+	L = (opcode & 15);
+	COPY_16(dst, src + 1);
+	src += (L + 1);
+	dst += L;
+	DISPATCH();
 
-				length = currentLength;												// mov	%r11,%rax
-				length -= decompBuffer;												// sub	%rdi,%rax
-				
-				compBufferPointer = *(uint64_t *)compBuffer;						// mov	(%rdx),%r8
-				caseTableIndex = (compBufferPointer & 255);							// movzbq (%rdx),%r9
+lrg_l:
+	L = (src[1] + 16);
+	src += 2;
 
-				jmpTo = CASE_TABLE;
-				break;																// jmpq	*(%rbx,%r9,8)
+	for (i = 0; i < L; i += 16)
+	{
+		COPY_16(dst + i, src + i);
+	}
 
-			case LZVN_2: /**********************************************************/
+	src += L;
+	dst += L;
+	DISPATCH();
 
-				_LZVN_DEBUG_DUMP("jmpTable(2)\n");
+sml_m:
+	M = (opcode & 15);
+	src++;
+	goto match;
 
-				currentLength = (decompressedSize + 8);								// lea	0x8(%rsi),%r11
+lrg_m:
+	M = (src[1] + 16);
+	src += 2;
+	goto match;
 
-			case LZVN_3: /***********************************************************/
+#undef DISPATCH
 
-				do																	// Llzvn_l3:
-				{
-					_LZVN_DEBUG_DUMP("jmpTable(3)\n");
-
-					address = (compBuffer + compBufferPointer);						// movzbq (%rdx,%r8,1),%r9
-					caseTableIndex = *((uint64_t *)address);
-					caseTableIndex &= 255;
-					
-					address = (decompBuffer + length);								// mov	%r9b,(%rdi,%rax,1)
-					byte_data = (unsigned char)caseTableIndex;
-					memcpy((void *)address, &byte_data, sizeof(byte_data));
-					
-					length += 1;													// add	$0x1,%rax
-					
-					if (currentLength == length)									// cmp	%rax,%r11
-					{
-						return length;												// je	Llzvn_exit2
-					}
-					
-					compBufferPointer += 1;											// add	$0x1,%r8
-					
-				} while ((int64_t)compBufferPointer != 0);							// jne	Llzvn_l3
-				
-				compBufferPointer = *(uint64_t *)compBuffer;						// mov	(%rdx),%r8
-				caseTableIndex = (compBufferPointer & 255);							// movzbq	(%rdx),%r9
+stop:
+	*srcPtr		= src;
+	*dstPtr		= dst;
+	*distance	= D;
 
-				jmpTo = CASE_TABLE;
-				break;																// jmpq	*(%rbx,%r9,8)
+	return status;
+}
 
-			case LZVN_4: /**********************************************************/
 
-				_LZVN_DEBUG_DUMP("jmpTable(4)\n");
+//==============================================================================
+// Resumable decoder for decodeKernel(). Each opcode is decoded into the
+// pending literal/match lengths of the stream, so that we can stop whenever
+// the input runs out or the output window is full, and pick up from there.
+// Copies are done a word at a time, unless we are too close to the end of
+// one of the buffers, in which case we fall back to byte sized copies.
 
-				currentLength = (decompressedSize + 8);								// lea	0x8(%rsi),%r11
+int lzvn_decode_stream(DecodeStream * stream)
+{
+	uint8_t * src		= stream->src;
+	uint8_t * dst		= stream->dst;
+	uint8_t * srcEnd	= stream->srcEnd;
+	uint8_t * dstEnd	= stream->dstEnd;
+	uint8_t * dstStart	= stream->dstStart;
 
-			case LZVN_9: /**********************************************************/
+	uint32_t L	= stream->literalLength;
+	uint32_t M	= stream->matchLength;
+	uint32_t D	= stream->matchDistance;
 
-				do																	// Llzvn_l9:
-				{
-					_LZVN_DEBUG_DUMP("jmpTable(9)\n");
-
-					address = (decompBuffer + compBufferPointer);					// movzbq (%rdi,%r8,1),%r9
-					byte_data = *((unsigned char *)address);
-					caseTableIndex = byte_data;
-					caseTableIndex &= 255;
-					compBufferPointer += 1;											// add	$0x1,%r8
-					
-					address = (decompBuffer + length);								// mov	%r9,(%rdi,%rax,1)
-					byte_data = (unsigned char)caseTableIndex;
-					memcpy((void *)address, &byte_data, sizeof(byte_data));
-					
-					length += 1;													// add	$0x1,%rax
-					
-					if (length == currentLength)									// cmp	%rax,%r11
-					{
-						return length;												// je	Llzvn_exit2
-					}
+	uint8_t * srcFast;
+	uint8_t * dstFast;
+	uint8_t * sum = (stream->flags & kDecodeNoChecksum) ? NULL : dst;
 
-					r10 -= 1;														// sub	$0x1,%r10
-					
-				} while (r10);														// jne	Llzvn_l9
-				
-				compBufferPointer = *(uint64_t *)compBuffer;						// mov	(%rdx),%r8
-				caseTableIndex = (compBufferPointer & 255);							// movzbq	(%rdx),%r9
+	uint32_t i, opcode, distance, available;
+	int status;
 
-				jmpTo = CASE_TABLE;
-				break;																// jmpq	*(%rbx,%r9,8)
+	for (;;)
+	{
+		if (sum && ((dst - sum) >= kDecodeChecksumSize))
+		{
+			stream->adler32 = Adler32(stream->adler32, sum, (dst - sum));
+			sum = dst;
+		}
 
-			case LZVN_5: /**********************************************************/
+		// Fast loop. As long as both buffers have room for the largest opcode, its
+		// literals and its match (plus slack) we can skip all remaining checks,
+		// except for the match distance. It also stops after each checksum block.
+		srcFast = (((uint32_t)(srcEnd - src) > LZVN_FAST_MARGIN) && !(L | M)) ? (srcEnd - LZVN_FAST_MARGIN) : src;
+		dstFast = ((uint32_t)(dstEnd - dst) > LZVN_FAST_MARGIN) ? (dstEnd - LZVN_FAST_MARGIN) : dst;
 
-				do
-				{
-					_LZVN_DEBUG_DUMP("jmpTable(5)\n");
+		if (sum && (dstFast > (sum + kDecodeChecksumSize)))
+		{
+			dstFast = (sum + kDecodeChecksumSize);
+		}
 
-					address = (decompBuffer + compBufferPointer);					// mov	(%rdi,%r8,1),%r9
-					caseTableIndex = *((uint64_t *)address);
-					compBufferPointer += 8;											// add	$0x8,%r8
-					
-					address = (decompBuffer + length);								// mov	%r9,(%rdi,%rax,1)
-					memcpy((void *)address, &caseTableIndex, sizeof(caseTableIndex));
-					
-					length += 8;													// add	$0x8,%rax
-					r10 -= 8;														// sub	$0x8,%r10
-					
-				} while ((r10 + 8) > 8);											// ja	Llzvn_l5
+		if ((src < srcFast) && (dst < dstFast) && (lzvn_decode_fast(&src, &dst, srcFast, dstFast, dstStart, &D) != 0))
+		{
+			status = kDecodeError;
+			goto done;
+		}
 
-				length += r10;														// add	%r10,%rax
-				compBufferPointer = *(uint64_t *)compBuffer;						// mov	(%rdx),%r8
-				caseTableIndex = (compBufferPointer & 255);							// movzbq	(%rdx),%r9
+		if (L)
+		{
+			if (((uint32_t)(srcEnd - src) >= (L + LZVN_COPY_SLACK)) && ((uint32_t)(dstEnd - dst) >= (L + LZVN_COPY_SLACK)))
+			{
+				for (i = 0; i < L; i += 16)
+				{
+					COPY_16(dst + i, src + i);
+				}
 
-				jmpTo = CASE_TABLE;
-				break;																// jmpq	*(%rbx,%r9,8)
+				src += L;
+				dst += L;
+				L = 0;
+			}
+			else
+			{
+				// Literal bytes (may be split over several input chunks).
+				while (L)
+				{
+					if ((src == srcEnd) || (dst == dstEnd))
+					{
+						status = (src == srcEnd) ? kDecodeNeedInput : kDecodeNeedOutput;
+						goto done;
+					}
 
-			case LZVN_10: /*********************************************************/
+					*dst++ = *src++;
+					L--;
+				}
+			}
+		}
 
-				_LZVN_DEBUG_DUMP("jmpTable(10)\n");
+		if (M)
+		{
+			if ((D == 0) || (D > (uint32_t)(dst - dstStart)))
+			{
+				status = kDecodeError;
+				goto done;
+			}
 
-				currentLength = (length + caseTableIndex);							// lea	(%rax,%r9,1),%r11
-				currentLength += r10;												// add	%r10,%r11
+			if ((uint32_t)(dstEnd - dst) >= (M + LZVN_COPY_SLACK))
+			{
+				distance = D;
 
-				if (currentLength < decompressedSize)								// cmp	%rsi,%r11 (block_end: jae	Llzvn_l8)
+				if (distance < 8)
 				{
-					address = decompBuffer + length;								// mov	%r8,(%rdi,%rax,1)
-					memcpy((void *)address, &compBufferPointer, sizeof(compBufferPointer));
-						
-					length += caseTableIndex;										// add	%r9,%rax
-					compBufferPointer = length;										// mov	%rax,%r8
-						
-					if (compBufferPointer < r12)									// jb	Llzvn_exit
+					// Short distances repeat a pattern, so after writing out the first
+					// bytes by hand we can continue with a multiple of the distance.
+					while (distance < 8)
 					{
-						return 0;
+						distance += D;
 					}
 
-					compBufferPointer -= r12;										// sub	%r12,%r8
-
-					if (r12 < 8)													// cmp	$0x8,%r12
+					for (i = (distance - D); i && M; i--, M--)
 					{
-						jmpTo = LZVN_4;												// jb	Llzvn_l4
-						break;
+						*dst = *(dst - D);
+						dst++;
 					}
-
-					jmpTo = LZVN_5;													// jmpq	*(%rbx,%r9,8)
-					break;
 				}
 
-			case LZVN_8: /**********************************************************/
-
-				_LZVN_DEBUG_DUMP("jmpTable(8)\n");
-
-				if (caseTableIndex == 0)											// test	%r9,%r9
+				if (distance >= 16)
 				{
-					jmpTo = LZVN_7;													// jmpq	*(%rbx,%r9,8)
-					break;
+					for (i = 0; i < M; i += 16)
+					{
+						COPY_16(dst + i, dst + i - distance);
+					}
+				}
+				else
+				{
+					for (i = 0; i < M; i += 8)
+					{
+						COPY_8(dst + i, dst + i - distance);
+					}
 				}
 
-				currentLength = (decompressedSize + 8);								// lea	0x8(%rsi),%r11
-
-			case LZVN_6: /**********************************************************/
-
+				dst += M;
+				M = 0;
+			}
+			else
+			{
+				// Match bytes (overlapping copies are byte sequential).
 				do
 				{
-					_LZVN_DEBUG_DUMP("jmpTable(6)\n");
-
-					address = (decompBuffer + length);								// mov	%r8b,(%rdi,%rax,1)
-					byte_data = (unsigned char)(compBufferPointer & 255);
-					memcpy((void *)address, &byte_data, sizeof(byte_data));
-					length += 1;													// add	$0x1,%rax
-						
-					if (length == currentLength)									// cmp	%rax,%r11
+					if (dst == dstEnd)
 					{
-						return length;												// je	Llzvn_exit2
+						status = kDecodeNeedOutput;
+						goto done;
 					}
-						
-					compBufferPointer >>= 8;										// shr	$0x8,%r8
-					caseTableIndex -= 1;											// sub	$0x1,%r9
-						
-				} while (caseTableIndex != 1);										// jne	Llzvn_l6
 
-			case LZVN_7: /**********************************************************/
+					*dst = *(dst - D);
+					dst++;
+				} while (--M);
+			}
+		}
 
-				_LZVN_DEBUG_DUMP("jmpTable(7)\n");
+		// Next opcode. Only consumed once all of its bytes are available.
+		available = (srcEnd - src);
 
-				compBufferPointer = length;											// mov	%rax,%r8
-				compBufferPointer -= r12;											// sub	%r12,%r8
+		if (available < 3)
+		{
+			if (available == 0)
+			{
+				status = kDecodeNeedInput;
+				break;
+			}
 
-				if (compBufferPointer < r12)										// jb	Llzvn_exit
-				{
-					return 0;
-				}
+			opcode = opcodeTable[src[0]];
+
+			if ((available == 1) ? ((opcode == SML_D) || (opcode == LRG_L) || (opcode == LRG_M) || (opcode == MED_D) || (opcode == LRG_D))
+								 : ((opcode == MED_D) || (opcode == LRG_D)))
+			{
+				status = kDecodeNeedInput;
+				break;
+			}
+		}
 
-				jmpTo = LZVN_4;
-				break;																// jmpq	*(%rbx,%r9,8)
-	
-			case LZVN_11: /*********************************************************/
+		opcode = src[0];
 
-				_LZVN_DEBUG_DUMP("jmpTable(11)\n");
+		switch (opcodeTable[opcode])
+		{
+			case SML_D:
+				L = (opcode >> 6);
+				M = (((opcode >> 3) & 7) + 3);
+				D = (((opcode & 7) << 8) | src[1]);
+				src += 2;
+				break;
 
-				compBufferPointer = length;											// mov	%rax,%r8
-				compBufferPointer -= r12;											// sub	%r12,%r8
-				currentLength = (length + r10);										// lea	(%rax,%r10,1),%r11
-				
-				if (currentLength < decompressedSize)								// cmp	%rsi,%r11
-				{
-					if (r12 >= 8)													// cmp	$0x8,%r12
-					{
-						jmpTo = LZVN_5;												// jae	Llzvn_l5
-						break;
-					}
-				}
-				
-				jmpTo = LZVN_4;														// jmp	Llzvn_l4
+			case MED_D:
+				L = ((opcode >> 3) & 3);
+				M = ((((opcode & 7) << 2) | (src[1] & 3)) + 3);
+				D = ((src[1] >> 2) | (src[2] << 6));
+				src += 3;
 				break;
-		}																			// switch (jmpq)
 
-	} while (1);
+			case LRG_D:
+				L = (opcode >> 6);
+				M = (((opcode >> 3) & 7) + 3);
+				D = (src[1] | (src[2] << 8));
+				src += 3;
+				break;
 
-	return 0;
+			case PRE_D:
+				L = (opcode >> 6);
+				M = (((opcode >> 3) & 7) + 3);
+				src++;
+				break;
+
+			case SML_L:
+				L = (opcode & 15);
+				src++;
+				break;
+
+			case LRG_L:
+				L = (src[1] + 16);
+				src += 2;
+				break;
+
+			case SML_M:
+				M = (opcode & 15);
+				src++;
+				break;
+
+			case LRG_M:
+				M = (src[1] + 16);
+				src += 2;
+				break;
+
+			case NOP:
+				src++;
+				break;
+
+			case EOS:
+				status = kDecodeDone;
+				goto done;
+
+			default:
+				status = kDecodeError;
+				goto done;
+		}
+	}
+
+done:
+	if (sum)
+	{
+		stream->adler32		= Adler32(stream->adler32, sum, (dst - sum));
+	}
+
+	stream->src				= src;
+	stream->dst				= dst;
+	stream->literalLength	= L;
+	stream->matchLength		= M;
+	stream->matchDistance	= D;
+
+	return status;
 }
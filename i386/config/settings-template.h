@@ -41,6 +41,10 @@
  *			- DYNAMIC_RAM_OVERRIDE_SIZES renamed to  STATIC_RAM_OVERRIDE_SIZES
  *			- DYNAMIC_RAM_OVERRIDE_FREQUENCY renamed to STATIC_RAM_OVERRIDE_FREQUENCY
  *			- PATCH_XCPI_SCOPE_MSRS renamed to PATCH_XCPM_SCOPE_MSRS
+ *			- LOAD_KERNEL_PATCHES_PLIST added.
+ *			- PATCH_LOAD_EXTRA_KEXTS now also works with a prelinkedkernel.
+ *			- KEXT_INDEX_SUPPORT added.
+ *			- MINIMAL_ROOT_KEXT_SET added.
  */
 
 
@@ -316,6 +320,10 @@
 
 #define LEGACY_BIOS_READ_SUPPORT			0	// Set to 0 by default. Change this to 1 for crappy old BIOSes.
 
+#define EDD3_FLAT_READ_SUPPORT				0	// Set to 0 by default. Change this to 1 to read large blocks straight into their destination
+												// (EDD 3.0 BIOS). Note: the one-time probe of a BIOS that ignores the flat address
+												// still writes one sector at FFFF:FFFF (1 MB + 64 KB) before it is rejected.
+
 #if RECOVERY_HD_SUPPORT
 	#define CORE_STORAGE_SUPPORT			1	// Set to 1 by default since booting from a 'Recovery HD' partition may requires us to skip
 												// (encrypted) CoreStorage partitions.
@@ -332,6 +340,14 @@
 //------------------------------------------------------------- DRIVERS.C -------------------------------------------------------------------
 
 
+#define KEXT_INDEX_SUPPORT					0	// Set to 0 by default. Change this to 1 to use /Extra/Extensions.index (made by
+												// util/kextindex) instead of parsing the Info.plist of each kext, when the
+												// kernelcache cannot be used. Outdated folders are still walked.
+
+#define MINIMAL_ROOT_KEXT_SET				0	// Set to 0 by default. Change this to 1 to load only the kexts with OSBundleRequired
+												// set to Root, Local-Root or Console (plus their libraries) when the kernelcache
+												// is not used. The kernel loads the other kexts itself.
+
 #define DEBUG_DRIVERS						0	// Set to 0 by default. Change it to 1 when things don't seem to work for you.
 
 
@@ -460,11 +476,15 @@
 
 #define XCPM_SCOPE_MSRS_TARGET_UINT64			0x00000002000000E2ULL
 
-#define PATCH_LOAD_EXTRA_KEXTS					0	// Set to 0 by default.
+#define PATCH_LOAD_EXTRA_KEXTS					0	// Set to 0 by default. Change this to 1 to load the kexts from /Extra/Extensions
+													// on top of the prelinkedkernel (without walking /System/Library/Extensions).
 
 #define READ_STARTUP_EXTENSIONS_TARGET_UINT64	0xe805eb00000025e8ULL // e825000000eb05e8 revered in HexEdit
 #define READ_STARTUP_EXTENSIONS_PATCH_UINT64	0xe8909000000025e8ULL
 
+#define LOAD_KERNEL_PATCHES_PLIST				0	// Set to 0 by default. Change this to 1 to apply the patches from:
+													// /Extra/KernelPatches.plist (see libsaio/load.c for the format).
+
 
 //-------------------------------------------------------------- PLATFORM.C ----------------------------------------------------------------
 
@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 1995-2004 Mark Adler.
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ *
+ * Updates:
+ *			- Replaces Adler32() from boot.c and localAdler32() from drivers.c.
+ *
+ */
+
+
+#include "libsa.h"
+
+#define BASE	65521UL	// Largest prime smaller than 65536.
+#define NMAX	5552	// Largest n such that 255n(n+1)/2 + (n+1)(BASE-1) <= 2^32-1.
+
+#define DO1(buf, i)		{ s1 += buf[i]; s2 += s1; }
+#define DO2(buf, i)		DO1(buf, i); DO1(buf, i + 1);
+#define DO4(buf, i)		DO2(buf, i); DO2(buf, i + 2);
+#define DO8(buf, i)		DO4(buf, i); DO4(buf, i + 4);
+#define DO16(buf)		DO8(buf, 0); DO8(buf, 8);
+
+
+//==========================================================================
+// Pass 1 as 'adler' for a new checksum, or the previous result to continue
+// one. The result is in host byte order.
+
+uint32_t Adler32(uint32_t adler, const void *buf, size_t size)
+{
+	const uint8_t *p = buf;
+
+	uint32_t s1 = (adler & 0xFFFF);
+	uint32_t s2 = (adler >> 16);
+	uint32_t n;
+
+	while (size)
+	{
+		n = (size < NMAX) ? size : NMAX;
+		size -= n;
+
+		// The modulo is taken once per NMAX bytes, not per byte.
+		while (n >= 16)
+		{
+			DO16(p);
+			p += 16;
+			n -= 16;
+		}
+
+		while (n--)
+		{
+			s1 += *p++;
+			s2 += s1;
+		}
+
+		s1 %= BASE;
+		s2 %= BASE;
+	}
+
+	return ((s2 << 16) | s1);
+}
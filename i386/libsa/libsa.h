@@ -39,6 +39,12 @@
 #include "../config/settings.h"
 
 
+/*
+ * adler32.c
+ */
+extern uint32_t Adler32(uint32_t adler, const void *buf, size_t size);
+
+
 /*
  * boot.c
  */
@@ -432,6 +432,48 @@ int ebiosread(int dev, unsigned long long sec, int count)
 }
 
 
+//==============================================================================
+// EDD 3.0 version of ebiosread() that uses the 64-bit flat buffer address,
+// so that the sectors land in buffer instead of in the track buffer. There
+// are no retries, the caller falls back to ebiosread() on errors.
+
+int ebiosreadflat(int dev, unsigned long long sec, int count, void * buffer)
+{
+	static struct
+	{
+		unsigned char  size;
+		unsigned char  reserved;
+		unsigned char  numblocks;
+		unsigned char  reserved2;
+		unsigned short bufferOffset;
+		unsigned short bufferSegment;
+		unsigned long  long startblock;
+		unsigned long  long flatAddress;
+	} addrpacket __attribute__((aligned(16))) = {0};
+	addrpacket.size = sizeof(addrpacket);
+
+	bb.intno   = 0x13;
+	bb.eax.r.h = 0x42;
+	bb.edx.r.l = dev;
+	bb.esi.rr  = NORMALIZED_OFFSET((unsigned)&addrpacket);
+	bb.ds      = NORMALIZED_SEGMENT((unsigned)&addrpacket);
+	addrpacket.reserved = addrpacket.reserved2 = 0;
+	addrpacket.numblocks     = count;
+	addrpacket.bufferOffset  = 0xFFFF;	// FFFF:FFFF selects flatAddress.
+	addrpacket.bufferSegment = 0xFFFF;
+	addrpacket.startblock    = sec;
+	addrpacket.flatAddress   = vtop((unsigned long)buffer);
+	bios(&bb);
+
+	if (bb.flags.cf == 0)
+	{
+		bb.eax.r.h = 0;
+	}
+
+	return bb.eax.r.h;
+}
+
+
 //==============================================================================
 
 void putc(int ch)
@@ -562,6 +604,7 @@ int get_drive_info(int drive, struct driveInfo *dp)
     if ((bb.ebx.rr == 0xaa55) && (bb.flags.cf == 0))
 	{
         dp->uses_ebios = bb.ecx.r.l; // Get flags for supported operations.
+        dp->edd_version = bb.eax.r.h; // 0x30 for EDD 3.0
 	}
 
     if (dp->uses_ebios & (EBIOS_ENHANCED_DRIVE_INFO | EBIOS_LOCKING_ACCESS | EBIOS_FIXED_DISK_ACCESS))
@@ -25,6 +25,11 @@
  *  Copyright (c) 2000 Apple Computer, Inc.
  *
  *  DRI: Josh de Cesare
+ *
+ *  Updates:
+ *			- Open addressed hash index and LRU list replace the linear scans in CacheRead.
+ *			- Range cache: reads of any offset and length are served from cached pages.
+ *			- Pages are keyed per volume and share one buffer, switching volumes no longer flushes it.
  */
 
 #include <sl.h>
@@ -32,25 +37,36 @@
 
 typedef struct CacheEntry {
   CICell    ih;
-  long      time;
   long long offset;
+  short     prev;		// Toward the most recently used entry.
+  short     next;		// Toward the least recently used entry.
 } CacheEntry;
 
 #define kCacheSize            (0x100000)
-#define kCacheMinBlockSize    (0x200)
-#define kCacheMaxBlockSize    (0x4000)
-#define kCacheMaxEntries      (kCacheSize / kCacheMinBlockSize)
+#define kCachePageShift       (12)
+#define kCachePageSize        (1 << kCachePageShift)
+#define kCacheMaxEntries      (kCacheSize / kCachePageSize)
+
+// Twice the number of entries keeps the load factor of the hash index at or below 0.5
+#define kCacheHashBits        (9)
+#define kCacheHashSize        (1 << kCacheHashBits)
+#define kCacheHashMask        (kCacheHashSize - 1)
+
+#define kCacheNil             (-1)
 
-static CICell     gCacheIH;
-static long       gCacheBlockSize;
-static long       gCacheNumEntries;
-static long       gCacheTime;
+static bool       gCacheReady;
+static long       gCacheUsedEntries;
+static short      gCacheFree;		// Entries released by CacheFlush (linked through next).
+static short      gCacheHead;		// Most recently used entry.
+static short      gCacheTail;		// Least recently used entry (next to evict).
 
 #ifdef __i386__
 	static CacheEntry *gCacheEntries;
+	static short      *gCacheHash;
 	static char       *gCacheBuffer;
 #else
 	static CacheEntry gCacheEntries[kCacheMaxEntries];
+	static short      gCacheHash[kCacheHashSize];
 	static char       gCacheBuffer[kCacheSize];
 #endif
 
@@ -60,142 +76,339 @@ static long       gCacheTime;
 	unsigned long     gCacheEvicts;
 #endif
 
-void CacheReset()
+
+//==============================================================================
+// Fibonacci hash of the page number and the volume reference.
+
+static inline unsigned long CacheHash(CICell ih, long long offset)
 {
-    gCacheIH = NULL;
+	uint32_t key = (uint32_t)(offset >> kCachePageShift) ^ (uint32_t)((unsigned long)ih >> 4);
+
+	return (uint32_t)(key * 2654435761U) >> (32 - kCacheHashBits);
 }
 
-void CacheInit( CICell ih, long blockSize )
+
+//==============================================================================
+// Returns the entry holding (ih, offset) or kCacheNil. The index of the matching,
+// or the first free, hash slot is stored in slot.
+
+static short CacheLookup(CICell ih, long long offset, unsigned long * slot)
 {
-#ifdef __i386__
-    if ((ih == gCacheIH) && (blockSize == gCacheBlockSize))
+	short cnt;
+	unsigned long index = CacheHash(ih, offset);
+
+	while ((cnt = gCacheHash[index]) != kCacheNil)
 	{
-        return;
+		if ((gCacheEntries[cnt].offset == offset) && (gCacheEntries[cnt].ih == ih))
+		{
+			break;
+		}
+
+		index = (index + 1) & kCacheHashMask;
 	}
-#endif
 
-    if ((blockSize  < kCacheMinBlockSize) || (blockSize >= kCacheMaxBlockSize))
+	*slot = index;
+
+	return cnt;
+}
+
+
+//==============================================================================
+// Empties a hash slot and shifts the rest of its probe chain back (no tombstones).
+
+static void CacheHashRemove(unsigned long hole)
+{
+	short cnt;
+	unsigned long home, index = hole;
+
+	gCacheHash[hole] = kCacheNil;
+
+	while (1)
+	{
+		index = (index + 1) & kCacheHashMask;
+
+		if ((cnt = gCacheHash[index]) == kCacheNil)
+		{
+			return;
+		}
+
+		home = CacheHash(gCacheEntries[cnt].ih, gCacheEntries[cnt].offset);
+
+		// Move the entry into the hole unless its home slot lies between the two.
+		if (((index - home) & kCacheHashMask) >= ((index - hole) & kCacheHashMask))
+		{
+			gCacheHash[hole] = cnt;
+			gCacheHash[index] = kCacheNil;
+			hole = index;
+		}
+	}
+}
+
+
+//==============================================================================
+
+static void CacheUnlink(short cnt)
+{
+	CacheEntry *entry = &gCacheEntries[cnt];
+
+	if (entry->prev != kCacheNil)
+	{
+		gCacheEntries[entry->prev].next = entry->next;
+	}
+	else
+	{
+		gCacheHead = entry->next;
+	}
+
+	if (entry->next != kCacheNil)
+	{
+		gCacheEntries[entry->next].prev = entry->prev;
+	}
+	else
+	{
+		gCacheTail = entry->prev;
+	}
+}
+
+
+//==============================================================================
+
+static void CachePushFront(short cnt)
+{
+	CacheEntry *entry = &gCacheEntries[cnt];
+
+	entry->prev = kCacheNil;
+	entry->next = gCacheHead;
+
+	if (gCacheHead != kCacheNil)
+	{
+		gCacheEntries[gCacheHead].prev = cnt;
+	}
+	else
+	{
+		gCacheTail = cnt;
+	}
+
+	gCacheHead = cnt;
+}
+
+
+//==============================================================================
+// Drops all cached pages of one volume, or of all volumes when ih is NULL.
+// Called when a volume reference is freed (its address may be reused).
+
+void CacheFlush(CICell ih)
+{
+	short cnt, next;
+	unsigned long slot;
+
+	if (!gCacheReady)
+	{
+		return;
+	}
+
+	for (cnt = gCacheHead; cnt != kCacheNil; cnt = next)
+	{
+		next = gCacheEntries[cnt].next;
+
+		if ((ih == NULL) || (gCacheEntries[cnt].ih == ih))
+		{
+			CacheLookup(gCacheEntries[cnt].ih, gCacheEntries[cnt].offset, &slot);
+			CacheHashRemove(slot);
+			CacheUnlink(cnt);
+
+			gCacheEntries[cnt].next = gCacheFree;
+			gCacheFree = cnt;
+		}
+	}
+}
+
+
+//==============================================================================
+
+void CacheReset()
+{
+	CacheFlush(NULL);
+}
+
+
+//==============================================================================
+// Sets up the cache once. Every volume shares the same pages, so there is
+// nothing to do when the file system code moves on to another volume.
+
+void CacheInit(void)
+{
+    if (gCacheReady)
 	{
         return;
 	}
 
-    gCacheBlockSize = blockSize;
-    gCacheNumEntries = kCacheSize / gCacheBlockSize;
-    gCacheTime = 0;
-    
+#ifdef __i386__
+    gCacheBuffer = (char *) malloc(kCacheSize);
+    gCacheEntries = (CacheEntry *) malloc(kCacheMaxEntries * sizeof(CacheEntry));
+    gCacheHash = (short *) malloc(kCacheHashSize * sizeof(short));
+
+    if (!gCacheBuffer || !gCacheEntries || !gCacheHash)
+    {
+        return;  // cache stays disabled
+    }
+#endif
+
+    gCacheUsedEntries = 0;
+    gCacheFree = gCacheHead = gCacheTail = kCacheNil;
+
 #if CACHE_STATS
     gCacheHits		= 0;
     gCacheMisses	= 0;
     gCacheEvicts	= 0;
 #endif
 
-    gCacheIH = ih;
+    // All bits set makes every slot kCacheNil.
+    memset(gCacheHash, 0xff, kCacheHashSize * sizeof(short));
 
-#ifdef __i386__
-    if (!gCacheBuffer)
+    gCacheReady = true;
+}
+
+
+//==============================================================================
+// Claims an entry for the page at (ih, offset) and makes it the most recently
+// used one. The caller fills the page buffer.
+
+static short CacheInsert(CICell ih, long long offset)
+{
+	short cnt;
+	unsigned long slot;
+
+	if (gCacheFree != kCacheNil)
 	{
-		gCacheBuffer = (char *) malloc(kCacheSize);
+		// Reuse a flushed entry.
+		cnt = gCacheFree;
+		gCacheFree = gCacheEntries[cnt].next;
 	}
-
-    if (!gCacheEntries)
+	else if (gCacheUsedEntries < kCacheMaxEntries)
 	{
-		gCacheEntries = (CacheEntry *) malloc(kCacheMaxEntries * sizeof(CacheEntry));
+		// Use the next free entry.
+		cnt = gCacheUsedEntries++;
 	}
-
-    if (!gCacheBuffer || !gCacheEntries)
-    {
-        gCacheIH = 0;  // invalidate cache
-        return;
-    }
+	else
+	{
+		// No free entry left, recycle the least recently used one.
+		cnt = gCacheTail;
+		CacheLookup(gCacheEntries[cnt].ih, gCacheEntries[cnt].offset, &slot);
+		CacheHashRemove(slot);
+		CacheUnlink(cnt);
+#if CACHE_STATS
+		gCacheEvicts++;
 #endif
+	}
+
+	// Find the free slot for the new key (after the removal shifted the chains).
+	CacheLookup(ih, offset, &slot);
 
-    bzero(gCacheEntries, kCacheMaxEntries * sizeof(CacheEntry));
+	gCacheEntries[cnt].ih = ih;
+	gCacheEntries[cnt].offset = offset;
+	gCacheHash[slot] = cnt;
+	CachePushFront(cnt);
+
+	return cnt;
 }
 
+
+//==============================================================================
+// Reads length bytes at offset. With cache set the request is split into
+// pages of kCachePageSize bytes: cached pages are copied, runs of missing
+// whole pages are read straight into the caller's buffer and then cached,
+// and partially covered missing pages are read into the cache first.
+
 long CacheRead(CICell ih, char * buffer, long long offset, long length, long cache)
 {
-    long cnt, oldestEntry = 0, oldestTime, loadCache = 0;
-    CacheEntry *entry;
+    short cnt;
+    long pageOffset, readSize, pages;
+    long long page, end;
+    unsigned long slot;
 
-    // See if the data can be cached.
-    if (cache && (gCacheIH == ih) && (length == gCacheBlockSize))
+    if (!cache || !gCacheReady)
 	{
-        // Look for the data in the cache.
-        for (cnt = 0; cnt < gCacheNumEntries; cnt++)
+        Seek(ih, offset);
+        Read(ih, (long)buffer, length);
+
+        return length;
+	}
+
+    end = offset + length;
+
+    while (offset < end)
+	{
+        page = offset & ~((long long)kCachePageSize - 1);
+        pageOffset = (long)(offset - page);
+        readSize = kCachePageSize - pageOffset;
+
+        if (readSize > (end - offset))
 		{
-            entry = &gCacheEntries[cnt];
+            readSize = (long)(end - offset);
+		}
 
-            if ((entry->ih == ih) && (entry->offset == offset))
-			{
-                entry->time = ++gCacheTime;
-                break;
-            }
-        }
+        // Look for the page in the cache.
+        cnt = CacheLookup(ih, page, &slot);
 
-        // If the data was found copy it to the caller.
-        if (cnt != gCacheNumEntries)
+        if (cnt != kCacheNil)
 		{
-            bcopy(gCacheBuffer + cnt * gCacheBlockSize, buffer, gCacheBlockSize);
+            if (cnt != gCacheHead)
+			{
+				CacheUnlink(cnt);
+				CachePushFront(cnt);
+			}
 #if CACHE_STATS
             gCacheHits++;
 #endif
-            return gCacheBlockSize;
-        }
+		}
+        else if (readSize == kCachePageSize)
+		{
+            // Gather the run of whole, uncached pages and read it in one go.
+            for (pages = 1; (offset + (pages + 1) * kCachePageSize) <= end; pages++)
+			{
+                if (CacheLookup(ih, offset + pages * kCachePageSize, &slot) != kCacheNil)
+				{
+                    break;
+				}
+			}
 
-        // Could not find the data in the cache.
-        loadCache = 1;
-    }
+            readSize = pages * kCachePageSize;
 
-    // Read the data from the disk.
-    Seek(ih, offset);
-    Read(ih, (long)buffer, length);
+            Seek(ih, offset);
+            Read(ih, (long)buffer, readSize);
 
+            for (pageOffset = 0; pageOffset < readSize; pageOffset += kCachePageSize)
+			{
+                cnt = CacheInsert(ih, offset + pageOffset);
+                bcopy(buffer + pageOffset, gCacheBuffer + cnt * kCachePageSize, kCachePageSize);
 #if CACHE_STATS
-    if (cache)
-	{
-		gCacheMisses++;
-	}
+                gCacheMisses++;
 #endif
+			}
 
-    // Put the data from the disk in the cache if needed.
-    if (loadCache)
-	{
-        // Find a free entry.
-        oldestTime = gCacheTime;
+            offset += readSize;
+            buffer += readSize;
 
-        for (cnt = 0; cnt < gCacheNumEntries; cnt++)
+            continue;
+		}
+        else
 		{
-            entry = &gCacheEntries[cnt];
-
-            // Found a free entry.
-            if (entry->ih == 0)
-			{
-				break;
-			}
-        
-            if (entry->time < oldestTime)
-			{
-                oldestTime = entry->time;
-                oldestEntry = cnt;
-            }
-        }
+            // Partially covered page, load all of it into the cache.
+            cnt = CacheInsert(ih, page);
 
-        // If no free entry was found, use the oldest.
-        if (cnt == gCacheNumEntries)
-		{
-            cnt = oldestEntry;
+            Seek(ih, page);
+            Read(ih, (long)(gCacheBuffer + cnt * kCachePageSize), kCachePageSize);
 #if CACHE_STATS
-            gCacheEvicts++;
+            gCacheMisses++;
 #endif
-        }
-
-        // Copy the data from disk to the new entry.
-        entry = &gCacheEntries[cnt];
-        entry->ih = ih;
-        entry->time = ++gCacheTime;
-        entry->offset = offset;
-        bcopy(buffer, gCacheBuffer + cnt * gCacheBlockSize, gCacheBlockSize);
-    }
+		}
+
+        bcopy(gCacheBuffer + cnt * kCachePageSize + pageOffset, buffer, readSize);
+
+        offset += readSize;
+        buffer += readSize;
+	}
 
     return length;
 }
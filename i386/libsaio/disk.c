@@ -104,6 +104,7 @@ typedef struct gpt_ent gpt_ent;
 #define PROBEFS_SIZE	BPS * 4	// buffer size for filesystem probe.
 // #define CD_BPS		2048	// CD-ROM block size.
 #define N_CACHE_SECS	(BIOS_LEN / BPS)	// Must be a multiple of 4 for CD-ROMs.
+#define N_FLAT_SECS		127					// Largest EDD 3.0 transfer that all BIOSes accept.
 
 // IORound and IOTrunc convenience functions, in the spirit of vm's round_page() and trunc_page().
 #define IORound(value, multiple) ((((value) + (multiple) - 1) / (multiple)) * (multiple))
@@ -116,6 +117,9 @@ static char * const trackbuf = (char *) ptov(BIOS_ADDR);
 // biosbuf points to a sector within the track cache, and is updated by Biosread().
 static char * biosbuf;
 
+// Number of valid sectors in the track cache from biosbuf on, updated by Biosread().
+static unsigned int biossecs;
+
 // Map a disk drive to bootable volumes contained within.
 struct DiskBVMap
 {
@@ -278,6 +282,15 @@ static const struct NamedValue bios_errors[] =
 
 static bool cache_valid = false;
 
+#if EDD3_FLAT_READ_SUPPORT
+	#define FLAT_READ_UNTESTED	0
+	#define FLAT_READ_WORKS		1
+	#define FLAT_READ_REJECTED	2
+
+	// State of the flat read path per BIOS hard drive (0x80 - 0xFF).
+	static unsigned char flatReadState[0x80];
+#endif
+
 
 //==============================================================================
 
@@ -345,6 +358,7 @@ static int Biosread(int biosdev, unsigned long long secno)
 		if (cache_valid && (biosdev == xbiosdev) && (secno >= xsec) && ((unsigned int)secno < (xsec + xnsecs)))
 		{
 			biosbuf = trackbuf + (BPS * (secno - xsec));
+			biossecs = xsec + xnsecs - secno;
 			return 0;
 		}
 
@@ -381,6 +395,7 @@ static int Biosread(int biosdev, unsigned long long secno)
 		{
 			// this sector is in trackbuf cache.
 			biosbuf = trackbuf + (BPS * (sec - xsec));
+			biossecs = xsec + xnsecs - sec;
 			return 0;
 		}
 
@@ -413,6 +428,7 @@ static int Biosread(int biosdev, unsigned long long secno)
 	}
 
 	biosbuf  = trackbuf + (secno % divisor) * BPS;
+	biossecs = xnsecs - (secno % divisor);
 	xbiosdev = biosdev;
 
 	return rc;
@@ -427,6 +443,82 @@ int testBiosread(int biosdev, unsigned long long secno)
 }
 
 
+#if EDD3_FLAT_READ_SUPPORT
+//==============================================================================
+// Reads count sectors straight into buffer by passing an EDD 3.0 flat buffer
+// address to the BIOS. Each drive is first probed with a single sector flat read
+// into a scratch buffer, which is checked against a read through the track buffer
+// since a BIOS that ignores the flat address would have used FFFF:FFFF instead.
+// The caller's buffer is only used once the probe succeeded.
+//
+// Returns 0 on success, or -1 when the caller has to use the track buffer.
+
+static int flatRead(int biosdev, unsigned long long secno, int count, char * buffer)
+{
+	struct driveInfo di;
+	unsigned char * state;
+	char * probe;
+
+	if ((biosdev < kBIOSDevTypeHardDrive) || (biosdev >= 0x100))
+	{
+		return -1;
+	}
+
+	state = &flatReadState[biosdev - kBIOSDevTypeHardDrive];
+
+	if (*state == FLAT_READ_REJECTED)
+	{
+		return -1;
+	}
+
+	if (*state == FLAT_READ_UNTESTED)
+	{
+		if ((getDriveInfo(biosdev, &di) < 0) || di.no_emulation || (di.edd_version < 0x30) ||
+			!(di.uses_ebios & EBIOS_FIXED_DISK_ACCESS) || (di.di.params.phys_nbps != BPS))
+		{
+			_DISK_DEBUG_DUMP("Flat reads not supported for device 0x%x.\n", biosdev);
+			*state = FLAT_READ_REJECTED;
+
+			return -1;
+		}
+
+		probe = (char *) malloc(BPS);
+
+		if (probe == NULL)
+		{
+			return -1;
+		}
+
+		memset(probe, 0xA5, BPS);
+
+		if (ebiosreadflat(biosdev, secno, 1, probe) || Biosread(biosdev, secno) || memcmp(biosbuf, probe, BPS))
+		{
+			_DISK_DEBUG_DUMP("Flat read probe failed for device 0x%x, using the track buffer.\n", biosdev);
+			*state = FLAT_READ_REJECTED;
+			free(probe);
+
+			return -1;
+		}
+
+		free(probe);
+
+		_DISK_DEBUG_DUMP("Flat reads enabled for device 0x%x.\n", biosdev);
+		*state = FLAT_READ_WORKS;
+	}
+
+	if (ebiosreadflat(biosdev, secno, count, buffer) != 0)
+	{
+		_DISK_DEBUG_DUMP("Flat read of %d sectors rejected for device 0x%x, using the track buffer.\n", count, biosdev);
+		*state = FLAT_READ_REJECTED;
+
+		return -1;
+	}
+
+	return 0;
+}
+#endif
+
+
 //==============================================================================
 
 static int readBytes(int biosdev, unsigned long long blkno, unsigned int byteoff, unsigned int byteCount, void * buffer)
@@ -445,8 +537,25 @@ static int readBytes(int biosdev, unsigned long long blkno, unsigned int byteoff
 
 	// _DISK_DEBUG_DUMP("%s: dev %x block %x [%d] -> 0x%x...", __FUNCTION__, biosdev, blkno, byteCount, (unsigned)cbuf);
 
-	for (; byteCount; cbuf += copy_len, blkno++)
+	while (byteCount)
 	{
+#if EDD3_FLAT_READ_SUPPORT
+		// Large reads skip the track buffer (and its read-ahead) when the BIOS allows it.
+		if ((byteoff == 0) && (byteCount >= BIOS_LEN))
+		{
+			copy_len = ((byteCount / BPS) > N_FLAT_SECS) ? N_FLAT_SECS : (byteCount / BPS);
+
+			if (flatRead(biosdev, blkno, copy_len, cbuf) == 0)
+			{
+				blkno += copy_len;
+				copy_len *= BPS;
+				cbuf += copy_len;
+				byteCount -= copy_len;
+
+				continue;
+			}
+		}
+#endif
 		error = Biosread(biosdev, blkno);
 
 		if (error)
@@ -456,9 +565,12 @@ static int readBytes(int biosdev, unsigned long long blkno, unsigned int byteoff
 			return (-1);
 		}
 
-		copy_len = ((byteCount + byteoff) > BPS) ? (BPS - byteoff) : byteCount;
+		// Copy everything the track cache holds for this request in one go.
+		copy_len = ((byteCount + byteoff) > (biossecs * BPS)) ? ((biossecs * BPS) - byteoff) : byteCount;
 		bcopy( biosbuf + byteoff, cbuf, copy_len );
+		cbuf += copy_len;
 		byteCount -= copy_len;
+		blkno += (byteoff + copy_len) / BPS;
 		byteoff = 0;
 	}
 
@@ -488,6 +600,10 @@ static BVRef initNewBVRef(int biosdev, int partno, unsigned int blkoff)
 		bvr->fs_getdirentry		= HFSGetDirEntry;
 		bvr->fs_getfileblock	= HFSGetFileBlock;
 		bvr->fs_getuuid			= HFSGetUUID;
+		bvr->fs_open			= HFSOpen;
+		bvr->fs_pread			= HFSPRead;
+		bvr->fs_close			= HFSClose;
+		bvr->fs_filesize		= HFSFileSize;
 		bvr->description		= HFSGetDescription;
 		bvr->bv_free			= HFSFree;
 		
@@ -28,6 +28,15 @@
  * Updates:
  *			- OSBigEndian removed and white space changes (PikerAlpha, November 2012)
  *			- Cleanups and spaces -> tabs (PikerAlpha, November 2012)
+ *			- B-tree header and small file reads are cached (any offset and length).
+ *			- The cache is no longer reset when switching volumes.
+ *			- ReadExtent merges physically adjacent extents into one read.
+ *			- Flattened extent lists are cached per file (no more extents B-tree lookups per read).
+ *			- B-tree node cache with pinned index nodes, lookups no longer copy nodes.
+ *			- Catalog lookups are cached by (parent folder ID, name), failed lookups included.
+ *			- Directory enumeration keeps the current leaf node in a cursor and follows fLink.
+ *			- HFSOpen/HFSPRead/HFSClose resolve a path once for several reads.
+ *			- HFSFileSize returns the size of an opened file.
  *
  */
 
@@ -43,15 +52,110 @@
 #define kBTreeCatalog (0)
 #define kBTreeExtents (1)
 
+// Larger file reads bypass the cache so that they don't flush the meta-data.
+#define kMaxCachedReadSize (64 * 1024)
+
+// Number of files for which the flattened extent list is kept.
+#define kExtentMapCount (16)
+
+typedef struct HFSExtentRun
+{
+	uint32_t	fileBlock;		// First block of the run within the file.
+	uint32_t	startBlock;		// First allocation block of the run on the volume.
+	uint32_t	blockCount;
+} HFSExtentRun;
+
+// Number of B-tree nodes kept by GetBTreeNode(). Up to half of them can be
+// pinned (the root and the index nodes above the lowest index level).
+#define kBTreeNodeCacheCount (32)
+
+typedef struct HFSNodeCacheEntry
+{
+	CICell		ih;
+	long		btree;
+	long		node;
+	long		nodeSize;
+	long		time;
+	long		pinned;
+	char		*buffer;
+} HFSNodeCacheEntry;
+
+// Files opened with HFSOpen(). The catalog record is kept so that reads don't
+// have to resolve the path again (the extent map is cached by file ID).
+#define kOpenFileCount (4)
+
+typedef struct HFSOpenFile
+{
+	CICell		ih;
+	char		entry[sizeof(HFSPlusCatalogFile)];
+} HFSOpenFile;
+
+// Directory cursors used by GetCatalogEntry(), one per level of nested directory
+// enumeration (loadKexts() uses three: Extensions, PlugIns and GetFileInfo).
+#define kDirCursorCount (4)
+
+typedef struct HFSDirCursor
+{
+	CICell		ih;
+	long		node;		// Catalog leaf node held in buffer.
+	long		nextNode;	// Its fLink.
+	long		nodeSize;
+	long		time;
+	char		*buffer;
+} HFSDirCursor;
+
+// Number of (parent folder, name) lookups remembered by ReadCatalogEntry(),
+// failed lookups included.
+#define kDentryCount		(256)
+#define kDentryHashSize		(256)	// Must be a power of 2.
+#define kDentryNameLength	(64)	// Longer names are not cached.
+#define kDentryEntrySize	(264)	// Largest catalog record (thread records).
+
+typedef struct HFSDentry
+{
+	CICell		ih;
+	long		dirID;
+	long		result;
+	long		dirIndex;
+	short		bucket;		// -1 when not hashed.
+	short		next;		// Next entry in the same bucket, or -1.
+	char		name[kDentryNameLength];
+	char		entry[kDentryEntrySize];
+} HFSDentry;
+
+typedef struct HFSExtentMap
+{
+	CICell			ih;
+	long			fileID;
+	long			runCount;
+	long			time;
+	HFSExtentRun	*runs;
+} HFSExtentMap;
+
 static CICell		gCurrentIH;
 static long long	gAllocationOffset;
 static long			gIsHFSPlus;
 static long			gBlockSize;
 static long			gCaseSensitive;
-static long			gCacheBlockSize;
 static BTHeaderRec	*gBTHeaders[2];
 static long long	gVolID;
 
+static HFSExtentMap	gExtentMaps[kExtentMapCount];
+static long			gExtentMapTime;
+
+static HFSNodeCacheEntry	gNodeCache[kBTreeNodeCacheCount];
+static long					gNodeCacheTime;
+static long					gNodeCachePinned;
+
+static HFSOpenFile	gOpenFiles[kOpenFileCount];
+
+static HFSDirCursor	gDirCursors[kDirCursorCount];
+static long			gDirCursorTime;
+
+static HFSDentry	*gDentries;
+static short		gDentryHash[kDentryHashSize];
+static long			gDentryNext;
+
 #ifdef __i386__
 
 static char						*gBTreeHeaderBuffer;
@@ -73,17 +177,27 @@ static char						gLinkTemp[64];
 
 #endif /* !__i386__ */
 
+static long LookupFile(char *filePath, void *entry);
 static long ReadFile(void *file, uint64_t *length, void *base, uint64_t offset);
 static long GetCatalogEntryInfo(void *entry, long *flags, long *time, FinderInfo *finderInfo, long *infoValid);
 static long ResolvePathToCatalogEntry(char *filePath, long *flags, void *entry, long dirID, long *dirIndex);
 
 static long GetCatalogEntry(long *dirIndex, char **name, long *flags, long *time, FinderInfo *finderInfo, long *infoValid);
+static char * GetDirCursorNode(long nodeNumber, long nodeSize);
 static long ReadCatalogEntry(char *fileName, long dirID, void *entry, long *dirIndex);
+static void AddDentry(long bucket, char *fileName, long dirID, long result, void *entry, long dirIndex);
+static void FlushDentries(CICell ih);
+static void FlushDirCursors(CICell ih);
 static long ReadExtentsEntry(long fileID, long startBlock, void *entry);
 
+static long GetBTreeFile(long btree, void **extent, uint64_t *extentSize);
+static char * GetBTreeNode(long btree, long nodeNumber);
+static void FlushBTreeNodes(CICell ih);
 static long ReadBTreeEntry(long btree, void *key, char *entry, long *dirIndex);
 static void GetBTreeRecord(long index, char *nodeBuffer, long nodeSize, char **key, char **data);
 
+static HFSExtentMap * GetExtentMap(char *extent, uint64_t extentSize, long extentFile);
+static void FlushExtentMaps(CICell ih);
 static long ReadExtent(char *extent, uint64_t extentSize, long extentFile, uint64_t offset, uint64_t size, void *buffer, long cache);
 
 static long GetExtentStart(void *extents, long index);
@@ -113,11 +227,26 @@ static void SwapFinderInfo(FndrFileInfo *dst, FndrFileInfo *src)
 
 void HFSFree(CICell ih)
 {
+	long index;
+	
 	if (gCurrentIH == ih)
 	{
 		gCurrentIH = 0;
 	}
 	
+	for (index = 0; index < kOpenFileCount; index++)
+	{
+		if (gOpenFiles[index].ih == ih)
+		{
+			gOpenFiles[index].ih = 0;
+		}
+	}
+	
+	FlushDentries(ih);
+	FlushDirCursors(ih);
+	FlushBTreeNodes(ih);
+	FlushExtentMaps(ih);
+	CacheFlush(ih);
 	free(ih);
 }
 
@@ -147,14 +276,8 @@ bool HFSProbe (const void *buf)
 
 long HFSInitPartition(CICell ih)
 {
-	long extentSize, extentFile, nodeSize;
-	void *extent;
-	
 	if (ih == gCurrentIH)
 	{
-#ifdef __i386__
-		CacheInit(ih, gCacheBlockSize);
-#endif
 		return 0L;
 	}
 	
@@ -192,6 +315,28 @@ long HFSInitPartition(CICell ih)
 	}
 #endif /* __i386__ */
 	
+	// The cache is shared by all volumes (pages are tagged with ih).
+	CacheInit();
+	
+	// Optional, lookups simply go to the catalog B-tree without it.
+	if (!gDentries)
+	{
+		gDentries = (HFSDentry *)malloc(kDentryCount * sizeof(HFSDentry));
+		
+		if (gDentries)
+		{
+			bzero(gDentries, kDentryCount * sizeof(HFSDentry));
+			memset(gDentryHash, 0xff, sizeof(gDentryHash));
+			
+			for (gDentryNext = 0; gDentryNext < kDentryCount; gDentryNext++)
+			{
+				gDentries[gDentryNext].bucket = -1;
+			}
+			
+			gDentryNext = 0;
+		}
+	}
+	
 	gAllocationOffset = 0;
 	gIsHFSPlus = 0;
 	gCaseSensitive = 0;
@@ -199,8 +344,7 @@ long HFSInitPartition(CICell ih)
 	gBTHeaders[1] = 0;
 	
 	// Look for the HFS MDB
-	Seek(ih, kMDBBaseOffset);
-	Read(ih, (long)gHFSMdbVib, kBlockSize);
+	CacheRead(ih, gHFSMdbVib, kMDBBaseOffset, kBlockSize, 1);
 	
 	if (SWAP_BE16(gHFSMDB->drSigWord) == kHFSSigWord)
 	{
@@ -210,28 +354,12 @@ long HFSInitPartition(CICell ih)
 		if (SWAP_BE16(gHFSMDB->drEmbedSigWord) != kHFSPlusSigWord)
 		{
 			// Normal HFS;
-			gCacheBlockSize = gBlockSize = SWAP_BE32(gHFSMDB->drAlBlkSiz);
-			CacheInit(ih, gCacheBlockSize);
+			gBlockSize = SWAP_BE32(gHFSMDB->drAlBlkSiz);
 			gCurrentIH = ih;
 			
 			// grab the 64 bit volume ID
 			bcopy(&gHFSMDB->drFndrInfo[6], &gVolID, 8);
 			
-			// Get the Catalog BTree node size.
-			extent		= (HFSExtentDescriptor *)&gHFSMDB->drCTExtRec;
-			extentSize	= SWAP_BE32(gHFSMDB->drCTFlSize);
-			extentFile	= kHFSCatalogFileID;
-			ReadExtent(extent, extentSize, extentFile, 0, 256, gBTreeHeaderBuffer + kBTreeCatalog * 256, 0);
-			
-			nodeSize = SWAP_BE16(((BTHeaderRec *)(gBTreeHeaderBuffer + kBTreeCatalog * 256 + sizeof(BTNodeDescriptor)))->nodeSize);
-			
-			// If the BTree node size is larger than the block size, reset the cache.
-			if (nodeSize > gBlockSize)
-			{
-				gCacheBlockSize = nodeSize;
-				CacheInit(ih, gCacheBlockSize);
-			}
-			
 			return 0L;
 		}
 		
@@ -240,8 +368,7 @@ long HFSInitPartition(CICell ih)
 	}
 	
 	// Look for the HFSPlus Header
-	Seek(ih, gAllocationOffset + kMDBBaseOffset);
-	Read(ih, (long)gHFSPlusHeader, kBlockSize);
+	CacheRead(ih, gHFSPlusHeader, gAllocationOffset + kMDBBaseOffset, kBlockSize, 1);
 	
 	// Not a HFS+ or HFSX volume.
 	if (SWAP_BE16(gHFSPlus->signature) != kHFSPlusSigWord && SWAP_BE16(gHFSPlus->signature) != kHFSXSigWord)
@@ -253,8 +380,7 @@ long HFSInitPartition(CICell ih)
 	}
 	
 	gIsHFSPlus = 1;
-	gCacheBlockSize = gBlockSize = SWAP_BE32(gHFSPlus->blockSize);
-	CacheInit(ih, gCacheBlockSize);
+	gBlockSize = SWAP_BE32(gHFSPlus->blockSize);
 	gCurrentIH = ih;
 	
 	ih->modTime = SWAP_BE32(gHFSPlus->modifyDate) - 2082844800;
@@ -262,22 +388,6 @@ long HFSInitPartition(CICell ih)
 	// grab the 64 bit volume ID
 	bcopy(&gHFSPlus->finderInfo[24], &gVolID, 8);
 	
-	// Get the Catalog BTree node size.
-	extent		= &gHFSPlus->catalogFile.extents;
-	extentSize	= SWAP_BE64(gHFSPlus->catalogFile.logicalSize);
-	extentFile	= kHFSCatalogFileID;
-	
-	ReadExtent(extent, extentSize, extentFile, 0, 256, gBTreeHeaderBuffer + kBTreeCatalog * 256, 0);
-	
-	nodeSize = SWAP_BE16(((BTHeaderRec *)(gBTreeHeaderBuffer + kBTreeCatalog * 256 + sizeof(BTNodeDescriptor)))->nodeSize);
-	
-	// If the BTree node size is larger than the block size, reset the cache.
-	if (nodeSize > gBlockSize)
-	{
-		gCacheBlockSize = nodeSize;
-		CacheInit(ih, gCacheBlockSize);
-	}
-	
 	return 0L;
 }
 
@@ -295,69 +405,113 @@ long HFSLoadFile(CICell ih, char * filePath)
 long HFSReadFile(CICell ih, char * filePath, void *base, uint64_t offset, uint64_t length)
 {
 	char entry[512];
-	long dirID, result, flags;
 	
 	if (HFSInitPartition(ih) == -1)
 	{
 		return -1;
 	}
 	
-	dirID = kHFSRootFolderID;
+	if (LookupFile(filePath, entry) == -1)
+	{
+		return -1L;
+	}
 	
-	// Skip a lead '\'.  Start in the system folder if there are two.
-	if (filePath[0] == '/')
+	if (ReadFile(entry, &length, base, offset) == -1)
 	{
-		if (filePath[1] == '/')
+		return -1L;
+	}
+	
+#if DEBUG
+	printf("Loaded [%s] %d bytes.\n", filePath, (uint32_t)length);
+#endif
+	
+	return length;
+}
+
+
+//==============================================================================
+// Returns a handle for HFSPRead(), or -1 when the file doesn't exist (or when
+// all handles are in use).
+
+long HFSOpen(CICell ih, char * filePath)
+{
+	long handle;
+	char entry[512];
+	
+	for (handle = 0; handle < kOpenFileCount; handle++)
+	{
+		if (gOpenFiles[handle].ih == 0)
 		{
-			if (gIsHFSPlus)
-			{
-				dirID = SWAP_BE32(((long *)gHFSPlus->finderInfo)[5]);
-			}
-			else
-			{
-				dirID = SWAP_BE32(gHFSMDB->drFndrInfo[5]);
-			}
-			
-			if (dirID == 0)
-			{
-				return -1L;
-			}
-			
-			filePath++;
+			break;
 		}
-		
-		filePath++;
 	}
 	
-	result = ResolvePathToCatalogEntry(filePath, &flags, entry, dirID, 0);
-	
-	if ((result == -1) || ((flags & kFileTypeMask) != kFileTypeFlat))
+	if ((handle == kOpenFileCount) || (HFSInitPartition(ih) == -1) || (LookupFile(filePath, entry) == -1))
 	{
 		return -1L;
 	}
 	
-#if UNUSED
-	// Not yet for Intel. System.config/Default.table will fail this check.
-	// Check file owner and permissions.
-	if (flags & (kOwnerNotRoot | kPermGroupWrite | kPermOtherWrite))
+	gOpenFiles[handle].ih = ih;
+	bcopy(entry, gOpenFiles[handle].entry, sizeof(gOpenFiles[handle].entry));
+	
+	return handle;
+}
+
+
+//==============================================================================
+// Same as HFSReadFile() but for a file opened with HFSOpen().
+
+long HFSPRead(CICell ih, long handle, void *base, uint64_t offset, uint64_t length)
+{
+	if ((handle < 0) || (handle >= kOpenFileCount) || (gOpenFiles[handle].ih != ih))
 	{
 		return -1L;
 	}
-#endif
 	
-	if (ReadFile(entry, &length, base, offset) == -1)
+	if (HFSInitPartition(ih) == -1)
 	{
 		return -1L;
 	}
 	
-#if DEBUG
-	printf("Loaded [%s] %d bytes.\n", filePath, (uint32_t)length);
-#endif
+	if (ReadFile(gOpenFiles[handle].entry, &length, base, offset) == -1)
+	{
+		return -1L;
+	}
 	
 	return length;
 }
 
 
+//==============================================================================
+
+void HFSClose(CICell ih, long handle)
+{
+	if ((handle >= 0) && (handle < kOpenFileCount) && (gOpenFiles[handle].ih == ih))
+	{
+		gOpenFiles[handle].ih = 0;
+	}
+}
+
+
+//==============================================================================
+// Returns the (data fork) size of a file opened with HFSOpen(), or -1.
+
+long HFSFileSize(CICell ih, long handle)
+{
+	if ((handle < 0) || (handle >= kOpenFileCount) || (gOpenFiles[handle].ih != ih) || (HFSInitPartition(ih) == -1))
+	{
+		return -1L;
+	}
+
+	if (gIsHFSPlus)
+	{
+		return (long)SWAP_BE64(((HFSPlusCatalogFile *)gOpenFiles[handle].entry)->dataFork.logicalSize);
+	}
+
+	return SWAP_BE32(((HFSCatalogFile *)gOpenFiles[handle].entry)->dataLogicalSize);
+}
+
+
 //==============================================================================
 
 long HFSGetDirEntry(CICell ih, char * dirPath, long * dirIndex, char ** name, long * flags, long * time, FinderInfo * finderInfo, long * infoValid)
@@ -559,6 +713,59 @@ long HFSGetUUID(CICell ih, char *uuidStr)
 //==============================================================================
 // Private Functions
 
+static long LookupFile(char * filePath, void * entry)
+{
+	long dirID, result, flags;
+	
+	dirID = kHFSRootFolderID;
+	
+	// Skip a lead '\'.  Start in the system folder if there are two.
+	if (filePath[0] == '/')
+	{
+		if (filePath[1] == '/')
+		{
+			if (gIsHFSPlus)
+			{
+				dirID = SWAP_BE32(((long *)gHFSPlus->finderInfo)[5]);
+			}
+			else
+			{
+				dirID = SWAP_BE32(gHFSMDB->drFndrInfo[5]);
+			}
+			
+			if (dirID == 0)
+			{
+				return -1L;
+			}
+			
+			filePath++;
+		}
+		
+		filePath++;
+	}
+	
+	result = ResolvePathToCatalogEntry(filePath, &flags, entry, dirID, 0);
+	
+	if ((result == -1) || ((flags & kFileTypeMask) != kFileTypeFlat))
+	{
+		return -1L;
+	}
+	
+#if UNUSED
+	// Not yet for Intel. System.config/Default.table will fail this check.
+	// Check file owner and permissions.
+	if (flags & (kOwnerNotRoot | kPermGroupWrite | kPermOtherWrite))
+	{
+		return -1L;
+	}
+#endif
+	
+	return 0L;
+}
+
+
+//==============================================================================
+
 static long ReadFile(void * file, uint64_t * length, void * base, uint64_t offset)
 {
 	void				*extents;
@@ -592,7 +799,7 @@ static long ReadFile(void * file, uint64_t * length, void * base, uint64_t offse
 		*length = fileLength - offset;
 	}
 	
-	*length = ReadExtent((char *)extents, fileLength, fileID, offset, *length, (char *)base, 0);
+	*length = ReadExtent((char *)extents, fileLength, fileID, offset, *length, (char *)base, (*length <= kMaxCachedReadSize));
 	
 	return 0L;
 }
@@ -757,32 +964,25 @@ static long ResolvePathToCatalogEntry(char * filePath, long * flags, void * entr
 
 static long GetCatalogEntry(long * dirIndex, char ** name, long * flags, long * time, FinderInfo * finderInfo, long * infoValid)
 {
-	long extentSize, nodeSize, curNode, index;
-	void *extent;
+	long nodeSize, curNode, index;
 	char *nodeBuf, *testKey, *entry;
 	
 	BTNodeDescriptor  *node;
 	
-	if (gIsHFSPlus)
-	{
-		extent		= &gHFSPlus->catalogFile.extents;
-		extentSize	= SWAP_BE64(gHFSPlus->catalogFile.logicalSize);
-	}
-	else
-	{
-		extent		= (HFSExtentDescriptor *)&gHFSMDB->drCTExtRec;
-		extentSize	= SWAP_BE32(gHFSMDB->drCTFlSize);
-	}
-	
 	nodeSize	= SWAP_BE16(gBTHeaders[kBTreeCatalog]->nodeSize);
-	nodeBuf		= (char *)malloc(nodeSize);
-	node		= (BTNodeDescriptor *)nodeBuf;
 	
 	index   = *dirIndex % nodeSize;
 	curNode = *dirIndex / nodeSize;
 	
-	// Read the BTree node and get the record for index.
-	ReadExtent(extent, extentSize, kHFSCatalogFileID, curNode * nodeSize, nodeSize, nodeBuf, 1);
+	// Get the leaf node (from the cursor of this enumeration) and the record for index.
+	nodeBuf		= GetDirCursorNode(curNode, nodeSize);
+	node		= (BTNodeDescriptor *)nodeBuf;
+	
+	if (nodeBuf == 0)
+	{
+		return -1;
+	}
+	
 	GetBTreeRecord(index, nodeBuf, nodeSize, &testKey, &entry);
 	GetCatalogEntryInfo(entry, flags, time, finderInfo, infoValid);
 	
@@ -812,61 +1012,253 @@ static long GetCatalogEntry(long * dirIndex, char ** name, long * flags, long *
 	
 	*dirIndex = curNode * nodeSize + index;
 	
-	free(nodeBuf);
-	
 	return 0;
 }
 
 
 //==============================================================================
+// Returns the catalog leaf node nodeNumber from a directory cursor. A cursor
+// that holds the node, or that just finished its predecessor, is reused so
+// that an enumeration moves from leaf to leaf along the fLink chain.
 
-static long ReadCatalogEntry(char * fileName, long dirID, void * entry, long * dirIndex)
+static char * GetDirCursorNode(long nodeNumber, long nodeSize)
 {
-	long length = 0L;
-	char key[sizeof(HFSPlusCatalogKey)];
-	
-	HFSCatalogKey		*hfsKey		= (HFSCatalogKey *)key;
-	HFSPlusCatalogKey	*hfsPlusKey	= (HFSPlusCatalogKey *)key;
-	
-	// Make the catalog key.
-	if (gIsHFSPlus)
+	long index;
+	char *nodeBuf;
+	HFSDirCursor *cursor = 0;
+
+	for (index = 0; index < kDirCursorCount; index++)
 	{
-		hfsPlusKey->parentID = SWAP_BE32(dirID);
-		length = strlen(fileName);
-		
-		if (length > 255)
+		if (gDirCursors[index].ih == gCurrentIH)
 		{
-			length = 255;
+			if (gDirCursors[index].node == nodeNumber)
+			{
+				gDirCursors[index].time = ++gDirCursorTime;
+
+				return gDirCursors[index].buffer;
+			}
+
+			if (gDirCursors[index].nextNode == nodeNumber)
+			{
+				cursor = &gDirCursors[index];
+			}
 		}
-		
-		utf_decodestr((u_int8_t *)fileName, hfsPlusKey->nodeName.unicode, &(hfsPlusKey->nodeName.length), 512);
 	}
-	else
+
+	if (cursor == 0)
 	{
-		hfsKey->parentID = SWAP_BE32(dirID);
-		length = strlen(fileName);
-		
-		if (length > 31)
+		// Take the least recently used cursor.
+		cursor = &gDirCursors[0];
+
+		for (index = 1; index < kDirCursorCount; index++)
 		{
-			length = 31;
+			if (gDirCursors[index].time < cursor->time)
+			{
+				cursor = &gDirCursors[index];
+			}
 		}
-		
-		hfsKey->nodeName[0] = length;
-		strncpy((char *)(hfsKey->nodeName + 1), fileName, length);
 	}
-	
-	return ReadBTreeEntry(kBTreeCatalog, &key, entry, dirIndex);
-}
 
+	if (cursor->buffer && (cursor->nodeSize != nodeSize))
+	{
+		free(cursor->buffer);
+		cursor->buffer = 0;
+	}
 
-//==============================================================================
+	if (cursor->buffer == 0)
+	{
+		cursor->buffer = (char *)malloc(nodeSize);
+	}
 
-static long ReadExtentsEntry(long fileID, long startBlock, void * entry)
-{
-	char key[sizeof(HFSPlusExtentKey)];
-	
-	HFSExtentKey		*hfsKey		= (HFSExtentKey *)key;
-	HFSPlusExtentKey	*hfsPlusKey	= (HFSPlusExtentKey *)key;
+	cursor->ih = 0;
+
+	if ((cursor->buffer == 0) || ((nodeBuf = GetBTreeNode(kBTreeCatalog, nodeNumber)) == 0))
+	{
+		return 0;
+	}
+
+	bcopy(nodeBuf, cursor->buffer, nodeSize);
+
+	cursor->ih			= gCurrentIH;
+	cursor->node		= nodeNumber;
+	cursor->nextNode	= SWAP_BE32(((BTNodeDescriptor *)nodeBuf)->fLink);
+	cursor->nodeSize	= nodeSize;
+	cursor->time		= ++gDirCursorTime;
+
+	return cursor->buffer;
+}
+
+
+//==============================================================================
+
+static void FlushDirCursors(CICell ih)
+{
+	long index;
+
+	for (index = 0; index < kDirCursorCount; index++)
+	{
+		if (gDirCursors[index].ih == ih)
+		{
+			gDirCursors[index].ih = 0;
+			gDirCursors[index].time = 0;
+		}
+	}
+}
+
+
+//==============================================================================
+
+static long ReadCatalogEntry(char * fileName, long dirID, void * entry, long * dirIndex)
+{
+	long bucket = -1, result, length = 0L, index = 0;
+	short slot;
+	char key[sizeof(HFSPlusCatalogKey)];
+	unsigned char *name;
+	unsigned long hash;
+	HFSDentry *dentry;
+	
+	HFSCatalogKey		*hfsKey		= (HFSCatalogKey *)key;
+	HFSPlusCatalogKey	*hfsPlusKey	= (HFSPlusCatalogKey *)key;
+	
+	// Check the lookup cache first (FNV-1a hash of volume, folder and name).
+	if (gDentries && (strlen(fileName) < kDentryNameLength))
+	{
+		hash = 2166136261UL ^ (unsigned long)dirID ^ (unsigned long)gCurrentIH;
+		
+		for (name = (unsigned char *)fileName; *name; name++)
+		{
+			hash = (hash ^ *name) * 16777619UL;
+		}
+		
+		bucket = hash & (kDentryHashSize - 1);
+		
+		for (slot = gDentryHash[bucket]; slot != -1; slot = dentry->next)
+		{
+			dentry = &gDentries[slot];
+			
+			if ((dentry->dirID == dirID) && (dentry->ih == gCurrentIH) && (strcmp(dentry->name, fileName) == 0))
+			{
+				if (dentry->result != -1)
+				{
+					bcopy(dentry->entry, entry, kDentryEntrySize);
+					
+					if (dirIndex != 0)
+					{
+						*dirIndex = dentry->dirIndex;
+					}
+				}
+				
+				return dentry->result;
+			}
+		}
+	}
+	
+	// Make the catalog key.
+	if (gIsHFSPlus)
+	{
+		hfsPlusKey->parentID = SWAP_BE32(dirID);
+		length = strlen(fileName);
+		
+		if (length > 255)
+		{
+			length = 255;
+		}
+		
+		utf_decodestr((u_int8_t *)fileName, hfsPlusKey->nodeName.unicode, &(hfsPlusKey->nodeName.length), 512);
+	}
+	else
+	{
+		hfsKey->parentID = SWAP_BE32(dirID);
+		length = strlen(fileName);
+		
+		if (length > 31)
+		{
+			length = 31;
+		}
+		
+		hfsKey->nodeName[0] = length;
+		strncpy((char *)(hfsKey->nodeName + 1), fileName, length);
+	}
+	
+	result = ReadBTreeEntry(kBTreeCatalog, &key, entry, &index);
+	
+	if ((result != -1) && (dirIndex != 0))
+	{
+		*dirIndex = index;
+	}
+	
+	if (bucket != -1)
+	{
+		AddDentry(bucket, fileName, dirID, result, entry, index);
+	}
+	
+	return result;
+}
+
+
+//==============================================================================
+// Stores a lookup result in the next cache entry (round robin).
+
+static void AddDentry(long bucket, char * fileName, long dirID, long result, void * entry, long dirIndex)
+{
+	short *link;
+	short slot = gDentryNext;
+	HFSDentry *dentry = &gDentries[slot];
+	
+	gDentryNext = (gDentryNext + 1) % kDentryCount;
+	
+	// Unhash the entry that we are about to replace.
+	if (dentry->bucket != -1)
+	{
+		for (link = &gDentryHash[dentry->bucket]; *link != slot; link = &gDentries[*link].next);
+		
+		*link = dentry->next;
+	}
+	
+	dentry->ih			= gCurrentIH;
+	dentry->dirID		= dirID;
+	dentry->result		= result;
+	dentry->dirIndex	= dirIndex;
+	dentry->bucket		= bucket;
+	dentry->next		= gDentryHash[bucket];
+	gDentryHash[bucket]	= slot;
+	
+	strlcpy(dentry->name, fileName, kDentryNameLength);
+	
+	if (result != -1)
+	{
+		bcopy(entry, dentry->entry, kDentryEntrySize);
+	}
+}
+
+
+//==============================================================================
+
+static void FlushDentries(CICell ih)
+{
+	long index;
+	
+	if (gDentries)
+	{
+		for (index = 0; index < kDentryCount; index++)
+		{
+			if (gDentries[index].ih == ih)
+			{
+				gDentries[index].ih = 0;	// Never matches, the entry stays hashed until reused.
+			}
+		}
+	}
+}
+
+
+//==============================================================================
+
+static long ReadExtentsEntry(long fileID, long startBlock, void * entry)
+{
+	char key[sizeof(HFSPlusExtentKey)];
+	
+	HFSExtentKey		*hfsKey		= (HFSExtentKey *)key;
+	HFSPlusExtentKey	*hfsPlusKey	= (HFSPlusExtentKey *)key;
 	
 	// Make the extents key.
 	if (gIsHFSPlus)
@@ -888,55 +1280,157 @@ static long ReadExtentsEntry(long fileID, long startBlock, void * entry)
 
 //==============================================================================
 
-static long ReadBTreeEntry(long btree, void * key, char * entry, long * dirIndex)
+static long GetBTreeFile(long btree, void ** extent, uint64_t * extentSize)
 {
-	
-	void *extent;
-	short extentFile;
-	long nodeSize, result = 0, entrySize = 0;
-	long curNode, index = 0, lowerBound, upperBound;
-	long extentSize;
-	char *testKey, *recordData;
-	char *nodeBuf;
-	
-	BTNodeDescriptor *node;
-	
-	// Figure out which tree is being looked at.
 	if (btree == kBTreeCatalog)
 	{
 		if (gIsHFSPlus)
 		{
-			extent		= &gHFSPlus->catalogFile.extents;
-			extentSize	= SWAP_BE64(gHFSPlus->catalogFile.logicalSize);
+			*extent		= &gHFSPlus->catalogFile.extents;
+			*extentSize	= SWAP_BE64(gHFSPlus->catalogFile.logicalSize);
 		}
 		else
 		{
-			extent		= (HFSExtentDescriptor *)&gHFSMDB->drCTExtRec;
-			extentSize	= SWAP_BE32(gHFSMDB->drCTFlSize);
+			*extent		= (HFSExtentDescriptor *)&gHFSMDB->drCTExtRec;
+			*extentSize	= SWAP_BE32(gHFSMDB->drCTFlSize);
 		}
 
-		extentFile = kHFSCatalogFileID;
+		return kHFSCatalogFileID;
+	}
+
+	if (gIsHFSPlus)
+	{
+		*extent		= &gHFSPlus->extentsFile.extents;
+		*extentSize	= SWAP_BE64(gHFSPlus->extentsFile.logicalSize);
 	}
 	else
 	{
-		if (gIsHFSPlus)
+		*extent		= (HFSExtentDescriptor *)&gHFSMDB->drXTExtRec;
+		*extentSize	= SWAP_BE32(gHFSMDB->drXTFlSize);
+	}
+
+	return kHFSExtentsFileID;
+}
+
+
+//==============================================================================
+// Returns a pointer to node nodeNumber of btree on the current volume. The
+// node stays valid until the next call, or for good when it is pinned. The
+// B-tree header must have been read.
+
+static char * GetBTreeNode(long btree, long nodeNumber)
+{
+	void *extent;
+	long index, nodeSize, extentFile;
+	uint64_t extentSize;
+	BTNodeDescriptor *node;
+	HFSNodeCacheEntry *slot = 0;
+
+	for (index = 0; index < kBTreeNodeCacheCount; index++)
+	{
+		if ((gNodeCache[index].node == nodeNumber) && (gNodeCache[index].btree == btree) && (gNodeCache[index].ih == gCurrentIH))
 		{
-			extent		= &gHFSPlus->extentsFile.extents;
-			extentSize	= SWAP_BE64(gHFSPlus->extentsFile.logicalSize);
+			gNodeCache[index].time = ++gNodeCacheTime;
+
+			return gNodeCache[index].buffer;
 		}
-		else
+
+		// Remember the least recently used unpinned entry.
+		if (!gNodeCache[index].pinned && ((slot == 0) || (gNodeCache[index].time < slot->time)))
 		{
-			extent		= (HFSExtentDescriptor *)&gHFSMDB->drXTExtRec;
-			extentSize	= SWAP_BE32(gHFSMDB->drXTFlSize);
+			slot = &gNodeCache[index];
 		}
-		
-		extentFile = kHFSExtentsFileID;
 	}
+
+	nodeSize = SWAP_BE16(gBTHeaders[btree]->nodeSize);
+
+	if (slot->buffer && (slot->nodeSize != nodeSize))
+	{
+		free(slot->buffer);
+		slot->buffer = 0;
+	}
+
+	if (slot->buffer == 0)
+	{
+		slot->buffer = (char *)malloc(nodeSize);
+
+		if (slot->buffer == 0)
+		{
+			slot->ih = 0;
+
+			return 0;
+		}
+	}
+
+	// Claim the entry before reading, reading the node may need other nodes.
+	slot->ih		= 0;
+	slot->time		= ++gNodeCacheTime;
+	slot->nodeSize	= nodeSize;
+
+	extentFile = GetBTreeFile(btree, &extent, &extentSize);
+	ReadExtent(extent, extentSize, extentFile, (uint64_t)nodeNumber * nodeSize, nodeSize, slot->buffer, 1);
+
+	slot->ih		= gCurrentIH;
+	slot->btree		= btree;
+	slot->node		= nodeNumber;
+
+	node = (BTNodeDescriptor *)slot->buffer;
+
+	if ((node->kind == kBTIndexNode) && (gNodeCachePinned < (kBTreeNodeCacheCount / 2)) &&
+		((node->height > 2) || (nodeNumber == SWAP_BE32(gBTHeaders[btree]->rootNode))))
+	{
+		slot->pinned = 1;
+		gNodeCachePinned++;
+	}
+
+	return slot->buffer;
+}
+
+
+//==============================================================================
+
+static void FlushBTreeNodes(CICell ih)
+{
+	long index;
+
+	for (index = 0; index < kBTreeNodeCacheCount; index++)
+	{
+		if (gNodeCache[index].ih == ih)
+		{
+			if (gNodeCache[index].pinned)
+			{
+				gNodeCache[index].pinned = 0;
+				gNodeCachePinned--;
+			}
+
+			gNodeCache[index].ih = 0;
+			gNodeCache[index].time = 0;
+		}
+	}
+}
+
+
+//==============================================================================
+
+static long ReadBTreeEntry(long btree, void * key, char * entry, long * dirIndex)
+{
+	void *extent;
+	short extentFile;
+	long nodeSize, result = 0, entrySize = 0;
+	long curNode, index = 0, lowerBound, upperBound;
+	uint64_t extentSize;
+	char *testKey, *recordData;
+	char *nodeBuf;
+	
+	BTNodeDescriptor *node;
+	
+	// Figure out which tree is being looked at.
+	extentFile = GetBTreeFile(btree, &extent, &extentSize);
 	
 	// Read the BTree Header if needed.
 	if (gBTHeaders[btree] == 0)
 	{
-		ReadExtent(extent, extentSize, extentFile, 0, 256, gBTreeHeaderBuffer + btree * 256, 0);
+		ReadExtent(extent, extentSize, extentFile, 0, 256, gBTreeHeaderBuffer + btree * 256, 1);
 		gBTHeaders[btree] = (BTHeaderRec *)(gBTreeHeaderBuffer + btree * 256 + sizeof(BTNodeDescriptor));
 		
 		if ((gIsHFSPlus && btree == kBTreeCatalog) && (gBTHeaders[btree]->keyCompareType == kHFSBinaryCompare))
@@ -947,13 +1441,17 @@ static long ReadBTreeEntry(long btree, void * key, char * entry, long * dirIndex
 	
 	curNode		= SWAP_BE32(gBTHeaders[btree]->rootNode);
 	nodeSize	= SWAP_BE16(gBTHeaders[btree]->nodeSize);
-	nodeBuf		= (char *)malloc(nodeSize);
-	node		= (BTNodeDescriptor *)nodeBuf;
 	
 	while (1)
 	{
-		// Read the current node.
-		ReadExtent(extent, extentSize, extentFile, curNode * nodeSize, nodeSize, nodeBuf, 1);
+		// Get the current node (no copy, index nodes are usually cached).
+		nodeBuf	= GetBTreeNode(btree, curNode);
+		node	= (BTNodeDescriptor *)nodeBuf;
+		
+		if (nodeBuf == 0)
+		{
+			return -1;
+		}
 		
 		// Find the matching key.
 		lowerBound = 0;
@@ -1022,8 +1520,6 @@ static long ReadBTreeEntry(long btree, void * key, char * entry, long * dirIndex
 	// Return error if the file was not found.
 	if (result != 0)
 	{
-		free(nodeBuf);
-
 		return -1;
 	}
 	
@@ -1077,8 +1573,6 @@ static long ReadBTreeEntry(long btree, void * key, char * entry, long * dirIndex
 		*dirIndex = curNode * nodeSize + index;
 	}
 	
-	free(nodeBuf);
-	
 	return 0;
 }
 
@@ -1105,107 +1599,230 @@ static void GetBTreeRecord(long index, char * nodeBuffer, long nodeSize, char **
 }
 
 
+//==============================================================================
+// Returns the extent list of extentFile on the current volume, with the
+// overflow extents included and physically adjacent extents merged. The
+// list is built on first use and kept for the kExtentMapCount most recently
+// used files. Returns 0 when the list cannot be read in full.
+
+static HFSExtentMap * GetExtentMap(char * extent, uint64_t extentSize, long extentFile)
+{
+	long index, extentDensity, runCount = 0, maxRuns, failed = 0;
+	uint32_t startBlock, blockCount, countedBlocks = 0, totalBlocks;
+	char *extentBuffer = 0;
+	HFSExtentRun *runs, *newRuns;
+	HFSExtentMap *map = &gExtentMaps[0];
+
+	for (index = 0; index < kExtentMapCount; index++)
+	{
+		if ((gExtentMaps[index].fileID == extentFile) && (gExtentMaps[index].ih == gCurrentIH) && gExtentMaps[index].runs)
+		{
+			gExtentMaps[index].time = ++gExtentMapTime;
+
+			return &gExtentMaps[index];
+		}
+	}
+
+	extentDensity = gIsHFSPlus ? kHFSPlusExtentDensity : kHFSExtentDensity;
+	totalBlocks = (extentSize + gBlockSize - 1) / gBlockSize;
+	maxRuns = extentDensity;
+	runs = (HFSExtentRun *)malloc(maxRuns * sizeof(HFSExtentRun));
+
+	if (runs == 0)
+	{
+		return 0;
+	}
+
+	for (index = 0; countedBlocks < totalBlocks; index++)
+	{
+		if (index == extentDensity)
+		{
+			// Continue with the next record from the extents overflow file.
+			if (extentBuffer == 0)
+			{
+				extentBuffer = malloc(extentDensity * (gIsHFSPlus ? sizeof(HFSPlusExtentDescriptor) : sizeof(HFSExtentDescriptor)));
+			}
+
+			if ((extentBuffer == 0) || (ReadExtentsEntry(extentFile, countedBlocks, extentBuffer) == -1))
+			{
+				failed = 1;
+				break;
+			}
+
+			extent = extentBuffer;
+			index = 0;
+		}
+
+		startBlock = GetExtentStart(extent, index);
+		blockCount = GetExtentSize(extent, index);
+
+		if (blockCount == 0)
+		{
+			break;
+		}
+
+		if (runCount && ((runs[runCount - 1].startBlock + runs[runCount - 1].blockCount) == startBlock))
+		{
+			runs[runCount - 1].blockCount += blockCount;
+		}
+		else
+		{
+			if (runCount == maxRuns)
+			{
+				maxRuns *= 2;
+				newRuns = (HFSExtentRun *)realloc(runs, maxRuns * sizeof(HFSExtentRun));
+
+				if (newRuns == 0)
+				{
+					failed = 1;
+					break;
+				}
+
+				runs = newRuns;
+			}
+
+			runs[runCount].fileBlock	= countedBlocks;
+			runs[runCount].startBlock	= startBlock;
+			runs[runCount].blockCount	= blockCount;
+			runCount++;
+		}
+
+		countedBlocks += blockCount;
+	}
+
+	if (extentBuffer)
+	{
+		free(extentBuffer);
+	}
+
+	// Do not cache an incomplete map, or every later read of the file would come up short.
+	if (failed)
+	{
+		free(runs);
+
+		return 0;
+	}
+
+	// Reuse the least recently used slot.
+	for (index = 1; index < kExtentMapCount; index++)
+	{
+		if (gExtentMaps[index].time < map->time)
+		{
+			map = &gExtentMaps[index];
+		}
+	}
+
+	if (map->runs)
+	{
+		free(map->runs);
+	}
+
+	map->ih			= gCurrentIH;
+	map->fileID		= extentFile;
+	map->runCount	= runCount;
+	map->time		= ++gExtentMapTime;
+	map->runs		= runs;
+
+	return map;
+}
+
+
+//==============================================================================
+
+static void FlushExtentMaps(CICell ih)
+{
+	long index;
+
+	for (index = 0; index < kExtentMapCount; index++)
+	{
+		if ((gExtentMaps[index].ih == ih) && gExtentMaps[index].runs)
+		{
+			free(gExtentMaps[index].runs);
+			gExtentMaps[index].runs = 0;
+			gExtentMaps[index].time = 0;
+		}
+	}
+}
+
+
 //==============================================================================
 
 static long ReadExtent(char * extent, uint64_t extentSize, long extentFile, uint64_t offset, uint64_t size, void * buffer, long cache)
 {
 	uint64_t  lastOffset;
-	long long blockNumber, countedBlocks = 0;
-	long long nextExtent = 0, sizeRead = 0, readSize;
-	long long nextExtentBlock, currentExtentBlock = 0;
-	long long readOffset;
-	long long extentDensity, sizeofExtent, currentExtentSize;
-	char *currentExtent, *extentBuffer = 0, *bufferPos = buffer;
+	long long blockNumber, sizeRead = 0, readSize, readOffset;
+	long lowerBound, upperBound, index;
+	char *bufferPos = buffer;
+	HFSExtentRun *run;
+	HFSExtentMap *map;
 	
 	if (offset >= extentSize)
 	{
 		return 0;
 	}
 	
-	if (gIsHFSPlus)
+	map = GetExtentMap(extent, extentSize, extentFile);
+	
+	if (map == 0)
 	{
-		extentDensity = kHFSPlusExtentDensity;
-		sizeofExtent  = sizeof(HFSPlusExtentDescriptor);
+		return -1;
 	}
-	else
+	
+	// Binary search for the run that holds the first block.
+	blockNumber = offset / gBlockSize;
+	lowerBound = 0;
+	upperBound = map->runCount - 1;
+	index = 0;
+	
+	while (lowerBound <= upperBound)
 	{
-		extentDensity = kHFSExtentDensity;
-		sizeofExtent  = sizeof(HFSExtentDescriptor);
+		index = (lowerBound + upperBound) / 2;
+		
+		if (map->runs[index].fileBlock > blockNumber)
+		{
+			upperBound = index - 1;
+		}
+		else if ((map->runs[index].fileBlock + map->runs[index].blockCount) <= blockNumber)
+		{
+			lowerBound = index + 1;
+		}
+		else
+		{
+			break;
+		}
 	}
 	
 	lastOffset = offset + size;
 	
-	while (offset < lastOffset)
+	// Runs are physically discontiguous, so this is one read per run.
+	for (; (offset < lastOffset) && (index < map->runCount); index++)
 	{
+		run = &map->runs[index];
 		blockNumber = offset / gBlockSize;
 		
-		// Find the extent for the offset.
-		for (; ; nextExtent++)
+		if ((blockNumber < run->fileBlock) || (blockNumber >= (run->fileBlock + run->blockCount)))
 		{
-			if (nextExtent < extentDensity)
-			{
-				if ((countedBlocks+GetExtentSize(extent, nextExtent)-1)<blockNumber)
-				{
-					countedBlocks += GetExtentSize(extent, nextExtent);
-					continue;
-				}
-				
-				currentExtent = extent + nextExtent * sizeofExtent;
-				break;
-			}
-			
-			if (extentBuffer == 0)
-			{
-				extentBuffer = malloc(sizeofExtent * extentDensity);
-				
-				if (extentBuffer == 0)
-				{
-					return -1;
-				}
-			}
-			
-			nextExtentBlock = nextExtent / extentDensity;
-			
-			if (currentExtentBlock != nextExtentBlock)
-			{
-				ReadExtentsEntry(extentFile, countedBlocks, extentBuffer);
-				currentExtentBlock = nextExtentBlock;
-			}
-			
-			currentExtentSize = GetExtentSize(extentBuffer, nextExtent % extentDensity);
-			
-			if ((countedBlocks + currentExtentSize - 1) >= blockNumber)
-			{
-				currentExtent = extentBuffer + sizeofExtent * (nextExtent % extentDensity);
-				break;
-			}
-			
-			countedBlocks += currentExtentSize;
+			break;	// Not mapped.
 		}
 		
-		readOffset = ((blockNumber - countedBlocks) * gBlockSize) + (offset % gBlockSize);
+		readOffset = ((blockNumber - run->fileBlock) * gBlockSize) + (offset % gBlockSize);
 		
-		readSize = GetExtentSize(currentExtent, 0) * gBlockSize - readOffset;
+		readSize = (long long)run->blockCount * gBlockSize - readOffset;
 		
 		if (readSize > (size - sizeRead))
 		{
 			readSize = size - sizeRead;
 		}
 		
-		readOffset += (long long)GetExtentStart(currentExtent, 0) * gBlockSize;
+		readOffset += gAllocationOffset + (long long)run->startBlock * gBlockSize;
 		
-		CacheRead(gCurrentIH, bufferPos, gAllocationOffset + readOffset, readSize, cache);
+		CacheRead(gCurrentIH, bufferPos, readOffset, readSize, cache);
 		
 		sizeRead += readSize;
 		offset += readSize;
 		bufferPos += readSize;
 	}
 	
-	if (extentBuffer)
-	{
-		free(extentBuffer);
-	}
-	
 	return sizeRead;
 }
 
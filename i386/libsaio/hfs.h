@@ -23,6 +23,10 @@
 extern long HFSInitPartition(CICell ih);
 extern long HFSLoadFile(CICell ih, char * filePath);
 extern long HFSReadFile(CICell ih, char * filePath, void *base, uint64_t offset, uint64_t length);
+extern long HFSOpen(CICell ih, char * filePath);
+extern long HFSPRead(CICell ih, long handle, void *base, uint64_t offset, uint64_t length);
+extern void HFSClose(CICell ih, long handle);
+extern long HFSFileSize(CICell ih, long handle);
 extern long HFSGetDirEntry(CICell ih, char * dirPath, long * dirIndex, char ** name, long * flags, long * time, FinderInfo * finderInfo, long * infoValid);
 extern void HFSGetDescription(CICell ih, char *str, long strMaxLen);
 extern long HFSGetFileBlock(CICell ih, char *str, unsigned long long *firstBlock);
@@ -26,6 +26,10 @@
  * Updates:
  *			- White space changes (PikerAlpha, November 2012)
  *			- Mountain Lion kernel patch for iMessage implemented (PikerAlpha, January 2013)
+ *			- DecodeMachOChunk/DecodeMachOFinish place a streamed kernelcache segment by segment.
+ *			- DecodeMachOFile reads the segments of an uncompressed kernel straight to their address.
+ *			- Single symbol table pass (ScanSymbols) for the version info and the kernel patches.
+ *			- Table driven kernel patcher (ApplyKernelPatches) with optional /Extra/KernelPatches.plist
  *
  */
 
@@ -36,6 +40,7 @@
 
 #include <sl.h>
 #include "platform.h"
+#include "xml.h"
 
 /***
  * Backward compatibility fix for the SDK 10.7 version of loader.h
@@ -48,14 +53,28 @@
 // Load MKext(s) or separate kexts (default behaviour / behavior).
 bool gLoadKernelDrivers = true;
 
+// Kernel patches from the compiled-in table and/or /Extra/KernelPatches.plist
+#define KERNEL_PATCHER	((PATCH_KEXT_LOADING && ((MAKE_TARGET_OS & EL_CAPITAN) == EL_CAPITAN)) || LOAD_KERNEL_PATCHES_PLIST)
+
 // Private functions.
-#if (PATCH_KEXT_LOADING && ((MAKE_TARGET_OS & EL_CAPITAN) == EL_CAPITAN))
-	static long patchLoadExecutable(unsigned long cmdBase, long listSize, unsigned long textSegmentAddress, unsigned long vldSegmentAddress);
+#if KERNEL_PATCHER
+	typedef struct KernelPatch KernelPatch;
+
+	static void ApplyKernelPatches(KernelPatch * patches, int count);
+	static void patchKernel(void);
 #endif
 
-static long initKernelVersionInfo(unsigned long cmdbase, long listSize, unsigned int textSegmentAddress);
+#if LOAD_KERNEL_PATCHES_PLIST
+	static void loadKernelPatches(void);
+#endif
+
+static long ScanSymbols(unsigned long cmdBase, long listSize);
+static long initKernelVersionInfo(void);
+static long DecodeLoadCommands(void *binary);
+static long DecodeSymbols(entry_t *rentry, char **raddr, int *rsize);
 static long DecodeSegment(long cmdBase, unsigned int*load_addr, unsigned int *load_size);
 static long DecodeUnixThread(long cmdBase, unsigned int *entry);
+static unsigned long FileOffsetToAddress(unsigned long offset, unsigned long length);
 
 #define ADD_SYMTAB	1
 
@@ -63,8 +82,153 @@ static long DecodeUnixThread(long cmdBase, unsigned int *entry);
 	static long DecodeSymbolTable(long cmdBase);
 #endif
 
+// Address of the Mach-O image, or 0 when it is streamed by DecodeMachOChunk()
+// or read segment by segment by DecodeMachOFile().
 static unsigned long gBinaryAddress;
 
+// Load command state shared by DecodeLoadCommands() and DecodeSymbols().
+static unsigned long gCmdStart;
+static unsigned long gNcmds;
+static unsigned long gListSize;
+static unsigned long gTextSegmentAddress;
+static unsigned long gVldSegmentAddress;
+static unsigned int  gEntry;
+static unsigned int  gVMAddr;
+static unsigned int  gVMEnd;
+
+// Symbols looked up by ScanSymbols(), for initKernelVersionInfo() and the kernel patches.
+typedef struct
+{
+	const char	* name;
+	uint8_t		section;	// n_sect of the symbol (0 matches any section).
+	uint16_t	length;		// Length of the name (set by ScanSymbols).
+	uint32_t	hash;		// FNV-1a hash of the name (set by ScanSymbols).
+	uint64_t	value;		// n_value, or 0 when the symbol was not found.
+} KernelSymbol;
+
+enum
+{
+	kVersionMajor,
+	kVersionMinor,
+	kVersionRevision,
+#if (PATCH_KEXT_LOADING && ((MAKE_TARGET_OS & EL_CAPITAN) == EL_CAPITAN))
+	kLoadExecutable,
+	#if PATCH_XCPM_SCOPE_MSRS
+	kXcpmCoreScopeMsrs,
+	#endif
+	#if PATCH_LOAD_EXTRA_KEXTS
+	kReadStartupExtensions,
+	#endif
+#endif
+	kKernelSymbolCount
+};
+
+#if LOAD_KERNEL_PATCHES_PLIST
+	#define kMaxPlistPatches	16	// Also the number of extra symbols for plist patches.
+#else
+	#define kMaxPlistPatches	0
+#endif
+
+static KernelSymbol gKernelSymbols[kKernelSymbolCount + kMaxPlistPatches] =
+{
+	{ "_version_major",									2 /* __TEXT,__const */	},
+	{ "_version_minor",									2 /* __TEXT,__const */	},
+	{ "_version_revision",								2 /* __TEXT,__const */	},
+#if (PATCH_KEXT_LOADING && ((MAKE_TARGET_OS & EL_CAPITAN) == EL_CAPITAN))
+	{ "__ZN6OSKext14loadExecutableEv",					1 /* __TEXT,__text */	},
+	#if PATCH_XCPM_SCOPE_MSRS
+	{ "_xcpm_core_scope_msrs",							8 /* __DATA,__data */	},
+	#endif
+	#if PATCH_LOAD_EXTRA_KEXTS
+	{ "__ZN12KLDBootstrap21readStartupExtensionsEv",	25 /* __KLD,__text */	},
+	#endif
+#endif
+};
+
+static int gKernelSymbolCount = kKernelSymbolCount;
+
+#define SYMBOL_ADDRESS(index)	((uint8_t *)(uint32_t)(gKernelSymbols[index].value & 0x3fffffff))
+
+#if KERNEL_PATCHER
+/*
+ * Kernel patches. Each patch searches the bytes of a symbol (match start within
+ * 'range' bytes from the symbol) or the file data of a segment, for 'find' (as
+ * compared under 'mask'), and writes 'replace' over each hit ('repeat' times,
+ * 'stride' bytes apart) until 'maxHits' hits were patched (0 is unlimited).
+ */
+
+#define kPatchSymbol		0
+#define kPatchSegment		1
+
+#define kPatchMaxLength		16
+#define kMaxKernelPatches	32	// Per call of ApplyKernelPatches().
+#define kPatchMaxHits		0xFFFF
+#define kPatchMaxSymbolLength	0xFFFF	// Limited by KernelSymbol.length
+
+typedef union
+{
+	uint64_t	quad[2];
+	uint8_t		byte[kPatchMaxLength];
+} PatchBytes;
+
+struct KernelPatch
+{
+	const char	* name;			// Symbol or segment name.
+	uint8_t		type;			// kPatchSymbol or kPatchSegment.
+	uint8_t		length;			// Number of bytes in find, mask and replace.
+	uint16_t	maxHits;		// 0 is unlimited.
+	uint8_t		repeat;
+	uint32_t	stride;
+	uint32_t	range;			// Only used for symbols.
+	const bool	* condition;	// Skipped when this is false (NULL is always applied).
+	PatchBytes	find;
+	PatchBytes	mask;
+	PatchBytes	replace;
+};
+
+#define PATCH_QUAD(value)	{ .quad = { (value), 0ULL } }
+#define PATCH_MASK_QUAD		{ .quad = { 0xffffffffffffffffULL, 0ULL } }
+
+static KernelPatch gKernelPatches[] =
+{
+#if (PATCH_KEXT_LOADING && ((MAKE_TARGET_OS & EL_CAPITAN) == EL_CAPITAN))
+	{ "__ZN6OSKext14loadExecutableEv", kPatchSymbol, 8, 1, 1, 0, 0x300, NULL,
+		PATCH_QUAD(LOAD_EXECUTABLE_TARGET_UINT64), PATCH_MASK_QUAD, PATCH_QUAD(LOAD_EXECUTABLE_PATCH_UINT64) },
+	#if PATCH_XCPM_SCOPE_MSRS
+	// Zeroes the first three entries of the table (0x30 bytes each).
+	{ "_xcpm_core_scope_msrs", kPatchSymbol, 8, 1, 3, 0x30, 0x3f, &gPlatform.CPU.CstConfigMsrLocked,
+		PATCH_QUAD(XCPM_SCOPE_MSRS_TARGET_UINT64), PATCH_MASK_QUAD, PATCH_QUAD(0ULL) },
+	#endif
+	#if PATCH_LOAD_EXTRA_KEXTS
+	{ "__ZN12KLDBootstrap21readStartupExtensionsEv", kPatchSymbol, 8, 1, 1, 0, 0x3f, NULL,
+		PATCH_QUAD(READ_STARTUP_EXTENSIONS_TARGET_UINT64), PATCH_MASK_QUAD, PATCH_QUAD(READ_STARTUP_EXTENSIONS_PATCH_UINT64) },
+	#endif
+#endif
+	{ NULL } // Terminator.
+};
+
+#if LOAD_KERNEL_PATCHES_PLIST
+static KernelPatch		* gPlistPatches;
+static int				gPlistPatchCount;
+#endif
+#endif
+
+// Segments of the image, filled in by DecodeSegment().
+#define kMaxStreamSegments	16
+
+typedef struct
+{
+	unsigned long	fileoff;
+	unsigned long	filesize;
+	unsigned long	vmaddr;
+	const char		* segname;	// Points into the load commands.
+} StreamSegment;
+
+static StreamSegment	gStreamSegments[kMaxStreamSegments];
+static int				gStreamSegmentCount;
+static unsigned long	gStreamFatOffset;
+static char				* gStreamLoadCommands;
+
 
 //==============================================================================
 // Public function.
@@ -129,31 +293,234 @@ long ThinFatFile(void **binary, unsigned long *length)
 // Called from DecodeKernel() in drivers.c
 
 long DecodeMachO(void *binary, entry_t *rentry, char **raddr, int *rsize)
+{
+	long ret = -1;
+
+	gBinaryAddress = (unsigned long)binary;
+
+	ret = DecodeLoadCommands(binary);
+
+	if (ret == 0)
+	{
+		ret = DecodeSymbols(rentry, raddr, rsize);
+	}
+
+	return ret;
+}
+
+
+//==============================================================================
+// Called from DecodeKernel() in drivers.c for a kernelcache that is being
+// decompressed in chunks (in file order). The first chunk must hold the Mach-O
+// header and load commands. Each chunk is copied straight to the segment(s)
+// that cover it, so that the image itself is never stored in full.
+
+long DecodeMachOChunk(void *data, unsigned long offset, unsigned long length)
+{
+	int index;
+	unsigned long start, end;
+
+	if (offset == 0)
+	{
+		long ret;
+		void * binary = data;
+		unsigned long size = 0;
+		struct mach_header * machHeader;
+
+		if ((ThinFatFile(&binary, &size) == 0) && (size == 0) && (gPlatform.ArchCPUType == CPU_TYPE_X86_64))
+		{
+			gPlatform.ArchCPUType = CPU_TYPE_I386;
+			ThinFatFile(&binary, &size);
+		}
+
+		gStreamFatOffset = ((unsigned long)binary - (unsigned long)data);
+		machHeader = (struct mach_header *)binary;
+
+		if ((machHeader->magic != MH_MAGIC) && (machHeader->magic != MH_MAGIC_64))
+		{
+			error("Mach-O file has a bad magic number!\n");
+			return -1;
+		}
+
+		// Both header types have sizeofcmds at the same offset.
+		size = machHeader->sizeofcmds + ((machHeader->magic == MH_MAGIC_64) ? sizeof(struct mach_header_64) : sizeof(struct mach_header));
+
+		if ((gStreamFatOffset + size) > length)
+		{
+			error("Mach-O load commands don't fit in the first chunk!\n");
+			return -1;
+		}
+
+		// Keep a copy of the load commands, for DecodeMachOFinish().
+		free(gStreamLoadCommands);
+		gStreamLoadCommands = malloc(size);
+
+		if (gStreamLoadCommands == NULL)
+		{
+			return -1;
+		}
+
+		bcopy(binary, gStreamLoadCommands, size);
+
+		gBinaryAddress = 0;
+
+		ret = DecodeLoadCommands(gStreamLoadCommands);
+
+		if (ret < 0 && gPlatform.ArchCPUType == CPU_TYPE_X86_64)
+		{
+			gPlatform.ArchCPUType = CPU_TYPE_I386;
+			ret = DecodeLoadCommands(gStreamLoadCommands);
+		}
+
+		if (ret < 0)
+		{
+			return -1;
+		}
+	}
+
+	// Skip what comes before the thin part of a fat file.
+	if (offset < gStreamFatOffset)
+	{
+		if ((offset + length) <= gStreamFatOffset)
+		{
+			return 0;
+		}
+
+		data = (void *)((unsigned long)data + (gStreamFatOffset - offset));
+		length -= (gStreamFatOffset - offset);
+		offset = 0;
+	}
+	else
+	{
+		offset -= gStreamFatOffset;
+	}
+
+	for (index = 0; index < gStreamSegmentCount; index++)
+	{
+		StreamSegment * segment = &gStreamSegments[index];
+
+		start = max(offset, segment->fileoff);
+		end = min(offset + length, segment->fileoff + segment->filesize);
+
+		if (start < end)
+		{
+			bcopy((char *)data + (start - offset), (char *)(segment->vmaddr + (start - segment->fileoff)), end - start);
+		}
+	}
+
+	return 0;
+}
+
+
+//==============================================================================
+// Called from DecodeKernel() in drivers.c once the last chunk has been passed
+// to DecodeMachOChunk().
+
+long DecodeMachOFinish(entry_t *rentry, char **raddr, int *rsize)
+{
+	long ret = DecodeSymbols(rentry, raddr, rsize);
+
+	free(gStreamLoadCommands);
+	gStreamLoadCommands = NULL;
+
+	return ret;
+}
+
+
+//==============================================================================
+// Called from DecodeKernel() in drivers.c for an uncompressed kernel, with the
+// first 'loaded' bytes of the file at binary. The rest of the load commands
+// is read when needed, after which each segment is read from the file that
+// OpenThinFatFile() left open, straight to its final address. Segments of a file
+// that was loaded as a whole (no fs_open) are copied instead.
+
+long DecodeMachOFile(void *binary, unsigned long loaded, entry_t *rentry, char **raddr, int *rsize)
+{
+	int index;
+	long count;
+	unsigned long size = 0;
+	unsigned long start = (unsigned long)binary;
+	struct mach_header * machHeader;
+
+	// A fat file that was loaded as a whole still needs to be thinned.
+	if ((ThinFatFile(&binary, &size) == 0) && (size == 0) && (gPlatform.ArchCPUType == CPU_TYPE_X86_64))
+	{
+		gPlatform.ArchCPUType = CPU_TYPE_I386;
+		ThinFatFile(&binary, &size);
+	}
+
+	loaded -= min(loaded, ((unsigned long)binary - start));
+	machHeader = (struct mach_header *)binary;
+
+	if ((machHeader->magic != MH_MAGIC) && (machHeader->magic != MH_MAGIC_64))
+	{
+		error("Mach-O file has a bad magic number!\n");
+		return -1;
+	}
+
+	// Both header types have sizeofcmds at the same offset.
+	size = machHeader->sizeofcmds + ((machHeader->magic == MH_MAGIC_64) ? sizeof(struct mach_header_64) : sizeof(struct mach_header));
+
+	if ((size > loaded) && (ReadThinFatFile((char *)binary + loaded, loaded, size - loaded) != (long)(size - loaded)))
+	{
+		error("Mach-O load commands read failed!\n");
+		return -1;
+	}
+
+	// Decodes the load commands (and fills in gStreamSegments).
+	if (DecodeMachOChunk(binary, 0, size) != 0)
+	{
+		return -1;
+	}
+
+	for (index = 0; index < gStreamSegmentCount; index++)
+	{
+		StreamSegment * segment = &gStreamSegments[index];
+
+		count = ReadThinFatFile((void *)segment->vmaddr, segment->fileoff, segment->filesize);
+
+		if ((count == 0) && ((segment->fileoff + segment->filesize) <= loaded))
+		{
+			bcopy((char *)binary + segment->fileoff, (char *)segment->vmaddr, segment->filesize);
+		}
+		else if (count != (long)segment->filesize)
+		{
+			error("Kernel segment read failed!\n");
+			return -1;
+		}
+	}
+
+	return DecodeMachOFinish(rentry, raddr, rsize);
+}
+
+
+//==============================================================================
+// Private function. Checks the Mach-O header and decodes the segment and thread
+// commands. Called from DecodeMachO() and DecodeMachOChunk()
+
+static long DecodeLoadCommands(void *binary)
 {
 	long ret						= -1;
 	long sectionNumber				= 0;
 
-	unsigned int vmaddr				= ~0;
-	unsigned int vmend				= 0;
-	unsigned int entry				= 0;
 	unsigned int load_addr			= 0;
 	unsigned int load_size			= 0;
-	unsigned int textSegmentAddress	= 0;
-	unsigned int vldSegmentAddress	= 0;
 
-	unsigned long ncmds				= 0;
 	unsigned long cmdBase			= 0;
 	unsigned long cmd				= 0;
 	unsigned long cmdsize			= 0;
-	unsigned long cmdstart			= 0;
 	unsigned long cnt				= 0;
-	unsigned long listSize			= 0;
 
-	gBinaryAddress = (unsigned long)binary;
+	gVMAddr = ~0;
+	gVMEnd = 0;
+	gEntry = 0;
+	gTextSegmentAddress = 0;
+	gVldSegmentAddress = 0;
+	gStreamSegmentCount = 0;
 
 	if (gPlatform.ArchCPUType == CPU_TYPE_X86_64)
 	{
-		struct mach_header_64 * machHeader = (struct mach_header_64 *)(gBinaryAddress);
+		struct mach_header_64 * machHeader = (struct mach_header_64 *)binary;
 
 		if (machHeader->magic != MH_MAGIC_64)
 		{
@@ -161,8 +528,8 @@ long DecodeMachO(void *binary, entry_t *rentry, char **raddr, int *rsize)
 			return -1;
 		}
 
-		listSize = sizeof(struct nlist_64);
-		cmdstart = (unsigned long)gBinaryAddress + sizeof(struct mach_header_64);
+		gListSize = sizeof(struct nlist_64);
+		gCmdStart = (unsigned long)binary + sizeof(struct mach_header_64);
 #if DEBUG
 		printf("In DecodeMachO()\n");
 		printf("magic:      %x\n", (unsigned)machHeader->magic);
@@ -174,11 +541,11 @@ long DecodeMachO(void *binary, entry_t *rentry, char **raddr, int *rsize)
 		printf("flags:      %x\n", (unsigned)machHeader->flags);
 		sleep(5);
 #endif
-		ncmds = machHeader->ncmds;
+		gNcmds = machHeader->ncmds;
 	}
 	else // if (gPlatform.ArchCPUType == CPU_TYPE_I386)
 	{
-		struct mach_header * machHeader = (struct mach_header *)(gBinaryAddress);
+		struct mach_header * machHeader = (struct mach_header *)binary;
 
 		if (machHeader->magic != MH_MAGIC)
 		{
@@ -186,8 +553,8 @@ long DecodeMachO(void *binary, entry_t *rentry, char **raddr, int *rsize)
 			return -1;
 		}
 
-		listSize = sizeof(struct nlist);
-		cmdstart = (unsigned long)gBinaryAddress + sizeof(struct mach_header);
+		gListSize = sizeof(struct nlist);
+		gCmdStart = (unsigned long)binary + sizeof(struct mach_header);
 #if DEBUG
 		printf("In DecodeMachO()\n");
 		printf("magic:      %x\n", (unsigned)machHeader->magic);
@@ -199,12 +566,12 @@ long DecodeMachO(void *binary, entry_t *rentry, char **raddr, int *rsize)
 		printf("flags:      %x\n", (unsigned)machHeader->flags);
 		sleep(5);
 #endif
-		ncmds = machHeader->ncmds;
+		gNcmds = machHeader->ncmds;
 	}
 
-	cmdBase = cmdstart;
+	cmdBase = gCmdStart;
 
-	for (cnt = 0; cnt < ncmds; cnt++)
+	for (cnt = 0; cnt < gNcmds; cnt++)
 	{
 		cmd = ((long *)cmdBase)[0];
 		cmdsize = ((long *)cmdBase)[1];
@@ -217,33 +584,26 @@ long DecodeMachO(void *binary, entry_t *rentry, char **raddr, int *rsize)
 
 				if (sectionNumber == 1) // __TEXT,__text
 				{
-					textSegmentAddress = cmdBase;
+					gTextSegmentAddress = cmdBase;
 					ret = 0;
 				}
 				else if (sectionNumber == 25) // __KLD,__text
 				{
-					vldSegmentAddress = cmdBase;
+					gVldSegmentAddress = cmdBase;
 					ret = 0;
 				}
 
 				if (load_size != 0 && load_addr >= KERNEL_ADDR)
 				{
-					vmaddr = min(vmaddr, load_addr);
-					vmend = max(vmend, load_addr + load_size);
+					gVMAddr = min(gVMAddr, load_addr);
+					gVMEnd = max(gVMEnd, load_addr + load_size);
 				}
 
 				break;
 
-			case LC_SYMTAB:
-				initKernelVersionInfo(cmdBase, listSize, textSegmentAddress);
-#if (PATCH_KEXT_LOADING && ((MAKE_TARGET_OS & EL_CAPITAN) == EL_CAPITAN))
-				patchLoadExecutable(cmdBase, listSize, textSegmentAddress, vldSegmentAddress);
-#endif
-				break;
-
 			case LC_MAIN:	/* Mountain Lion's replacement for LC_UNIXTHREAD */
 			case LC_UNIXTHREAD:
-				ret = DecodeUnixThread(cmdBase, &entry);
+				ret = DecodeUnixThread(cmdBase, &gEntry);
 				break;
 
 			default:
@@ -261,313 +621,517 @@ long DecodeMachO(void *binary, entry_t *rentry, char **raddr, int *rsize)
 		cmdBase += cmdsize;
 	}
 
-	*rentry = (entry_t)( (unsigned long) entry & 0x3fffffff );
-	*rsize = vmend - vmaddr;
-	*raddr = (char *)vmaddr;
+	return ret;
+}
 
-#if ADD_SYMTAB
-	cmdBase = cmdstart;
 
-	for (cnt = 0; cnt < ncmds; cnt++)
+//==============================================================================
+// Private function. Runs the symbol table based work, after all segments are
+// in place. Called from DecodeMachO() and DecodeMachOFinish()
+
+static long DecodeSymbols(entry_t *rentry, char **raddr, int *rsize)
+{
+	unsigned long cmdBase	= gCmdStart;
+	unsigned long cnt		= 0;
+
+	*rentry = (entry_t)( (unsigned long) gEntry & 0x3fffffff );
+	*rsize = gVMEnd - gVMAddr;
+	*raddr = (char *)gVMAddr;
+
+	for (cnt = 0; cnt < gNcmds; cnt++)
 	{
-		cmd = ((long *)cmdBase)[0];
-		cmdsize = ((long *)cmdBase)[1];
-		
-		if (cmd == LC_SYMTAB)
+		if (((long *)cmdBase)[0] == LC_SYMTAB)
 		{
+#if LOAD_KERNEL_PATCHES_PLIST
+			if (gPlistPatches == NULL)
+			{
+				// Adds the symbols of plist patches to gKernelSymbols.
+				loadKernelPatches();
+			}
+#endif
+			ScanSymbols(cmdBase, gListSize);
+			initKernelVersionInfo();
+#if KERNEL_PATCHER
+			patchKernel();
+#endif
+#if ADD_SYMTAB
 			if (DecodeSymbolTable(cmdBase) != 0)
 			{
 				return -1;
 			}
+#endif
 		}
 
-		cmdBase += cmdsize;
+		cmdBase += ((long *)cmdBase)[1];
 	}
-#endif
-	return ret;
+
+	return 0;
 }
 
-#if (PATCH_KEXT_LOADING && ((MAKE_TARGET_OS & EL_CAPITAN) == EL_CAPITAN))
 
 //==============================================================================
-// Private function. Called from DecodeMachO()
+// Private function. Returns the address of a range of the Mach-O file, or 0
+// when a streamed image has no segment covering all of it.
 
-static long patchLoadExecutable(unsigned long cmdBase, long listSize, unsigned long textSegmentAddress, unsigned long vldSegmentAddress)
+static unsigned long FileOffsetToAddress(unsigned long offset, unsigned long length)
 {
-#if (DEBUG_BOOT && PATCH_KEXT_LOADING && ((MAKE_TARGET_OS & EL_CAPITAN) == EL_CAPITAN))
-	printf("patchLoadExecutable() called\n");
-	sleep(1);
-#endif
+	int index;
 
-	char * symbolName = NULL;
+	if (gBinaryAddress)
+	{
+		return (gBinaryAddress + offset);
+	}
 
-	// Skip the first 3000 symbols, to speed up the search process.
-	int skippedSymbolCount	= 0; // (3000 * listSize);
+	for (index = 0; index < gStreamSegmentCount; index++)
+	{
+		StreamSegment * segment = &gStreamSegments[index];
 
-	long symbolNumber		= 0;
+		if ((offset >= segment->fileoff) && ((offset + length) <= (segment->fileoff + segment->filesize)))
+		{
+			return (segment->vmaddr + (offset - segment->fileoff));
+		}
+	}
 
+	return 0;
+}
+
+//==============================================================================
+// Private function. Called from DecodeSymbols()
+//
+// Walks the symbol table once, and stores the value of each symbol listed in
+// gKernelSymbols. Each candidate name is hashed (and measured) in a single loop,
+// so that strcmp is only called for names with a matching section, length and
+// hash. This replaces a full symbol table walk for each patcher and probe.
+
+static long ScanSymbols(unsigned long cmdBase, long listSize)
+{
 	struct symtab_command * symtab = (struct symtab_command *)cmdBase;
-	struct segment_command_64 * textSegment = (struct segment_command_64 *)textSegmentAddress;
-	// struct segment_command_64 * vldSegment = (struct segment_command_64 *)vldSegmentAddress;
 
-	void * stringTable = (void *)(gBinaryAddress + symtab->stroff);
+	char * stringTable = (char *)FileOffsetToAddress(symtab->stroff, symtab->strsize);
+
+	uint32_t pointer = FileOffsetToAddress(symtab->symoff, (symtab->nsyms * listSize));
+
+	uint32_t sections = 0;
+	uint32_t symbolNumber, hash;
+
+	uint64_t value;
 
-	uint32_t pointer = (gBinaryAddress + symtab->symoff + skippedSymbolCount);
+	int index, found = 0;
+
+	const char * symbolName;
+	const char * s;
+
+	for (index = 0; index < gKernelSymbolCount; index++)
+	{
+		KernelSymbol * symbol = &gKernelSymbols[index];
+
+		for (hash = 2166136261UL, s = symbol->name; *s; s++)
+		{
+			hash = ((hash ^ (uint8_t)*s) * 16777619UL);
+		}
+
+		symbol->hash	= hash;
+		symbol->length	= (s - symbol->name);
+		symbol->value	= 0;
+
+		sections |= symbol->section ? (1 << symbol->section) : 0xffffffff;
+	}
+
+	if ((stringTable == NULL) || (pointer == 0))
+	{
+		return -1;
+	}
 
-	while (symbolNumber < symtab->nsyms)
+	for (symbolNumber = 0; (symbolNumber < symtab->nsyms) && (found < gKernelSymbolCount); symbolNumber++, pointer += listSize)
 	{
+		// Both nlist types have n_strx and n_sect at the same offset.
 		struct nlist_64 * nl = (struct nlist_64 *)pointer;
 
-#if PATCH_KEXT_LOADING
-		if ((nl->n_sect == 1 /* __TEXT,__text */) && nl->n_value)
+		if (((nl->n_sect > 31) && (sections != 0xffffffff)) || ((sections & (1 << (nl->n_sect & 31))) == 0))
 		{
-			symbolName = (char *)stringTable + nl->n_un.n_strx;
+			continue;
+		}
 
-			if (strcmp(symbolName, "__ZN6OSKext14loadExecutableEv") == 0)
-			{
-				int64_t offset = (nl->n_value - textSegment->vmaddr);
-				uint64_t startAddress = (uint64_t)(textSegment->vmaddr + offset);
-				uint64_t endAddress = (startAddress + 0x300);
+		value = (listSize == sizeof(struct nlist_64)) ? nl->n_value : ((struct nlist *)pointer)->n_value;
 
-				/* printf("__ZN6OSKext14loadExecutableEv found!\n");
- 				printf("offset..............: 0x%llx\n", offset);
-				printf("textSegment->vmaddr.: 0x%llx\n", textSegment->vmaddr);
-				printf("textSegment->fileoff: 0x%llx\n", textSegment->fileoff);
-				printf("startAddress........: 0x%llx\n", startAddress);
-				printf("endAddress..........: 0x%llx\n", endAddress);
-				sleep(5); */
+		if (value == 0)
+		{
+			continue;
+		}
 
-				unsigned char * p = (unsigned char *)startAddress;
+		symbolName = stringTable + nl->n_un.n_strx;
 
-				for (; p <= (unsigned char *)endAddress; p++)
-				{
-					if (*(uint64_t *)p == LOAD_EXECUTABLE_TARGET_UINT64)
-					{
-						/* printf("Found @ 0x%llx ", (uint64_t)p - startAddress);
-						printf("Symbol-number: %ld\n", (symbolNumber + (skippedSymbolCount / listSize) + 1));
-						sleep(3); */
+		for (hash = 2166136261UL, s = symbolName; *s; s++)
+		{
+			hash = ((hash ^ (uint8_t)*s) * 16777619UL);
+		}
 
-						*(uint64_t *)p = LOAD_EXECUTABLE_PATCH_UINT64;
-						p = (unsigned char *)endAddress;
-					}
-				}
+		for (index = 0; index < gKernelSymbolCount; index++)
+		{
+			KernelSymbol * symbol = &gKernelSymbols[index];
+
+			if ((symbol->hash == hash) && ((symbol->section == nl->n_sect) || (symbol->section == 0)) && (symbol->length == (s - symbolName)) &&
+				(symbol->value == 0) && (strcmp(symbolName, symbol->name) == 0))
+			{
+				symbol->value = value;
+				found++;
+				break;
 			}
 		}
+	}
+
+#if DEBUG
+	printf("ScanSymbols(): found %d of %d symbols (%d of %d iterated).\n", found, gKernelSymbolCount, symbolNumber, symtab->nsyms);
+	sleep(5);
 #endif
 
-#if PATCH_XCPI_SCOPE_MSRS
-	#if PATCH_KEXT_LOADING
-		else
-	#endif
-		if (((nl->n_sect == 8 /* __DATA,__data */) && nl->n_value) && gPlatform.CPU.CstConfigMsrLocked)
+	return 0;
+}
+
+#if KERNEL_PATCHER
+
+//==============================================================================
+// Private function. Sets the match start range of a patch. Returns false when
+// the symbol or segment was not found.
+
+static bool GetPatchRegion(KernelPatch * patch, uint8_t ** start, uint8_t ** end)
+{
+	int index;
+
+	if (patch->type == kPatchSegment)
+	{
+		for (index = 0; index < gStreamSegmentCount; index++)
 		{
-			symbolName = (char *)stringTable + nl->n_un.n_strx;
-		
-			if (strcmp(symbolName, "_xcpm_core_scope_msrs") == 0)
+			StreamSegment * segment = &gStreamSegments[index];
+
+			if ((strncmp(segment->segname, patch->name, 16) == 0) && (segment->filesize >= patch->length))
 			{
-				int64_t offset = (nl->n_value - textSegment->vmaddr);
-				uint64_t startAddress = (uint64_t)(textSegment->vmaddr + offset);
-				uint64_t endAddress = (startAddress + 0x3f);
-
-				/* printf("_xcpm_core_scope_msrs found!\n");
-				printf("offset..............: 0x%llx\n", offset);
-				printf("textSegment->vmaddr.: 0x%llx\n", textSegment->vmaddr);
-				printf("textSegment->fileoff: 0x%llx\n", textSegment->fileoff);
-				printf("startAddress........: 0x%llx\n", startAddress);
-				printf("endAddress..........: 0x%llx\n", endAddress);
-				sleep(5); */
-
-				unsigned char * p = (unsigned char *)startAddress;
-				
-				for (; p <= (unsigned char *)endAddress; p++)
-				{
-					// Note: We don't really need this check.
-					if (*(uint64_t *)p == XCPM_SCOPE_MSRS_TARGET_UINT64)
-					{
-						/* printf("Found @ 0x%llx ", (uint64_t)p - startAddress);
-						printf("Symbol-number: %ld\n", (symbolNumber + (skippedSymbolCount / listSize) + 1));
-						sleep(3); */
-						
-						*(uint64_t *)p = 0x0000000000000000ULL;
-						p += 0x30;
-						*(uint64_t *)p = 0x0000000000000000ULL;
-						p += 0x30;
-						*(uint64_t *)p = 0x0000000000000000ULL;
-						p = (unsigned char *)endAddress;
-					}
-				}
+				// Segments are already in place (see DecodeSegment).
+				*start = (uint8_t *)segment->vmaddr;
+				*end = *start + (segment->filesize - patch->length) + 1;
+
+				return true;
 			}
 		}
-#endif
-
-#if PATCH_LOAD_EXTRA_KEXTS
-	#if (PATCH_KEXT_LOADING || PATCH_XCPI_SCOPE_MSRS)
-		else
-	#endif
-		if ((nl->n_sect == 25 /* __KLD,__text */) && nl->n_value)
+	}
+	else
+	{
+		for (index = 0; index < gKernelSymbolCount; index++)
 		{
-			symbolName = (char *)stringTable + nl->n_un.n_strx;
-			
-			if (strcmp(symbolName, "__ZN12KLDBootstrap21readStartupExtensionsEv") == 0)
+			if (gKernelSymbols[index].value && (strcmp(gKernelSymbols[index].name, patch->name) == 0))
 			{
-				int64_t offset = (nl->n_value - textSegment->vmaddr);
-				uint64_t startAddress = (uint64_t)(textSegment->vmaddr + offset);
-				uint64_t endAddress = (startAddress + 0x3f);
-				
-				/* printf("__ZN12KLDBootstrap21readStartupExtensionsEv found!\n");
-				printf("offset..............: 0x%llx\n", offset);
-				printf("vldSegment->vmaddr..: 0x%llx\n", vldSegment->vmaddr);
-				printf("vldSegment->fileoff.: 0x%llx\n", vldSegment->fileoff);
-				printf("startAddress........: 0x%llx\n", startAddress);
-				printf("endAddress..........: 0x%llx\n", endAddress);
-				sleep(5); */
- 
-				unsigned char * p = (unsigned char *)startAddress;
-				
-				for (; p <= (unsigned char *)endAddress; p++)
-				{
-					if (*(uint64_t *)p == READ_STARTUP_EXTENSIONS_TARGET_UINT64)
-					{
-						/* printf("Found @ 0x%llx ", (uint64_t)p - startAddress);
-						printf("Symbol-number: %ld\n", (symbolNumber + (skippedSymbolCount / listSize) + 1));
-						sleep(3); */
-						
-						*(uint64_t *)p = READ_STARTUP_EXTENSIONS_PATCH_UINT64;
-						p = (unsigned char *)endAddress;
-					}
-				}
+				*start = SYMBOL_ADDRESS(index);
+				*end = *start + patch->range + 1;
+
+				return true;
 			}
 		}
-#endif
-		symbolNumber++;
-		pointer += listSize; // Point to next symbol.
 	}
 
-	return 0;
+	return false;
 }
-#endif
+
 
 //==============================================================================
-// Private function. Called from DecodeMachO()
+// Private function. Applies up to kMaxKernelPatches patches. Patches for the
+// same symbol/segment (and range) are grouped, so that each region is scanned
+// only once. The first byte of each pending patch is checked before the rest.
 
-static long initKernelVersionInfo(unsigned long cmdBase, long listSize, unsigned int textSegmentVMAddress)
+static void ApplyKernelPatches(KernelPatch * patches, int count)
 {
-	struct symtab_command * symtab = (struct symtab_command *)cmdBase;
+	int i, j, k, r;
 
-	/*
-	 * Reverse search is quicker for symbols at the end of the symbol table (example with 20496 symbols):
-	 *
-	 * _version_revision	is symbol 18865 – first target symbol, iterated symbols: 1631
-	 * _version_minor		is symbol 18863 – second target symbol, iterated symbols: 1633
-	 * _version_major		is symbol 18862 – last target symbol, iterated symbols: 1634
-	 *
-	 * versus:
-	 *
-	 * _version_major		is symbol 18862 – first target symbol, iterated symbols: 18862
-	 * _version_minor		is symbol 18863 – ssecond target symbol, iterated symbols: 18863
-	 * _version_revision	is symbol 18865 – last target symbol, iterated symbols: 18865
-	 */
+	uint32_t hits[kMaxKernelPatches];
+	uint8_t * start, * end, * p;
 
-	const char * targetSymbols[] = { "_version_revision", "_version_minor", "_version_major" };
+	uint32_t pending = 0;
+	uint32_t group;
 
-	char * symbolName = NULL;
-	char * loadBuffer = (char *)gBinaryAddress;
+	if (count > kMaxKernelPatches)
+	{
+		count = kMaxKernelPatches;
+	}
 
-	void * stringTable = (void *)(gBinaryAddress + symtab->stroff);
+	for (i = 0; i < count; i++)
+	{
+		if ((patches[i].condition == NULL) || *patches[i].condition)
+		{
+			pending |= (1 << i);
+		}
+	}
 
-	short index								= 0;
+	for (i = 0; i < count; i++)
+	{
+		if ((pending & (1 << i)) == 0)
+		{
+			continue;
+		}
 
-	long symbolOffset						= 0;
-	long symbolLength						= 0;
-	long symbolNumber						= symtab->nsyms;
+		group = 0;
 
-	uint32_t pointer = gBinaryAddress + symtab->symoff + ((symtab->nsyms - 1) * listSize);
+		for (j = i; j < count; j++)
+		{
+			if ((pending & (1 << j)) && (patches[j].type == patches[i].type) && (patches[j].range == patches[i].range) &&
+				(strcmp(patches[j].name, patches[i].name) == 0))
+			{
+				group |= (1 << j);
+				hits[j] = 0;
+			}
+		}
 
-#if ((MAKE_TARGET_OS & SNOW_LEOPARD) == SNOW_LEOPARD)
-	if (gPlatform.ArchCPUType == CPU_TYPE_X86_64)
-	{
+		pending &= ~group;
+
+		if (!GetPatchRegion(&patches[i], &start, &end))
+		{
+#if DEBUG
+			printf("ApplyKernelPatches(): %s not found!\n", patches[i].name);
 #endif
-		struct nlist_64 * nl = (struct nlist_64 *)pointer;
-	
-		while (symbolNumber > 0)
+			continue;
+		}
+
+		for (p = start; (p < end) && group; p++)
 		{
-			nl = (struct nlist_64 *)pointer;
-			
-			if ((nl->n_sect == 2 /* __TEXT,__const */) && nl->n_value)
+			for (j = i; j < count; j++)
 			{
-				symbolName = (char *)stringTable + nl->n_un.n_strx;
-				symbolLength = strlen(symbolName);
-				symbolOffset = (nl->n_value - textSegmentVMAddress);
-				
-				if (symbolLength && (strcmp(symbolName, targetSymbols[index]) == 0))
+				KernelPatch * patch = &patches[j];
+
+				if (((group & (1 << j)) == 0) || ((p[0] & patch->mask.byte[0]) != patch->find.byte[0]))
 				{
-					switch(index)
+					continue;
+				}
+
+				for (k = 1; (k < patch->length) && ((p[k] & patch->mask.byte[k]) == patch->find.byte[k]); k++);
+
+				if (k == patch->length)
+				{
+					for (r = 0; r < patch->repeat; r++)
 					{
-						case 0:
-							gPlatform.KERNEL.versionRevision = (uint8_t)loadBuffer[symbolOffset];
-							index++;
-							break;
-							
-						case 1:
-							gPlatform.KERNEL.versionMinor = (uint8_t)loadBuffer[symbolOffset];
-							index++;
-							break;
-							
-						case 2:
-							gPlatform.KERNEL.versionMajor = (uint8_t)loadBuffer[symbolOffset];
-							symbolNumber = 0;
-							break;
+						bcopy(patch->replace.byte, p + (r * patch->stride), patch->length);
+					}
+
+#if DEBUG
+					printf("ApplyKernelPatches(): %s patched @ 0x%x\n", patch->name, (uint32_t)p);
+#endif
+
+					if (++hits[j] == patch->maxHits)
+					{
+						group &= ~(1 << j);
 					}
 				}
 			}
-			
-			symbolNumber--;
-			pointer -= listSize;
 		}
-#if ((MAKE_TARGET_OS & SNOW_LEOPARD) == SNOW_LEOPARD)
 	}
-	else // 32-bit compatibility code.
+}
+
+#if LOAD_KERNEL_PATCHES_PLIST
+
+//==============================================================================
+// Private function. Converts a hex string (spaces allowed) into bytes. Returns
+// the number of bytes, or 0 for a missing/invalid string.
+
+static int ParseHexBytes(TagPtr tag, uint8_t * bytes)
+{
+	int digits = 0;
+	char c;
+	const char * s;
+
+	if ((tag == NULL) || (tag->type != kTagTypeString))
+	{
+		return 0;
+	}
+
+	for (s = tag->string; (c = *s); s++)
 	{
-		struct nlist * nl = (struct nlist *)pointer;
-		
-		while (symbolNumber > 0)
+		if ((c >= '0') && (c <= '9'))
 		{
-			nl = (struct nlist *)pointer;
-			
-			if ((nl->n_sect == 2 /* __TEXT,__const */) && nl->n_value)
+			c -= '0';
+		}
+		else if (((c | 0x20) >= 'a') && ((c | 0x20) <= 'f'))
+		{
+			c = ((c | 0x20) - 'a' + 10);
+		}
+		else if (c == ' ')
+		{
+			continue;
+		}
+		else
+		{
+			return 0;
+		}
+
+		if (digits == (kPatchMaxLength * 2))
+		{
+			return 0;
+		}
+
+		bytes[digits >> 1] = ((bytes[digits >> 1] << 4) | c);
+		digits++;
+	}
+
+	return (digits & 1) ? 0 : (digits >> 1);
+}
+
+
+//==============================================================================
+// Private function. Called from DecodeSymbols()
+//
+// Reads the optional /Extra/KernelPatches.plist with a 'Patches' array of dict
+// entries. Each entry has a 'Symbol' or 'Segment' name, and 'Find', 'Replace'
+// and optional 'Mask' hex strings (1-16 bytes each). Optional are 'Range' (hex,
+// for symbols) and 'Count' (maximum number of hits, 0 is unlimited, up to 65535).
+// Note: all values must be strings, and the file is limited to IO_CONFIG_DATA_SIZE
+// bytes.
+
+static void loadKernelPatches(void)
+{
+	int index;
+
+	const char * path = "/Extra/KernelPatches.plist";
+
+	TagPtr array, dict, tag;
+
+	config_file_t * config = malloc(sizeof(config_file_t));
+
+	gPlistPatches = malloc(kMaxPlistPatches * sizeof(KernelPatch));
+
+	if ((config == NULL) || (gPlistPatches == NULL) || (loadConfigFile(path, config) != EFI_SUCCESS))
+	{
+		free(config);
+		return;
+	}
+
+	array = XMLGetProperty(config->dictionary, "Patches");
+
+	if ((array == NULL) || (array->type != kTagTypeArray))
+	{
+		free(config);
+		return;
+	}
+
+	for (dict = array->tag; dict && (gPlistPatchCount < kMaxPlistPatches); dict = dict->tagNext)
+	{
+		KernelPatch * patch = &gPlistPatches[gPlistPatchCount];
+
+		bzero(patch, sizeof(KernelPatch));
+
+		if ((tag = XMLGetProperty(dict, "Symbol")) && (tag->type == kTagTypeString))
+		{
+			patch->type = kPatchSymbol;
+		}
+		else if ((tag = XMLGetProperty(dict, "Segment")) && (tag->type == kTagTypeString))
+		{
+			patch->type = kPatchSegment;
+		}
+		else
+		{
+			continue;
+		}
+
+		patch->name = tag->string;
+
+		if ((patch->type == kPatchSymbol) && (strlen(patch->name) > kPatchMaxSymbolLength))
+		{
+			error("KernelPatches.plist: Symbol name exceeds %d characters (skipped)\n", kPatchMaxSymbolLength);
+			continue;
+		}
+
+		patch->repeat = 1;
+		patch->length = ParseHexBytes(XMLGetProperty(dict, "Find"), patch->find.byte);
+
+		if ((patch->length == 0) || (ParseHexBytes(XMLGetProperty(dict, "Replace"), patch->replace.byte) != patch->length))
+		{
+			error("KernelPatches.plist: invalid patch for %s (skipped)\n", patch->name);
+			continue;
+		}
+
+		if (ParseHexBytes(XMLGetProperty(dict, "Mask"), patch->mask.byte) != patch->length)
+		{
+			memset(patch->mask.byte, 0xff, kPatchMaxLength);
+		}
+
+		// Find bits outside of the mask would never match.
+		patch->find.quad[0] &= patch->mask.quad[0];
+		patch->find.quad[1] &= patch->mask.quad[1];
+
+		if ((tag = XMLGetProperty(dict, "Range")) && (tag->type == kTagTypeString))
+		{
+			patch->range = strtoul(tag->string, NULL, 16);
+		}
+
+		if ((tag = XMLGetProperty(dict, "Count")) && (tag->type == kTagTypeString))
+		{
+			unsigned long count = strtoul(tag->string, NULL, 10);
+
+			if (count > kPatchMaxHits)
 			{
-				symbolName = (char *)stringTable + nl->n_un.n_strx;
-				symbolLength = strlen(symbolName);
-				symbolOffset = (nl->n_value - textSegmentVMAddress);
-				
-				if (symbolLength && (strcmp(symbolName, targetSymbols[index]) == 0))
-				{
-					switch(index)
-					{
-						case 0:
-							gPlatform.KERNEL.versionRevision = (uint8_t)loadBuffer[symbolOffset];
-							index++;
-							break;
-							
-						case 1:
-							gPlatform.KERNEL.versionMinor = (uint8_t)loadBuffer[symbolOffset];
-							index++;
-							break;
-							
-						case 2:
-							gPlatform.KERNEL.versionMajor = (uint8_t)loadBuffer[symbolOffset];
-							symbolNumber = 0;
-							break;
-					}
-				}
+				error("KernelPatches.plist: Count for %s exceeds %d (skipped)\n", patch->name, kPatchMaxHits);
+				continue;
+			}
+
+			patch->maxHits = count;
+		}
+
+		if (patch->type == kPatchSymbol)
+		{
+			// Add the symbol to the list for ScanSymbols(), unless it is already there.
+			for (index = 0; (index < gKernelSymbolCount) && strcmp(gKernelSymbols[index].name, patch->name); index++);
+
+			if (index == gKernelSymbolCount)
+			{
+				gKernelSymbols[gKernelSymbolCount].name = patch->name;
+				gKernelSymbols[gKernelSymbolCount].section = 0; // Any.
+				gKernelSymbolCount++;
 			}
-			
-			symbolNumber--;
-			pointer -= listSize;
 		}
+
+		gPlistPatchCount++;
 	}
+
+	// The names are XML symbols, which do not live in the plist buffer.
+	free(config);
+}
+#endif
+
+
+//==============================================================================
+// Private function. Called from DecodeSymbols()
+
+static void patchKernel(void)
+{
+#if (DEBUG_BOOT && KERNEL_PATCHER)
+	printf("patchKernel() called\n");
+	sleep(1);
+#endif
+
+	ApplyKernelPatches(gKernelPatches, (sizeof(gKernelPatches) / sizeof(KernelPatch)) - 1);
+
+#if LOAD_KERNEL_PATCHES_PLIST
+	ApplyKernelPatches(gPlistPatches, gPlistPatchCount);
+#endif
+}
 #endif
 
+//==============================================================================
+// Private function. Called from DecodeSymbols()
+
+static long initKernelVersionInfo(void)
+{
+	// Segments are already in place (see DecodeSegment).
+	if (gKernelSymbols[kVersionMajor].value)
+	{
+		gPlatform.KERNEL.versionMajor = *SYMBOL_ADDRESS(kVersionMajor);
+	}
+
+	if (gKernelSymbols[kVersionMinor].value)
+	{
+		gPlatform.KERNEL.versionMinor = *SYMBOL_ADDRESS(kVersionMinor);
+	}
+
+	if (gKernelSymbols[kVersionRevision].value)
+	{
+		gPlatform.KERNEL.versionRevision = *SYMBOL_ADDRESS(kVersionRevision);
+	}
+
 #if DEBUG
 	printf("gPlatform.KERNEL.versionMmR: %d.%d.%d\n", gPlatform.KERNEL.versionMajor, gPlatform.KERNEL.versionMinor, gPlatform.KERNEL.versionRevision);
 	sleep(5);
@@ -577,7 +1141,7 @@ static long initKernelVersionInfo(unsigned long cmdBase, long listSize, unsigned
 }
 
 //==============================================================================
-// Private function. Called from DecodeMachO()
+// Private function. Called from DecodeLoadCommands()
 // Refactoring and segment name fix for OS X 10.6+ by DHP in 2010.
 
 static long DecodeSegment(long cmdBase, unsigned int *load_addr, unsigned int *load_size)
@@ -646,7 +1210,24 @@ static long DecodeSegment(long cmdBase, unsigned int *load_addr, unsigned int *l
 		// Copy from file load area.
 		if (filesize > 0)
 		{
-			bcopy((char *)fileAddress, (char *)vmaddr, vmsize > filesize ? filesize : vmsize);
+			if (gBinaryAddress)
+			{
+				bcopy((char *)fileAddress, (char *)vmaddr, vmsize > filesize ? filesize : vmsize);
+			}
+
+			if (gStreamSegmentCount < kMaxStreamSegments)
+			{
+				// For streamed images (gBinaryAddress is 0) DecodeMachOChunk() copies the data.
+				gStreamSegments[gStreamSegmentCount].fileoff	= (fileAddress - gBinaryAddress);
+				gStreamSegments[gStreamSegmentCount].filesize	= vmsize > filesize ? filesize : vmsize;
+				gStreamSegments[gStreamSegmentCount].vmaddr		= vmaddr;
+				gStreamSegments[gStreamSegmentCount].segname	= segmentName;
+				gStreamSegmentCount++;
+			}
+			else
+			{
+				stop("Too many kernel segments");
+			}
 		}
 
 		// Zero space at the end of the segment.
@@ -669,7 +1250,7 @@ static long DecodeSegment(long cmdBase, unsigned int *load_addr, unsigned int *l
 
 
 //==============================================================================
-// Private function. Called from DecodeMachO()
+// Private function. Called from DecodeLoadCommands()
 
 static long DecodeUnixThread(long cmdBase, unsigned int *entry)
 {
@@ -709,11 +1290,11 @@ static long DecodeUnixThread(long cmdBase, unsigned int *entry)
 
 #if ADD_SYMTAB
 //==============================================================================
-// Private function. Called from DecodeMachO()
+// Private function. Called from DecodeSymbols()
 
 static long DecodeSymbolTable(long cmdBase)
 {
-	long tmpAddr, symsSize, totalSize;
+	long tmpAddr, symsSize, totalSize, sourceAddr;
 	long gSymbolTableAddr;
 	long gSymbolTableSize;
 	
@@ -729,6 +1310,12 @@ static long DecodeSymbolTable(long cmdBase)
 	symsSize = symTab->stroff - symTab->symoff;
 	totalSize = symsSize + symTab->strsize;
 
+	// Not covered by a segment of a streamed image (no symbols for the kernel).
+	if ((sourceAddr = FileOffsetToAddress(symTab->symoff, totalSize)) == 0)
+	{
+		return 0;
+	}
+
 	gSymbolTableSize = totalSize + sizeof(struct symtab_command);
 	gSymbolTableAddr = AllocateKernelMemory(gSymbolTableSize);
 	// Add the SymTab to the memory-map.
@@ -742,7 +1329,7 @@ static long DecodeSymbolTable(long cmdBase)
 	symTableSave->stroff = tmpAddr + symsSize;
 	symTableSave->strsize = symTab->strsize;
 	
-	bcopy((char *)(gBinaryAddress + symTab->symoff), (char *)tmpAddr, totalSize);
+	bcopy((char *)sourceAddr, (char *)tmpAddr, totalSize);
 
 	return 0;
 }
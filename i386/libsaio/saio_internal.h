@@ -51,6 +51,7 @@ extern void		bios(biosBuf_t *bb);
 extern int		bgetc(void);
 extern int		biosread(int dev, int cyl, int head, int sec, int num);
 extern int		ebiosread(int dev, unsigned long long sec, int count);
+extern int		ebiosreadflat(int dev, unsigned long long sec, int count, void * buffer);
 extern int		get_drive_info(int drive, struct driveInfo *dp);
 extern void		putc(int ch);
 extern void		putca(int ch, int attr, int repeat);
@@ -88,8 +89,9 @@ extern void		moveKernelBootArgs(void);
 
 
 /* cache.c */
+extern void		CacheFlush(CICell ih);
 extern void		CacheReset();
-extern void		CacheInit(CICell ih, long blockSize);
+extern void		CacheInit(void);
 extern long		CacheRead(CICell ih, char *buffer, long long offset, long length, long cache);
 
 
@@ -147,6 +149,9 @@ extern void		utf_decodestr(const u_int8_t *utf8p, u_int16_t *ucsp, u_int16_t *uc
 extern bool		gLoadKernelDrivers;
 extern long		ThinFatFile(void **binary, unsigned long *length);
 extern long		DecodeMachO(void *binary, entry_t *rentry, char **raddr, int *rsize);
+extern long		DecodeMachOChunk(void *data, unsigned long offset, unsigned long length);
+extern long		DecodeMachOFinish(entry_t *rentry, char **raddr, int *rsize);
+extern long		DecodeMachOFile(void *binary, unsigned long loaded, entry_t *rentry, char **raddr, int *rsize);
 extern long		loadBinaryData(char *aFilePath, void **aMemoryAddress);
 
 
@@ -180,6 +185,10 @@ extern long		LoadVolumeFile(BVRef bvr, const char *fileSpec);
 extern long		LoadFile(const char *fileSpec);
 extern long		ReadFileAtOffset(const char * fileSpec, void *buffer, uint64_t offset, uint64_t length);
 extern long		LoadThinFatFile(const char *fileSpec, void **binary);
+extern long		OpenThinFatFile(const char *fileSpec, void **binary);
+extern long		ReadThinFatFile(void *buffer, unsigned long offset, unsigned long length);
+extern unsigned long	GetThinFatFileSize(void);
+extern void		CloseThinFatFile(void);
 extern long		GetDirEntry(const char *dirSpec, long *dirIndex, const char **name, long *flags, long *time);
 extern long		GetFileInfo(const char *dirSpec, const char *name,long *flags, long *time);
 extern long		GetFileBlock(const char *fileSpec, unsigned long long *firstBlock);
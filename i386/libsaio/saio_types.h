@@ -121,6 +121,7 @@ struct driveInfo
 	boot_drive_info_t di;
 
 	int uses_ebios;
+	int edd_version;
 	int no_emulation;
 	int biosdev;
 	int valid;
@@ -140,6 +141,10 @@ typedef struct BootVolume * CICell;
 typedef long (*FSInit)(CICell ih);
 typedef long (*FSLoadFile)(CICell ih, char * filePath);
 typedef long (*FSReadFile)(CICell ih, char *filePath, void *base, uint64_t offset, uint64_t length);
+typedef long (*FSOpen)(CICell ih, char *filePath);
+typedef long (*FSPRead)(CICell ih, long handle, void *base, uint64_t offset, uint64_t length);
+typedef void (*FSClose)(CICell ih, long handle);
+typedef long (*FSFileSize)(CICell ih, long handle);
 typedef long (*FSGetFileBlock)(CICell ih, char *filePath, unsigned long long *firstBlock);
 typedef long (*FSGetDirEntry)(CICell ih, char * dirPath, long * dirIndex,
                               char ** name, long * flags, long * time,
@@ -191,6 +196,10 @@ struct BootVolume
 	FSGetDirEntry    fs_getdirentry;  /* FSGetDirEntry function */
 	FSGetFileBlock   fs_getfileblock; /* FSGetFileBlock function */
 	FSGetUUID        fs_getuuid;      /* FSGetUUID function */
+	FSOpen           fs_open;         /* FSOpen function (optional) */
+	FSPRead          fs_pread;        /* FSPRead function */
+	FSClose          fs_close;        /* FSClose function */
+	FSFileSize       fs_filesize;     /* FSFileSize function (optional) */
 	unsigned int     bps;             /* bytes per sector for this device */
 	char             name[BVSTRLEN];  /* (name of partition) */
 	char             type_name[BVSTRLEN]; /* (type of partition, eg. Apple_HFS) */
@@ -54,6 +54,9 @@
  *
  * Updates:
  *			- Cleanups, white space and layout changes (PikerAlpha, November2012)
+ *			- LoadThinFatFile resolves the path once through fs_open/fs_pread.
+ *			- OpenThinFatFile/ReadThinFatFile/CloseThinFatFile read a (fat) file in parts.
+ *			- GetThinFatFileSize returns the size of the thin part (before it is read).
  *
  */
 
@@ -173,13 +176,27 @@ long ReadFileAtOffset(const char * fileSpec, void *buffer, uint64_t offset, uint
 }
 
 
+//==============================================================================
+
+static long ReadFileRange(BVRef bvr, long handle, const char *filePath, void *base, uint64_t offset, uint64_t length)
+{
+	// Use the handle from fs_open() when we have one, to skip the path lookup.
+	if (handle >= 0)
+	{
+		return bvr->fs_pread(bvr, handle, base, offset, length);
+	}
+
+	return bvr->fs_readfile(bvr, (char *)filePath, base, offset, length);
+}
+
+
 //==============================================================================
 
 long LoadThinFatFile(const char *fileSpec, void **binary)
 {
 	const char	* filePath = "";
-	FSReadFile	readFile;
 	BVRef		bvr;
+	long		handle = -1;
 	unsigned long length; // = 0;
 	unsigned long length2; //  = 0;
 
@@ -197,39 +214,51 @@ long LoadThinFatFile(const char *fileSpec, void **binary)
 
 	gFSLoadAddress = (void *) LOAD_ADDR;
 
-	readFile = bvr->fs_readfile;
-
-	if (readFile != NULL)
+	if (bvr->fs_readfile != NULL)
 	{
+		// Resolve the path once for all reads below.
+		if (bvr->fs_open != NULL)
+		{
+			if ((handle = bvr->fs_open(bvr, (char *)filePath)) == -1)
+			{
+				return -1;
+			}
+		}
+
 		// Read the first 4096 bytes (fat header)
-		length = readFile(bvr, (char *)filePath, *binary, 0, 0x1000);
+		length = ReadFileRange(bvr, handle, filePath, *binary, 0, 0x1000);
 
 		if (length > 0)
 		{
 			if (ThinFatFile(binary, &length) == 0)
 			{
-				if (length == 0)
+				if (length != 0)
 				{
-					return 0;
+					// We found a fat binary; read only the thin part
+					length = ReadFileRange(bvr, handle, filePath, (void *)kLoadAddr, (unsigned long)(*binary) - kLoadAddr, length);
+					*binary = (void *)kLoadAddr;
 				}
-
-				// We found a fat binary; read only the thin part
-				length = readFile(bvr, (char *)filePath, (void *)kLoadAddr, (unsigned long)(*binary) - kLoadAddr, length);
-				*binary = (void *)kLoadAddr;
 			}
 			else
 			{
 				// Not a fat binary; read the rest of the file
-				length2 = readFile(bvr, (char *)filePath, (void *)(kLoadAddr + length), length, 0);
+				length2 = ReadFileRange(bvr, handle, filePath, (void *)(kLoadAddr + length), length, 0);
 
 				if (length2 == -1)
 				{
-					return -1;
+					length = -1;
+				}
+				else
+				{
+					length += length2;
 				}
-
-				length += length2;
 			}
 		}
+
+		if (handle >= 0)
+		{
+			bvr->fs_close(bvr, handle);
+		}
 	}
 	else
 	{
@@ -245,6 +274,141 @@ long LoadThinFatFile(const char *fileSpec, void **binary)
 }
 
 
+//==============================================================================
+// The file opened by OpenThinFatFile(), for decodeKernel() which reads it in
+// chunks so that it can decompress the kernelcache while it is being loaded.
+
+static BVRef			gThinFileVolume = NULL;
+static long				gThinFileHandle = -1;
+static unsigned long	gThinFileOffset = 0;	// Start of the thin part.
+static unsigned long	gThinFileLength = 0;	// Length of the thin part (0 when unknown).
+
+
+//==============================================================================
+// Same as LoadThinFatFile() but only loads the first 4096 bytes of the thin part
+// (to kLoadAddr). Use ReadThinFatFile() for the rest, and CloseThinFatFile()
+// when done. Loads the whole file when the file system has no fs_open().
+
+long OpenThinFatFile(const char *fileSpec, void **binary)
+{
+	const char	* filePath = "";
+	BVRef		bvr;
+	long		length;
+	unsigned long size;
+
+	CloseThinFatFile();
+
+	if ((bvr = getBootVolumeRef(fileSpec, &filePath)) == NULL)
+	{
+		return -1;
+	}
+
+	if (bvr->fs_open == NULL)
+	{
+		return LoadThinFatFile(fileSpec, binary);
+	}
+
+	*binary = (void *)kLoadAddr;
+
+	gFSLoadAddress = (void *) LOAD_ADDR;
+
+	if ((gThinFileHandle = bvr->fs_open(bvr, (char *)filePath)) == -1)
+	{
+		return -1;
+	}
+
+	gThinFileVolume = bvr;
+
+	// Read the first 4096 bytes (fat header)
+	length = bvr->fs_pread(bvr, gThinFileHandle, *binary, 0, 0x1000);
+
+	if ((length > 0) && (ThinFatFile(binary, &size) == 0))
+	{
+		if (size == 0)
+		{
+			CloseThinFatFile();
+			return 0;
+		}
+
+		// We found a fat binary; read the start of the thin part
+		gThinFileOffset = ((unsigned long)*binary - kLoadAddr);
+		gThinFileLength = size;
+
+		*binary = (void *)kLoadAddr;
+		length = ReadThinFatFile(*binary, 0, min(size, 0x1000));
+	}
+	else if (bvr->fs_filesize != NULL)
+	{
+		// Not a fat binary; the thin part is the whole file.
+		gThinFileLength = max(bvr->fs_filesize(bvr, gThinFileHandle), 0);
+	}
+
+	if (length <= 0)
+	{
+		CloseThinFatFile();
+		return -1;
+	}
+
+	return length;
+}
+
+
+//==============================================================================
+// Reads from the file opened by OpenThinFatFile(), at an offset in the thin part.
+// A length of 0 reads up to the end of the thin part. Returns 0 when there is no
+// open file (because it was loaded as a whole).
+
+long ReadThinFatFile(void *buffer, unsigned long offset, unsigned long length)
+{
+	if (gThinFileHandle == -1)
+	{
+		return 0;
+	}
+
+	if (gThinFileLength)
+	{
+		if (offset >= gThinFileLength)
+		{
+			return 0;
+		}
+
+		if ((length == 0) || (length > (gThinFileLength - offset)))
+		{
+			length = (gThinFileLength - offset);
+		}
+	}
+
+	return gThinFileVolume->fs_pread(gThinFileVolume, gThinFileHandle, buffer, gThinFileOffset + offset, length);
+}
+
+
+//==============================================================================
+// Returns the size of the thin part of the file opened by OpenThinFatFile(), so
+// that it can be read straight to its destination. Returns 0 when the size is
+// unknown, or when the file was loaded as a whole.
+
+unsigned long GetThinFatFileSize(void)
+{
+	return (gThinFileHandle == -1) ? 0 : gThinFileLength;
+}
+
+
+//==============================================================================
+
+void CloseThinFatFile(void)
+{
+	if (gThinFileHandle != -1)
+	{
+		gThinFileVolume->fs_close(gThinFileVolume, gThinFileHandle);
+	}
+
+	gThinFileVolume = NULL;
+	gThinFileHandle = -1;
+	gThinFileOffset = 0;
+	gThinFileLength = 0;
+}
+
+
 //==============================================================================
 // filesystem-specific getUUID functions call this shared string generator
 
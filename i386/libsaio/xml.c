@@ -24,6 +24,7 @@
  * Updates:
  *			- Cleanups, white space and layout changes (PikerAlpha, November 2012)
  *			- New/improved kXMLTagData support (PikerAlpha, November 2012)
+ *			- Symbols are now kept in a hash table (instead of a single list).
  *
  */
 
@@ -73,16 +74,20 @@ enum
 
 static TagPtr gTagsFree;
 
+#define kSymbolHashSize (0x800)	// Must be a power of 2.
+
 typedef struct Symbol
 {
 	long			refCount;
 	struct Symbol *	next;
+	uint32_t		hash;
 	char			string[];
 } Symbol, *SymbolPtr;
 
-static SymbolPtr FindSymbol(char * string, SymbolPtr * prevSymbol);
+static SymbolPtr FindSymbol(char * string, uint32_t hash, SymbolPtr ** prevLink);
+static uint32_t HashSymbol(char * string, long * length);
 
-static SymbolPtr gSymbolsHead;
+static SymbolPtr * gSymbolHash;
 
 static long ParseTagList(char *buffer, TagPtr *tag, long type, long empty);
 static long ParseTagKey(char *buffer, TagPtr *tag);
@@ -642,25 +647,29 @@ void XMLFreeTag(TagPtr tag)
 
 static char * NewSymbol(char * string)
 {
-	static SymbolPtr lastGuy = 0;
+	long length;
+	uint32_t hash = HashSymbol(string, &length);
 
-	// Look for string in the list of symbols.
-	SymbolPtr symbol = FindSymbol(string, 0);
+	// Look for string in the symbol table.
+	SymbolPtr symbol = FindSymbol(string, hash, 0);
 
 	// Add new symbol.
 	if (symbol == 0)
 	{
-		symbol = (SymbolPtr)malloc(sizeof(Symbol) + 1 + strlen(string));
+		symbol = (SymbolPtr)malloc(sizeof(Symbol) + 1 + length);
 
 		if (symbol)
 		{
 			// Set the symbol's data.
 			symbol->refCount = 0;
-			strcpy(symbol->string, string);
-			
-			// Add the symbol to the list.
-			symbol->next = gSymbolsHead;
-			gSymbolsHead = symbol;
+			symbol->hash = hash;
+			memcpy(symbol->string, string, length + 1);
+
+			// Add the symbol to its bucket.
+			SymbolPtr * bucket = &gSymbolHash[hash & (kSymbolHashSize - 1)];
+
+			symbol->next = *bucket;
+			*bucket = symbol;
 		}
 		else
 		{
@@ -671,11 +680,6 @@ static char * NewSymbol(char * string)
 	// Update the refCount and return the string.
 	symbol->refCount++;
 
-	if (lastGuy && lastGuy->next != 0)
-	{
-		stop ("xml.c");
-	}
-
 	return symbol->string;
 }
 
@@ -684,11 +688,10 @@ static char * NewSymbol(char * string)
 
 static void FreeSymbol(char * string)
 {
-	SymbolPtr symbol, prev;
-	prev = 0;
+	SymbolPtr symbol, * link;
 
-	// Look for string in the list of symbols.
-	symbol = FindSymbol(string, &prev);
+	// Look for string in the symbol table.
+	symbol = FindSymbol(string, HashSymbol(string, 0), &link);
 
 	if (symbol)
 	{
@@ -697,15 +700,8 @@ static void FreeSymbol(char * string)
 
 		if (symbol->refCount == 0)
 		{
-			// Remove the symbol from the list.
-			if (prev != 0)
-			{
-				prev->next = symbol->next;
-			}
-			else
-			{
-				gSymbolsHead = symbol->next;
-			}
+			// Remove the symbol from its bucket.
+			*link = symbol->next;
 
 			// Free the symbol's memory.
 			free (symbol);
@@ -715,27 +711,63 @@ static void FreeSymbol(char * string)
 
 
 //==============================================================================
+// FNV-1a hash of a symbol string, optionally returning its length as well.
 
-static SymbolPtr FindSymbol(char * string, SymbolPtr * prevSymbol)
+static uint32_t HashSymbol(char * string, long * length)
 {
-	SymbolPtr prev		= 0;
-	SymbolPtr symbol	= gSymbolsHead;
+	uint32_t hash = 2166136261UL;
+	char * cp = string;
 
-	while (symbol != 0)
+	while (*cp)
 	{
-		if (!strcmp(symbol->string, string))
+		hash = ((hash ^ (uint8_t)*cp++) * 16777619UL);
+	}
+
+	if (length)
+	{
+		*length = (cp - string);
+	}
+
+	return hash;
+}
+
+
+//==============================================================================
+
+static SymbolPtr FindSymbol(char * string, uint32_t hash, SymbolPtr ** prevLink)
+{
+	SymbolPtr * link;
+	SymbolPtr symbol;
+
+	// Allocated here, on first use, since there is no init routine for xml.c
+	if (gSymbolHash == 0)
+	{
+		gSymbolHash = (SymbolPtr *)malloc(kSymbolHashSize * sizeof(SymbolPtr));
+
+		if (gSymbolHash == 0)
+		{
+			stop ("xml.c");
+		}
+
+		bzero(gSymbolHash, kSymbolHashSize * sizeof(SymbolPtr));
+	}
+
+	link = &gSymbolHash[hash & (kSymbolHashSize - 1)];
+
+	while ((symbol = *link) != 0)
+	{
+		if ((symbol->hash == hash) && !strcmp(symbol->string, string))
 		{
 			break;
 		}
 
-		prev = symbol;
-		symbol = symbol->next;
+		link = &symbol->next;
 	}
 
-	if ((symbol != 0) && (prevSymbol != 0))
+	if ((symbol != 0) && (prevLink != 0))
 	{
-		*prevSymbol = prev;
+		*prevLink = link;
 	}
 
 	return symbol;
-}
\ No newline at end of file
+}
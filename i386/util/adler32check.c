@@ -0,0 +1,153 @@
+/*
+ * File: RevoBoot/i386/util/adler32check.c
+ *
+ * Host side check of Adler32() in libsa/adler32.c, which is used for the
+ * kernelcache checksum (decompressKernel), the mkext checksum (loadMultiKext)
+ * and the kernelcache key in boot.c. It runs known test vectors, all 0xFF
+ * input (the worst case for the deferred modulo) across NMAX boundaries, and
+ * random input split at random points, against a plain byte by byte version.
+ * Also reports the throughput of both, for a 32 MB buffer.
+ *
+ * Usage: adler32check
+ *
+ * Not part of the booter build; make tools (in i386/util) builds a host binary.
+ * Build it like the booter, as 32-bit code, to get meaningful numbers:
+ *
+ * cc -arch i386 -Os -o adler32check adler32check.c
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+// Stand-in for libsa.h, so that we can include libsa/adler32.c as is.
+
+#define __BOOT_LIBSA_H
+
+#include "../libsa/adler32.c"
+
+#define kBenchSize	(32 << 20)
+
+static int gFailed = 0;
+
+
+//==============================================================================
+// Reference implementation, with the modulo taken after every byte.
+
+static uint32_t referenceAdler32(uint32_t adler, const uint8_t * buf, size_t size)
+{
+	uint32_t s1 = (adler & 0xFFFF);
+	uint32_t s2 = (adler >> 16);
+
+	while (size--)
+	{
+		s1 = ((s1 + *buf++) % BASE);
+		s2 = ((s2 + s1) % BASE);
+	}
+
+	return ((s2 << 16) | s1);
+}
+
+
+//==============================================================================
+
+static void check(const char * name, uint32_t result, uint32_t expected)
+{
+	if (result != expected)
+	{
+		printf("%s: 0x%08x, expected 0x%08x FAILED\n", name, result, expected);
+		gFailed = 1;
+	}
+}
+
+
+//==============================================================================
+
+static uint32_t nextRandom(uint32_t * seed)
+{
+	*seed = ((*seed * 1103515245) + 12345);
+
+	return (*seed >> 8);
+}
+
+
+//==============================================================================
+
+int main(void)
+{
+	static const size_t sizes[] = { 1, 15, 16, 17, NMAX - 1, NMAX, NMAX + 1, (2 * NMAX) - 16, 2 * NMAX, (2 * NMAX) + 15, (7 * NMAX) + 3 };
+
+	// Start values: a new checksum, and the largest sums a previous call can return.
+	static const uint32_t starts[] = { 1, ((BASE - 1) << 16) | (BASE - 1) };
+
+	uint8_t * buf = malloc(kBenchSize);
+	uint32_t adler, seed = 1;
+	size_t i, j, offset, length;
+	char name[64];
+	clock_t start;
+	double fast, slow;
+
+	if (buf == NULL)
+	{
+		printf("adler32check: out of memory!\n");
+		return 1;
+	}
+
+	// Test vectors.
+	check("empty", Adler32(1, "", 0), 1);
+	check("\"Wikipedia\"", Adler32(1, "Wikipedia", 9), 0x11E60398);
+	check("\"abc\"", Adler32(1, "abc", 3), 0x024D0127);
+
+	// All 0xFF, the largest sums possible, across NMAX boundaries.
+	memset(buf, 0xFF, kBenchSize);
+
+	for (i = 0; i < (sizeof(sizes) / sizeof(sizes[0])); i++)
+	{
+		for (j = 0; j < (sizeof(starts) / sizeof(starts[0])); j++)
+		{
+			sprintf(name, "0xFF x %lu (start 0x%08x)", (unsigned long)sizes[i], starts[j]);
+			check(name, Adler32(starts[j], buf, sizes[i]), referenceAdler32(starts[j], buf, sizes[i]));
+		}
+	}
+
+	check("0xFF x 32 MB", Adler32(1, buf, kBenchSize), referenceAdler32(1, buf, kBenchSize));
+
+	// Random input, split at random points (as the LZVN decoder does, per 16 KB block).
+	for (i = 0; i < (1 << 20); i++)
+	{
+		buf[i] = (uint8_t)nextRandom(&seed);
+	}
+
+	for (i = 0; i < 64; i++)
+	{
+		length = (1 + (nextRandom(&seed) % (1 << 20)));
+
+		for (adler = 1, offset = 0; offset < length; offset += j)
+		{
+			j = (1 + (nextRandom(&seed) % (3 * NMAX)));
+			j = (j < (length - offset)) ? j : (length - offset);
+			adler = Adler32(adler, buf + offset, j);
+		}
+
+		sprintf(name, "random x %lu, split", (unsigned long)length);
+		check(name, adler, referenceAdler32(1, buf, length));
+	}
+
+	// Throughput.
+	start = clock();
+	adler = Adler32(1, buf, kBenchSize);
+	fast = ((double)(clock() - start) / CLOCKS_PER_SEC);
+
+	start = clock();
+	check("mixed x 32 MB", adler, referenceAdler32(1, buf, kBenchSize));
+	slow = ((double)(clock() - start) / CLOCKS_PER_SEC);
+
+	printf("Adler32 %.1f MB/s, byte by byte %.1f MB/s\n", (kBenchSize / fast / 1e6), (kBenchSize / slow / 1e6));
+	printf("%s\n", gFailed ? "FAILED" : "All checks passed.");
+
+	free(buf);
+
+	return gFailed;
+}
@@ -0,0 +1,489 @@
+/*
+ * File: RevoBoot/i386/util/kextindex.c
+ *
+ * Builds the kext index (/Extra/Extensions.index) that boot2/drivers.c uses,
+ * with KEXT_INDEX_SUPPORT set to 1, instead of walking the extensions folders
+ * and parsing the Info.plist of each kext. Rebuild the index after kexts are
+ * installed or updated (outdated folders are walked by the booter).
+ *
+ * Usage: kextindex [-r root] <output file> <folder> [<folder> ...]
+ *
+ * Example: sudo kextindex /Extra/Extensions.index /System/Library/Extensions /Extra/Extensions
+ *
+ * The folders are stored as given, so use the paths as seen from the root of
+ * the boot volume. Use -r when that volume is mounted elsewhere.
+ *
+ * Not part of the booter build. Build it with: make tools (in i386/util).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <CoreFoundation/CoreFoundation.h>
+
+// START_DUPLICATED_BLOCK (see boot2/drivers.c)
+
+#define kKextIndexSignature	'KIDX'
+#define kKextIndexVersion	2
+#define kKextIndexFile		"/Extra/Extensions.index"
+
+// All offsets are from the start of the file.
+typedef struct KextIndexHeader
+{
+	uint32_t	signature;
+	uint32_t	version;
+	uint32_t	length;			// Of the file.
+	uint32_t	adler32;		// Of everything after the header.
+	uint32_t	folderCount;	// Followed by the folders, the kexts and the stamps.
+	uint32_t	kextCount;
+	uint32_t	stampCount;
+} KextIndexHeader;
+
+typedef struct KextIndexFolder
+{
+	uint32_t	path;			// i.e. "/System/Library/Extensions"
+	int32_t		time;			// Modification time of the folder.
+	uint32_t	firstKext;
+	uint32_t	kextCount;
+	uint32_t	firstStamp;
+	uint32_t	stampCount;
+} KextIndexFolder;
+
+// Only kexts that the booter loads (OSBundleRequired set, but not to "Safe Boot").
+typedef struct KextIndexEntry
+{
+	uint32_t	bundlePath;		// "<folder>/Foo.kext/"
+	uint32_t	executablePath;	// "<folder>/Foo.kext/Contents/MacOS/"
+	uint32_t	executable;		// CFBundleExecutable (0 for none).
+	uint32_t	bundleID;		// CFBundleIdentifier.
+	uint32_t	required;		// OSBundleRequired.
+	uint32_t	libraries;		// OSBundleLibraries, NUL separated and ended by an empty string.
+	uint32_t	plist;			// Copy of the Info.plist, NUL terminated.
+	uint32_t	plistLength;	// Including the NUL.
+} KextIndexEntry;
+
+// Modification times that must still match: the Info.plist of every kext in the
+// folder (indexed or not) and every PlugIns folder, which change when a kext is
+// updated or a plugin kext is added or removed.
+typedef struct KextIndexStamp
+{
+	uint32_t	folder;			// i.e. "<folder>/Foo.kext/Contents"
+	uint32_t	name;			// "Info.plist" or "PlugIns"
+	int32_t		time;
+} KextIndexStamp;
+// END_DUPLICATED_BLOCK
+
+#define kMaxFolders		8
+#define kMaxKexts		4096
+#define kMaxStamps		16384
+
+static const char		* gRoot = "";
+
+static KextIndexFolder	gFolders[kMaxFolders];
+static KextIndexEntry	gKexts[kMaxKexts];
+static KextIndexStamp	gStamps[kMaxStamps];
+static int				gFolderCount, gKextCount, gStampCount;
+
+static uint32_t			gInfoPlistName, gPlugInsName;
+
+static char				* gData;	// Strings and plists.
+static uint32_t			gDataLength, gDataSize;
+
+
+//==============================================================================
+
+static uint32_t addData(const void * data, uint32_t length)
+{
+	uint32_t offset = gDataLength;
+
+	if ((gDataLength + length) > gDataSize)
+	{
+		gDataSize = (gDataLength + length) * 2;
+
+		if ((gData = realloc(gData, gDataSize)) == NULL)
+		{
+			fprintf(stderr, "kextindex: out of memory\n");
+			exit(1);
+		}
+	}
+
+	memcpy(gData + gDataLength, data, length);
+	gDataLength += length;
+
+	return offset;
+}
+
+
+//==============================================================================
+// Adds a string and returns its offset (relative to the data area).
+
+static uint32_t addCFString(CFStringRef string)
+{
+	char buffer[1024];
+
+	if (!CFStringGetCString(string, buffer, sizeof(buffer), kCFStringEncodingUTF8))
+	{
+		buffer[0] = '\0';
+	}
+
+	return addData(buffer, strlen(buffer) + 1);
+}
+
+
+//==============================================================================
+
+static CFStringRef getString(CFDictionaryRef dict, const char * key)
+{
+	CFStringRef keyString = CFStringCreateWithCString(NULL, key, kCFStringEncodingUTF8);
+	CFTypeRef value = CFDictionaryGetValue(dict, keyString);
+
+	CFRelease(keyString);
+
+	return (value && (CFGetTypeID(value) == CFStringGetTypeID())) ? (CFStringRef)value : NULL;
+}
+
+
+//==============================================================================
+// Adds the modification time of folder/name, for the booter to check.
+
+static void addStamp(const char * folder, uint32_t name, time_t time)
+{
+	if (gStampCount == kMaxStamps)
+	{
+		fprintf(stderr, "kextindex: too many kexts\n");
+		exit(1);
+	}
+
+	KextIndexStamp * stamp = &gStamps[gStampCount++];
+
+	stamp->folder	= addData(folder, strlen(folder) + 1);
+	stamp->name		= name;
+	stamp->time		= (int32_t)time;
+}
+
+
+//==============================================================================
+// Adds a kext to the index, when the booter would load it (see parseXML). The
+// time of its Info.plist is recorded either way, so that a kext that gets a
+// loadable OSBundleRequired (or loses it) invalidates the index.
+
+static void addKext(const char * kextPath, int isBundleType2)
+{
+	char path[1024], plistFolder[1024];
+	struct stat plistStat;
+
+	snprintf(plistFolder, sizeof(plistFolder), "%s%s", kextPath, isBundleType2 ? "/Contents" : "");
+	snprintf(path, sizeof(path), "%s%s/Info.plist", gRoot, plistFolder);
+
+	FILE * file = fopen(path, "rb");
+
+	if ((file == NULL) || (fstat(fileno(file), &plistStat) != 0))
+	{
+		if (file)
+		{
+			fclose(file);
+		}
+
+		return;
+	}
+
+	char * plist = malloc(plistStat.st_size + 1);
+
+	if ((plist == NULL) || (fread(plist, 1, plistStat.st_size, file) != (size_t)plistStat.st_size))
+	{
+		fprintf(stderr, "kextindex: failed to read %s\n", path);
+		exit(1);
+	}
+
+	fclose(file);
+	plist[plistStat.st_size] = '\0';
+
+	addStamp(plistFolder, gInfoPlistName, plistStat.st_mtime);
+
+	CFDataRef data = CFDataCreateWithBytesNoCopy(NULL, (const UInt8 *)plist, plistStat.st_size, kCFAllocatorNull);
+	CFPropertyListRef dict = CFPropertyListCreateWithData(NULL, data, kCFPropertyListImmutable, NULL, NULL);
+
+	CFRelease(data);
+
+	if ((dict == NULL) || (CFGetTypeID(dict) != CFDictionaryGetTypeID()))
+	{
+		fprintf(stderr, "kextindex: skipping %s (invalid plist)\n", path);
+	}
+	else
+	{
+		CFStringRef bundleID	= getString(dict, "CFBundleIdentifier");
+		CFStringRef required	= getString(dict, "OSBundleRequired");
+		CFStringRef executable	= getString(dict, "CFBundleExecutable");
+
+		if (bundleID && required && (CFStringCompare(required, CFSTR("Safe Boot"), 0) != kCFCompareEqualTo))
+		{
+			if (gKextCount == kMaxKexts)
+			{
+				fprintf(stderr, "kextindex: too many kexts\n");
+				exit(1);
+			}
+
+			KextIndexEntry * kext = &gKexts[gKextCount++];
+
+			snprintf(path, sizeof(path), "%s/", kextPath);
+			kext->bundlePath = addData(path, strlen(path) + 1);
+
+			snprintf(path, sizeof(path), "%s/%s", kextPath, isBundleType2 ? "Contents/MacOS/" : "");
+			kext->executablePath	= addData(path, strlen(path) + 1);
+			kext->executable		= executable ? addCFString(executable) : 0;
+			kext->bundleID			= addCFString(bundleID);
+			kext->required			= addCFString(required);
+			kext->plist				= addData(plist, plistStat.st_size + 1);
+			kext->plistLength		= plistStat.st_size + 1;
+
+			// Bundle IDs of the libraries, NUL separated and ended by an empty string.
+			CFTypeRef libraries = CFDictionaryGetValue(dict, CFSTR("OSBundleLibraries"));
+
+			if (libraries && (CFGetTypeID(libraries) == CFDictionaryGetTypeID()) && CFDictionaryGetCount((CFDictionaryRef)libraries))
+			{
+				CFIndex index, count = CFDictionaryGetCount((CFDictionaryRef)libraries);
+				const void ** keys = malloc(count * sizeof(void *));
+
+				CFDictionaryGetKeys((CFDictionaryRef)libraries, keys);
+
+				for (index = 0; index < count; index++)
+				{
+					uint32_t offset = addCFString(keys[index]);
+
+					if (index == 0)
+					{
+						kext->libraries = offset;
+					}
+				}
+
+				addData("", 1);
+				free(keys);
+			}
+			else
+			{
+				kext->libraries = 0;
+			}
+		}
+	}
+
+	if (dict)
+	{
+		CFRelease(dict);
+	}
+
+	free(plist);
+}
+
+
+//==============================================================================
+// Adds the kexts in a folder, and the ones in their PlugIns folder (as does
+// loadKexts in boot2/drivers.c). The time of each PlugIns folder is recorded,
+// since adding or removing a plugin kext does not change the top folder.
+
+static void addKexts(const char * folder, int isPluginRun)
+{
+	char path[1024], kextPath[1024], parent[1024];
+	struct dirent ** entries;
+	struct stat st;
+	int index, count;
+
+	snprintf(path, sizeof(path), "%s%s", gRoot, folder);
+
+	if ((count = scandir(path, &entries, NULL, alphasort)) < 0)
+	{
+		if (!isPluginRun)
+		{
+			fprintf(stderr, "kextindex: cannot read %s\n", path);
+			exit(1);
+		}
+
+		return;
+	}
+
+	for (index = 0; index < count; index++)
+	{
+		const char * name = entries[index]->d_name;
+		size_t length = strlen(name);
+
+		snprintf(kextPath, sizeof(kextPath), "%s/%s", folder, name);
+		snprintf(path, sizeof(path), "%s%s", gRoot, kextPath);
+
+		if ((length > 5) && (strcmp(name + length - 5, ".kext") == 0) && (stat(path, &st) == 0) && S_ISDIR(st.st_mode))
+		{
+			snprintf(path, sizeof(path), "%s%s/Contents", gRoot, kextPath);
+
+			int isBundleType2 = (stat(path, &st) == 0);
+
+			addKext(kextPath, isBundleType2);
+
+			if (!isPluginRun)
+			{
+				snprintf(parent, sizeof(parent), "%s%s", kextPath, isBundleType2 ? "/Contents" : "");
+				snprintf(path, sizeof(path), "%s%s/PlugIns", gRoot, parent);
+
+				// Take the time first, so that changes made while we run invalidate the index.
+				if (stat(path, &st) == 0)
+				{
+					addStamp(parent, gPlugInsName, st.st_mtime);
+
+					snprintf(path, sizeof(path), "%s/PlugIns", parent);
+					addKexts(path, 1);
+				}
+			}
+		}
+
+		free(entries[index]);
+	}
+
+	free(entries);
+}
+
+
+//==============================================================================
+// Same as Adler32 in libsa/adler32.c
+
+static uint32_t adler32(const uint8_t * buffer, size_t length)
+{
+	uint32_t a = 1, b = 0;
+
+	while (length--)
+	{
+		a = (a + *buffer++) % 65521;
+		b = (b + a) % 65521;
+	}
+
+	return ((b << 16) | a);
+}
+
+
+//==============================================================================
+
+int main(int argc, char * argv[])
+{
+	int index, arg = 1;
+	struct stat st;
+	char path[1024];
+
+	if ((argc > 2) && (strcmp(argv[1], "-r") == 0))
+	{
+		gRoot = argv[2];
+		arg = 3;
+	}
+
+	if ((argc - arg) < 2)
+	{
+		fprintf(stderr, "Usage: kextindex [-r root] <output file> <folder> [<folder> ...]\n");
+		fprintf(stderr, "Example: kextindex %s /System/Library/Extensions /Extra/Extensions\n", kKextIndexFile);
+		return 1;
+	}
+
+	const char * outputFile = argv[arg++];
+
+	gInfoPlistName	= addData("Info.plist", 11);
+	gPlugInsName	= addData("PlugIns", 8);
+
+	for (; arg < argc; arg++)
+	{
+		const char * folder = argv[arg];
+
+		if ((gFolderCount == kMaxFolders) || (folder[0] != '/'))
+		{
+			fprintf(stderr, "kextindex: invalid folder %s (use an absolute path)\n", folder);
+			return 1;
+		}
+
+		snprintf(path, sizeof(path), "%s%s", gRoot, folder);
+
+		// Take the time first, so that changes made while we run invalidate the index.
+		if (stat(path, &st) != 0)
+		{
+			fprintf(stderr, "kextindex: cannot find %s\n", path);
+			return 1;
+		}
+
+		KextIndexFolder * entry = &gFolders[gFolderCount++];
+
+		entry->path			= addData(folder, strlen(folder) + 1);
+		entry->time			= (int32_t)st.st_mtime;
+		entry->firstKext	= gKextCount;
+		entry->firstStamp	= gStampCount;
+
+		addKexts(folder, 0);
+
+		entry->kextCount	= gKextCount - entry->firstKext;
+		entry->stampCount	= gStampCount - entry->firstStamp;
+
+		printf("%s: %d kexts\n", folder, entry->kextCount);
+	}
+
+	// Make the data offsets relative to the start of the file.
+	uint32_t dataOffset = sizeof(KextIndexHeader) + (gFolderCount * sizeof(KextIndexFolder)) + (gKextCount * sizeof(KextIndexEntry)) +
+						  (gStampCount * sizeof(KextIndexStamp));
+
+	for (index = 0; index < gFolderCount; index++)
+	{
+		gFolders[index].path += dataOffset;
+	}
+
+	for (index = 0; index < gKextCount; index++)
+	{
+		KextIndexEntry * kext = &gKexts[index];
+
+		kext->bundlePath		+= dataOffset;
+		kext->executablePath	+= dataOffset;
+		kext->executable		+= kext->executable ? dataOffset : 0;
+		kext->bundleID			+= dataOffset;
+		kext->required			+= dataOffset;
+		kext->libraries			+= kext->libraries ? dataOffset : 0;
+		kext->plist				+= dataOffset;
+	}
+
+	for (index = 0; index < gStampCount; index++)
+	{
+		gStamps[index].folder	+= dataOffset;
+		gStamps[index].name		+= dataOffset;
+	}
+
+	uint32_t length = dataOffset + gDataLength;
+	uint8_t * buffer = malloc(length);
+
+	if (buffer == NULL)
+	{
+		fprintf(stderr, "kextindex: out of memory\n");
+		return 1;
+	}
+
+	KextIndexHeader * header = (KextIndexHeader *)buffer;
+
+	header->signature	= kKextIndexSignature;
+	header->version		= kKextIndexVersion;
+	header->length		= length;
+	header->folderCount	= gFolderCount;
+	header->kextCount	= gKextCount;
+	header->stampCount	= gStampCount;
+
+	memcpy(buffer + sizeof(KextIndexHeader), gFolders, gFolderCount * sizeof(KextIndexFolder));
+	memcpy(buffer + sizeof(KextIndexHeader) + (gFolderCount * sizeof(KextIndexFolder)), gKexts, gKextCount * sizeof(KextIndexEntry));
+	memcpy(buffer + sizeof(KextIndexHeader) + (gFolderCount * sizeof(KextIndexFolder)) + (gKextCount * sizeof(KextIndexEntry)), gStamps,
+		   gStampCount * sizeof(KextIndexStamp));
+	memcpy(buffer + dataOffset, gData, gDataLength);
+
+	header->adler32 = adler32(buffer + sizeof(KextIndexHeader), length - sizeof(KextIndexHeader));
+
+	FILE * file = fopen(outputFile, "wb");
+
+	if ((file == NULL) || (fwrite(buffer, 1, length, file) != length) || (fclose(file) != 0))
+	{
+		fprintf(stderr, "kextindex: failed to write %s\n", outputFile);
+		return 1;
+	}
+
+	printf("%s: %d kexts, %d bytes\n", outputFile, gKextCount, length);
+
+	free(buffer);
+
+	return 0;
+}
@@ -0,0 +1,1087 @@
+/*
+ * File: RevoBoot/i386/util/lzvnbench.c
+ *
+ * Host side benchmark and check for the LZVN decoder in boot2/lzvn.c. It
+ * times lzvn_decode() against the reference decoder (the C port of Apple's
+ * assembly that boot2/lzvn.c used to have), checks that both produce the
+ * same output, and that lzvn_decode_stream() does so too when the input and
+ * output are handed over in random sized chunks (as decodeKernel() does).
+ *
+ * Usage: lzvnbench [-r runs] [<file> ...]
+ *
+ * Files that start with a 'comp' 'lzvn' header (i.e. a compressed prelinkedkernel
+ * from /System/Library/PrelinkedKernels) are decoded as is. Other files are
+ * compressed first, with the simple (greedy) encoder below. Without files, a
+ * generated corpus is used: a mix of machine code, pointer tables, symbol names
+ * and page alignment padding, modelled after a prelinkedkernel.
+ *
+ * Note: the greedy encoder emits a different opcode mix than Apple's, so only
+ * the figures for a 'comp' 'lzvn' file say how decodeKernel() will do. The
+ * speedup also depends heavily on the build: the reference decoder runs out of
+ * registers as 32-bit code, which makes lzvn_decode() look far better there
+ * (3.6x to 4x) than in a 64-bit build (1.6x to 1.9x), at similar MB/s.
+ *
+ * Not part of the booter build; make tools (in i386/util) builds a host binary.
+ * Build it like the booter, as 32-bit code, to get meaningful numbers:
+ *
+ * cc -arch i386 -Os -iquote ../libsaio -o lzvnbench lzvnbench.c
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <sys/types.h>
+
+// Stand-ins for sl.h and boot.h, so that we can include boot2/lzvn.c as is.
+
+#define __LIBSAIO_SL_H
+#define __BOOT2_BOOT_H
+#define __BOOT_LIBSA_H
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+
+uint32_t Adler32(uint32_t adler, const void *buf, size_t size);
+
+// START_DUPLICATED_BLOCK (see boot2/boot.h)
+
+#define kDecodeError		-1
+#define kDecodeDone			0		// End of the compressed stream (LZVN only).
+#define kDecodeNeedOutput	1		// Output window is full.
+#define kDecodeNeedInput	2		// All available input has been consumed.
+
+#define kDecodeChecksumSize	0x4000	// Output is checksummed in 16 KB blocks, while these are still cached.
+
+#define kDecodeNoChecksum	1		// LZVN: set in flags to skip the Adler-32 (lzvn_decode).
+
+typedef struct DecodeStream
+{
+	u_int8_t	* src;				// Next compressed byte.
+	u_int8_t	* srcEnd;			// End of the compressed bytes available so far.
+	u_int8_t	* dst;				// Next output byte.
+	u_int8_t	* dstStart;			// Start of the output window (oldest byte a match may use).
+	u_int8_t	* dstEnd;			// End of the output window.
+	u_int32_t	literalLength;		// LZVN: literal bytes not yet copied.
+	u_int32_t	matchLength;		// Match bytes not yet copied.
+	u_int32_t	matchDistance;		// Current match distance.
+	u_int32_t	flags;				// LZSS: flag byte, with the valid bits marked in the high byte. LZVN: kDecodeNoChecksum.
+	u_int32_t	ringIndex;			// LZSS: number of bytes written, modulo the ring buffer size.
+	u_int32_t	adler32;			// Adler-32 of the output so far (set to 1 before the first call).
+} DecodeStream;
+
+extern int decompressLZSS(DecodeStream * stream);
+
+extern int lzvn_decode(void * decompressedData, uint32_t decompressedSize, void * compressedData, uint32_t compressedSize);
+extern int lzvn_decode_stream(DecodeStream * stream);
+// END_DUPLICATED_BLOCK
+
+#include "../libsa/adler32.c"
+#include "../boot2/lzvn.c"
+
+#define kPadding	64		// Both decoders read (and the new one writes) a little past the end.
+
+#define LZVN_0		0
+#define LZVN_1		1
+#define LZVN_2		2
+#define LZVN_3		3
+#define LZVN_4		4
+#define LZVN_5		5
+#define LZVN_6		6
+#define LZVN_7		7
+#define LZVN_8		8
+#define LZVN_9		9
+#define LZVN_10		10
+#define LZVN_11		11
+
+#define CASE_TABLE	127
+
+//==============================================================================
+
+static size_t lzvn_decode_reference(void * decompressedData, size_t decompressedSize, void * compressedData, size_t compressedSize)
+{
+	const uint64_t decompBuffer = (const uint64_t)decompressedData;
+
+	size_t	length	= 0;															// xor	%rax,%rax
+
+	uint64_t compBuffer	= (uint64_t)compressedData;
+
+	uint64_t compBufferPointer	= 0;												// use p(ointer)?
+	uint64_t caseTableIndex	= 0;
+	uint64_t r10			= 0;
+	uint64_t currentLength	= 0;													// xor	%r12,%r12
+	uint64_t r12			= 0;
+
+	uint64_t address		= 0;													// ((uint64_t)compBuffer + compBufferPointer)
+	unsigned char byte_data	= 0;
+
+	uint8_t jmpTo			= CASE_TABLE;
+
+	/*
+	 * This jump table was developed by someone using the handle 'MinusZwei'
+	 * over at insanelymac.com
+	 */
+	static short caseTable[ 256 ] =
+	{
+		1,  1,  1,  1,    1,  1,  2,  3,    1,  1,  1,  1,    1,  1,  4,  3,
+		1,  1,  1,  1,    1,  1,  4,  3,    1,  1,  1,  1,    1,  1,  5,  3,
+		1,  1,  1,  1,    1,  1,  5,  3,    1,  1,  1,  1,    1,  1,  5,  3,
+		1,  1,  1,  1,    1,  1,  5,  3,    1,  1,  1,  1,    1,  1,  5,  3,
+		1,  1,  1,  1,    1,  1,  0,  3,    1,  1,  1,  1,    1,  1,  0,  3,
+		1,  1,  1,  1,    1,  1,  0,  3,    1,  1,  1,  1,    1,  1,  0,  3,
+		1,  1,  1,  1,    1,  1,  0,  3,    1,  1,  1,  1,    1,  1,  0,  3,
+		5,  5,  5,  5,    5,  5,  5,  5,    5,  5,  5,  5,    5,  5,  5,  5,
+		1,  1,  1,  1,    1,  1,  0,  3,    1,  1,  1,  1,    1,  1,  0,  3,
+		1,  1,  1,  1,    1,  1,  0,  3,    1,  1,  1,  1,    1,  1,  0,  3,
+		6,  6,  6,  6,    6,  6,  6,  6,    6,  6,  6,  6,    6,  6,  6,  6,
+		6,  6,  6,  6,    6,  6,  6,  6,    6,  6,  6,  6,    6,  6,  6,  6,
+		1,  1,  1,  1,    1,  1,  0,  3,    1,  1,  1,  1,    1,  1,  0,  3,
+		5,  5,  5,  5,    5,  5,  5,  5,    5,  5,  5,  5,    5,  5,  5,  5,
+		7,  8,  8,  8,    8,  8,  8,  8,    8,  8,  8,  8,    8,  8,  8,  8,
+		9, 10, 10, 10,   10, 10, 10, 10,   10, 10, 10, 10,   10, 10, 10, 10
+	};
+
+	decompressedSize -= 8;															// sub	$0x8,%rsi
+
+	if (decompressedSize < 8)														// jb	Llzvn_exit
+	{
+		return 0;
+	}
+
+	compressedSize = (compBuffer + compressedSize - 8);								// lea	-0x8(%rdx,%rcx,1),%rcx
+
+	if (compBuffer > compressedSize)												// cmp	%rcx,%rdx
+	{
+		return 0;																	// ja	Llzvn_exit
+	}
+
+	compBufferPointer = *(uint64_t *)compBuffer;									// mov	(%rdx),%r8
+	caseTableIndex = (compBufferPointer & 255);										// movzbq	(%rdx),%r9
+
+	do																				// jmpq	*(%rbx,%r9,8)
+	{
+		switch (jmpTo)																// our jump table
+		{
+			case CASE_TABLE: /******************************************************/
+
+				switch (caseTable[(uint8_t)caseTableIndex])
+				{
+					case 0: _LZVN_DEBUG_DUMP("caseTable[0]\n");
+
+							caseTableIndex >>= 6;									// shr	$0x6,%r9
+							compBuffer = (compBuffer + caseTableIndex + 1);			// lea	0x1(%rdx,%r9,1),%rdx
+						
+							if (compBuffer > compressedSize)						// cmp	%rcx,%rdx
+							{
+								return 0;											// ja	Llzvn_exit
+							}
+						
+							r10 = 56;												// mov	$0x38,%r10
+							r10 &= compBufferPointer;								// and	%r8,%r10
+							compBufferPointer >>= 8;								// shr	$0x8,%r8
+							r10 >>= 3;												// shr	$0x3,%r10
+							r10 += 3;												// add	$0x3,%r10
+						
+							jmpTo = LZVN_10;										// jmp	Llzvn_l10
+							break;
+						
+					case 1:	_LZVN_DEBUG_DUMP("caseTable[1]\n");
+
+							caseTableIndex >>= 6;									// shr	$0x6,%r9
+							compBuffer = (compBuffer + caseTableIndex + 2);			// lea	0x2(%rdx,%r9,1),%rdx
+
+							if (compBuffer > compressedSize)						// cmp	%rcx,%rdx
+							{
+								return 0;											// ja	Llzvn_exit
+							}
+						
+							r12 = compBufferPointer;								// mov	%r8,%r12
+							r12 = OSSwapInt64(r12);									// bswap	%r12
+							r10 = r12;												// mov	%r12,%r10
+							r12 <<= 5;												// shl	$0x5,%r12
+							r10 <<= 2;												// shl	$0x2,%r10
+							r12 >>= 53;												// shr	$0x35,%r12
+							r10 >>= 61;												// shr	$0x3d,%r10
+							compBufferPointer >>= 16;								// shr	$0x10,%r8
+							r10 += 3;												// add	$0x3,%r10
+
+							jmpTo = LZVN_10;										// jmp	Llzvn_l10
+							break;
+
+					case 2: _LZVN_DEBUG_DUMP("caseTable[2]\n");
+
+							return length;
+			
+					case 3: _LZVN_DEBUG_DUMP("caseTable[3]\n");
+
+							caseTableIndex >>= 6;									// shr	$0x6,%r9
+							compBuffer = (compBuffer + caseTableIndex + 3);			// lea	0x3(%rdx,%r9,1),%rdx
+
+							if (compBuffer > compressedSize)						// cmp	%rcx,%rdx
+							{
+								return 0;											// ja	Llzvn_exit
+							}
+						
+							r10 = 56;												// mov	$0x38,%r10
+							r12 = 65535;											// mov	$0xffff,%r12
+							r10 &= compBufferPointer;								// and	%r8,%r10
+							compBufferPointer >>= 8;								// shr	$0x8,%r8
+							r10 >>= 3;												// shr	$0x3,%r10
+							r12 &= compBufferPointer;								// and	%r8,%r12
+							compBufferPointer >>= 16;								// shr	$0x10,%r8
+							r10 += 3;												// add	$0x3,%r10
+						
+							jmpTo = LZVN_10;										// jmp	Llzvn_l10
+							break;
+						
+					case 4:	_LZVN_DEBUG_DUMP("caseTable[4]\n");
+
+							compBuffer += 1;										// add	$0x1,%rdx
+
+							if (compBuffer > compressedSize)						// cmp	%rcx,%rdx
+							{
+								return 0;											// ja	Llzvn_exit
+							}
+						
+							compBufferPointer = *(uint64_t *)compBuffer;			// mov	(%rdx),%r8
+							caseTableIndex = (compBufferPointer & 255);				// movzbq (%rdx),%r9
+						
+							jmpTo = CASE_TABLE;										// continue;
+							break;													// jmpq	*(%rbx,%r9,8)
+
+					case 5: _LZVN_DEBUG_DUMP("caseTable[5]\n");
+
+							return 0;												// Llzvn_table5;
+					
+					case 6: _LZVN_DEBUG_DUMP("caseTable[6]\n");
+
+							caseTableIndex >>= 3;									// shr	$0x3,%r9
+							caseTableIndex &= 3;									// and	$0x3,%r9
+							compBuffer = (compBuffer + caseTableIndex + 3);			// lea	0x3(%rdx,%r9,1),%rdx
+
+							if (compBuffer > compressedSize)						// cmp	%rcx,%rdx
+							{
+								return 0;											// ja	Llzvn_exit
+							}
+						
+							r10 = compBufferPointer;								// mov	%r8,%r10
+							r10 &= 775;												// and	$0x307,%r10
+							compBufferPointer >>= 10;								// shr	$0xa,%r8
+							r12 = (r10 & 255);										// movzbq %r10b,%r12
+							r10 >>= 8;												// shr	$0x8,%r10
+							r12 <<= 2;												// shl	$0x2,%r12
+							r10 |= r12;												// or	%r12,%r10
+							r12 = 16383;											// mov	$0x3fff,%r12
+							r10 += 3;												// add	$0x3,%r10
+							r12 &= compBufferPointer;								// and	%r8,%r12
+							compBufferPointer >>= 14;								// shr	$0xe,%r8
+
+							jmpTo = LZVN_10;										// jmp	Llzvn_l10
+							break;
+						
+					case 7:	_LZVN_DEBUG_DUMP("caseTable[7]\n");
+
+							compBufferPointer >>= 8;								// shr	$0x8,%r8
+							compBufferPointer &= 255;								// and	$0xff,%r8
+							compBufferPointer += 16;								// add	$0x10,%r8
+							compBuffer = (compBuffer + compBufferPointer + 2);		// lea	0x2(%rdx,%r8,1),%rdx
+
+							jmpTo = LZVN_0;											// jmp	Llzvn_l0
+							break;
+						
+					case 8: _LZVN_DEBUG_DUMP("caseTable[8]\n");
+
+							compBufferPointer &= 15;								// and	$0xf,%r8
+							compBuffer = (compBuffer + compBufferPointer + 1);		// lea	0x1(%rdx,%r8,1),%rdx
+						
+							jmpTo = LZVN_0;											// jmp	Llzvn_l0
+							break;
+					
+					case 9:	_LZVN_DEBUG_DUMP("caseTable[9]\n");
+
+							compBuffer += 2;										// add	$0x2,%rdx
+					
+							if (compBuffer > compressedSize)						// cmp	%rcx,%rdx
+							{
+								return 0;											// ja	Llzvn_exit
+							}
+
+							r10 = compBufferPointer;								// mov	%r8,%r10
+							r10 >>= 8;												// shr	$0x8,%r10
+							r10 &= 255;												// and	$0xff,%r10
+							r10 += 16;												// add	$0x10,%r10
+
+							jmpTo = LZVN_11;										// jmp	Llzvn_l11
+							break;
+
+					case 10:_LZVN_DEBUG_DUMP("caseTable[10]\n");
+
+							compBuffer += 1;										// add	$0x1,%rdx
+							
+							if (compBuffer > compressedSize)						// cmp	%rcx,%rdx
+							{
+								return 0;											// ja	Llzvn_exit
+							}
+						
+							r10 = compBufferPointer;								// mov	%r8,%r10
+							r10 &= 15;												// and	$0xf,%r10
+						
+							jmpTo = LZVN_11;										// jmp	Llzvn_l11
+							break;
+#if DEBUG_STATE_ENABLED
+					default:printf("default() caseTableIndex[%d]\n", (uint8_t)caseTableIndex);
+#endif
+				}																	// switch (caseTable[caseTableIndex])
+
+				break;
+
+			case LZVN_0: /**********************************************************/
+
+				_LZVN_DEBUG_DUMP("jmpTable(0)\n");
+
+				if (compBuffer > compressedSize)									// cmp	%rcx,%rdx
+				{
+					return 0;														// ja	Llzvn_exit
+				}
+				
+				currentLength = (length + compBufferPointer);						// lea	(%rax,%r8,1),%r11
+				compBufferPointer = -compBufferPointer;								// neg	%r8
+				
+				if (currentLength > decompressedSize)								// cmp	%rsi,%r11
+				{
+					jmpTo = LZVN_2;													// ja	Llzvn_l2
+					break;
+				}
+
+				currentLength = (decompBuffer + currentLength);						// lea	(%rdi,%r11,1),%r11
+
+			case LZVN_1: /**********************************************************/
+
+				do																	// Llzvn_l1:
+				{
+					_LZVN_DEBUG_DUMP("jmpTable(1)\n");
+
+//					address = (compBuffer + compBufferPointer);						// mov	(%rdx,%r8,1),%r9
+//					caseTableIndex = *(uint64_t *)address;
+					caseTableIndex = *(uint64_t *)((uint64_t)compBuffer + compBufferPointer);
+
+//					address = (currentLength + compBufferPointer);					// mov	%r9,(%r11,%r8,1)
+//					*(uint64_t *)address = caseTableIndex;
+					*(uint64_t *)((uint64_t)currentLength + compBufferPointer) = caseTableIndex;
+
+					compBufferPointer += 8;											// add	$0x8,%r8
+
+				} while ((UINT64_MAX - (compBufferPointer - 8)) >= 8);				// jae	Llzvn_l1
+
+				length = currentLength;												// mov	%r11,%rax
+				length -= decompBuffer;												// sub	%rdi,%rax
+				
+				compBufferPointer = *(uint64_t *)compBuffer;						// mov	(%rdx),%r8
+				caseTableIndex = (compBufferPointer & 255);							// movzbq (%rdx),%r9
+
+				jmpTo = CASE_TABLE;
+				break;																// jmpq	*(%rbx,%r9,8)
+
+			case LZVN_2: /**********************************************************/
+
+				_LZVN_DEBUG_DUMP("jmpTable(2)\n");
+
+				currentLength = (decompressedSize + 8);								// lea	0x8(%rsi),%r11
+
+			case LZVN_3: /***********************************************************/
+
+				do																	// Llzvn_l3:
+				{
+					_LZVN_DEBUG_DUMP("jmpTable(3)\n");
+
+					address = (compBuffer + compBufferPointer);						// movzbq (%rdx,%r8,1),%r9
+					caseTableIndex = *((uint64_t *)address);
+					caseTableIndex &= 255;
+					
+					address = (decompBuffer + length);								// mov	%r9b,(%rdi,%rax,1)
+					byte_data = (unsigned char)caseTableIndex;
+					memcpy((void *)address, &byte_data, sizeof(byte_data));
+					
+					length += 1;													// add	$0x1,%rax
+					
+					if (currentLength == length)									// cmp	%rax,%r11
+					{
+						return length;												// je	Llzvn_exit2
+					}
+					
+					compBufferPointer += 1;											// add	$0x1,%r8
+					
+				} while ((int64_t)compBufferPointer != 0);							// jne	Llzvn_l3
+				
+				compBufferPointer = *(uint64_t *)compBuffer;						// mov	(%rdx),%r8
+				caseTableIndex = (compBufferPointer & 255);							// movzbq	(%rdx),%r9
+
+				jmpTo = CASE_TABLE;
+				break;																// jmpq	*(%rbx,%r9,8)
+
+			case LZVN_4: /**********************************************************/
+
+				_LZVN_DEBUG_DUMP("jmpTable(4)\n");
+
+				currentLength = (decompressedSize + 8);								// lea	0x8(%rsi),%r11
+
+			case LZVN_9: /**********************************************************/
+
+				do																	// Llzvn_l9:
+				{
+					_LZVN_DEBUG_DUMP("jmpTable(9)\n");
+
+					address = (decompBuffer + compBufferPointer);					// movzbq (%rdi,%r8,1),%r9
+					byte_data = *((unsigned char *)address);
+					caseTableIndex = byte_data;
+					caseTableIndex &= 255;
+					compBufferPointer += 1;											// add	$0x1,%r8
+					
+					address = (decompBuffer + length);								// mov	%r9,(%rdi,%rax,1)
+					byte_data = (unsigned char)caseTableIndex;
+					memcpy((void *)address, &byte_data, sizeof(byte_data));
+					
+					length += 1;													// add	$0x1,%rax
+					
+					if (length == currentLength)									// cmp	%rax,%r11
+					{
+						return length;												// je	Llzvn_exit2
+					}
+
+					r10 -= 1;														// sub	$0x1,%r10
+					
+				} while (r10);														// jne	Llzvn_l9
+				
+				compBufferPointer = *(uint64_t *)compBuffer;						// mov	(%rdx),%r8
+				caseTableIndex = (compBufferPointer & 255);							// movzbq	(%rdx),%r9
+
+				jmpTo = CASE_TABLE;
+				break;																// jmpq	*(%rbx,%r9,8)
+
+			case LZVN_5: /**********************************************************/
+
+				do
+				{
+					_LZVN_DEBUG_DUMP("jmpTable(5)\n");
+
+					address = (decompBuffer + compBufferPointer);					// mov	(%rdi,%r8,1),%r9
+					caseTableIndex = *((uint64_t *)address);
+					compBufferPointer += 8;											// add	$0x8,%r8
+					
+					address = (decompBuffer + length);								// mov	%r9,(%rdi,%rax,1)
+					memcpy((void *)address, &caseTableIndex, sizeof(caseTableIndex));
+					
+					length += 8;													// add	$0x8,%rax
+					r10 -= 8;														// sub	$0x8,%r10
+					
+				} while ((r10 + 8) > 8);											// ja	Llzvn_l5
+
+				length += r10;														// add	%r10,%rax
+				compBufferPointer = *(uint64_t *)compBuffer;						// mov	(%rdx),%r8
+				caseTableIndex = (compBufferPointer & 255);							// movzbq	(%rdx),%r9
+
+				jmpTo = CASE_TABLE;
+				break;																// jmpq	*(%rbx,%r9,8)
+
+			case LZVN_10: /*********************************************************/
+
+				_LZVN_DEBUG_DUMP("jmpTable(10)\n");
+
+				currentLength = (length + caseTableIndex);							// lea	(%rax,%r9,1),%r11
+				currentLength += r10;												// add	%r10,%r11
+
+				if (currentLength < decompressedSize)								// cmp	%rsi,%r11 (block_end: jae	Llzvn_l8)
+				{
+					address = decompBuffer + length;								// mov	%r8,(%rdi,%rax,1)
+					memcpy((void *)address, &compBufferPointer, sizeof(compBufferPointer));
+						
+					length += caseTableIndex;										// add	%r9,%rax
+					compBufferPointer = length;										// mov	%rax,%r8
+						
+					if (compBufferPointer < r12)									// jb	Llzvn_exit
+					{
+						return 0;
+					}
+
+					compBufferPointer -= r12;										// sub	%r12,%r8
+
+					if (r12 < 8)													// cmp	$0x8,%r12
+					{
+						jmpTo = LZVN_4;												// jb	Llzvn_l4
+						break;
+					}
+
+					jmpTo = LZVN_5;													// jmpq	*(%rbx,%r9,8)
+					break;
+				}
+
+			case LZVN_8: /**********************************************************/
+
+				_LZVN_DEBUG_DUMP("jmpTable(8)\n");
+
+				if (caseTableIndex == 0)											// test	%r9,%r9
+				{
+					jmpTo = LZVN_7;													// jmpq	*(%rbx,%r9,8)
+					break;
+				}
+
+				currentLength = (decompressedSize + 8);								// lea	0x8(%rsi),%r11
+
+			case LZVN_6: /**********************************************************/
+
+				do
+				{
+					_LZVN_DEBUG_DUMP("jmpTable(6)\n");
+
+					address = (decompBuffer + length);								// mov	%r8b,(%rdi,%rax,1)
+					byte_data = (unsigned char)(compBufferPointer & 255);
+					memcpy((void *)address, &byte_data, sizeof(byte_data));
+					length += 1;													// add	$0x1,%rax
+						
+					if (length == currentLength)									// cmp	%rax,%r11
+					{
+						return length;												// je	Llzvn_exit2
+					}
+						
+					compBufferPointer >>= 8;										// shr	$0x8,%r8
+					caseTableIndex -= 1;											// sub	$0x1,%r9
+						
+				} while (caseTableIndex != 1);										// jne	Llzvn_l6
+
+			case LZVN_7: /**********************************************************/
+
+				_LZVN_DEBUG_DUMP("jmpTable(7)\n");
+
+				compBufferPointer = length;											// mov	%rax,%r8
+				compBufferPointer -= r12;											// sub	%r12,%r8
+
+				if (compBufferPointer < r12)										// jb	Llzvn_exit
+				{
+					return 0;
+				}
+
+				jmpTo = LZVN_4;
+				break;																// jmpq	*(%rbx,%r9,8)
+	
+			case LZVN_11: /*********************************************************/
+
+				_LZVN_DEBUG_DUMP("jmpTable(11)\n");
+
+				compBufferPointer = length;											// mov	%rax,%r8
+				compBufferPointer -= r12;											// sub	%r12,%r8
+				currentLength = (length + r10);										// lea	(%rax,%r10,1),%r11
+				
+				if (currentLength < decompressedSize)								// cmp	%rsi,%r11
+				{
+					if (r12 >= 8)													// cmp	$0x8,%r12
+					{
+						jmpTo = LZVN_5;												// jae	Llzvn_l5
+						break;
+					}
+				}
+				
+				jmpTo = LZVN_4;														// jmp	Llzvn_l4
+				break;
+		}																			// switch (jmpq)
+
+	} while (1);
+
+	return 0;
+}
+
+
+//==============================================================================
+// Greedy LZVN encoder. Good enough to get data that looks like what Apple's
+// encoder produces (both look for the longest match and reuse the previous
+// distance) without being smart about it.
+
+#define kHashBits	16
+
+static uint32_t hashBytes(const uint8_t * p)
+{
+	return (((p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24)) * 2654435761U) >> (32 - kHashBits));
+}
+
+static uint8_t * emitLiterals(uint8_t * out, const uint8_t * literals, uint32_t length)
+{
+	uint32_t count;
+
+	while (length)
+	{
+		if (length >= 16)
+		{
+			count = min(length, 271);
+			*out++ = 0xE0;
+			*out++ = (count - 16);
+		}
+		else
+		{
+			count = length;
+			*out++ = (0xE0 | count);
+		}
+
+		memcpy(out, literals, count);
+		out += count;
+		literals += count;
+		length -= count;
+	}
+
+	return out;
+}
+
+static uint8_t * emitMatch(uint8_t * out, uint32_t length)	// With the previous distance.
+{
+	uint32_t count;
+
+	while (length)
+	{
+		if (length >= 16)
+		{
+			count = min(length, 271);
+			*out++ = 0xF0;
+			*out++ = (count - 16);
+		}
+		else
+		{
+			count = length;
+			*out++ = (0xF0 | count);
+		}
+
+		length -= count;
+	}
+
+	return out;
+}
+
+static uint32_t lzvn_encode(uint8_t * out, const uint8_t * in, uint32_t size)
+{
+	// Longest match for sml_d, lrg_d and pre_d, by the number of literals. Other
+	// combinations are taken by opcodes like med_d, sml_l and sml_m.
+	static const uint32_t maxMatch[4] = { 10, 8, 6, 4 };
+
+	uint8_t * start = out;
+	uint32_t * table = calloc((1 << kHashBits), sizeof(uint32_t));
+
+	uint32_t pos = 0, anchor = 0, previous = 0;
+	uint32_t L, M, D, count, candidate, h;
+
+	while ((pos + 4) <= size)
+	{
+		h = hashBytes(in + pos);
+		candidate = table[h];
+		table[h] = pos;
+		M = D = 0;
+
+		// Try the previous distance first, like the real thing.
+		if (previous && (previous <= pos) && !memcmp(in + pos, in + pos - previous, 3))
+		{
+			D = previous;
+		}
+		else if (candidate && ((pos - candidate) < 0x10000) && !memcmp(in + pos, in + candidate, 3))
+		{
+			D = (pos - candidate);
+		}
+
+		if (D == 0)
+		{
+			pos++;
+			continue;
+		}
+
+		while (((pos + M) < size) && (in[pos + M] == in[pos + M - D]))
+		{
+			M++;
+		}
+
+		// Literals, up to three of them go with the match.
+		L = (pos - anchor);
+
+		if (L > 3)
+		{
+			out = emitLiterals(out, in + anchor, L - 3);
+			anchor += (L - 3);
+			L = 3;
+		}
+
+		if (D == previous)
+		{
+			if (L)
+			{
+				count = min(M, maxMatch[L]);
+				*out++ = ((L << 6) | ((count - 3) << 3) | 6);			// pre_d
+			}
+			else
+			{
+				count = 0;
+			}
+		}
+		else if ((D < 0x600) && (M <= maxMatch[L]))
+		{
+			count = M;
+			*out++ = ((L << 6) | ((count - 3) << 3) | (D >> 8));	// sml_d
+			*out++ = (D & 0xFF);
+		}
+		else if (D < 0x4000)
+		{
+			count = min(M, 34);
+			*out++ = (0xA0 | (L << 3) | ((count - 3) >> 2));		// med_d
+			*out++ = (((D & 0x3F) << 2) | ((count - 3) & 3));
+			*out++ = (D >> 6);
+		}
+		else
+		{
+			count = min(M, maxMatch[L]);
+			*out++ = ((L << 6) | ((count - 3) << 3) | 7);			// lrg_d
+			*out++ = (D & 0xFF);
+			*out++ = (D >> 8);
+		}
+
+		memcpy(out, in + anchor, L);
+		out += L;
+		out = emitMatch(out, M - count);
+
+		// Add some of the skipped positions to the table.
+		for (h = pos + 1; (h < (pos + M)) && ((h + 4) <= size); h += 4)
+		{
+			table[hashBytes(in + h)] = h;
+		}
+
+		pos += M;
+		anchor = pos;
+		previous = D;
+	}
+
+	out = emitLiterals(out, in + anchor, size - anchor);
+
+	// End of stream (followed by seven zero bytes).
+	memset(out, 0, 8);
+	*out = 0x06;
+	out += 8;
+
+	free(table);
+
+	return (uint32_t)(out - start);
+}
+
+
+//==============================================================================
+// Generated corpus, modelled after a prelinkedkernel: machine code (built from
+// common x86_64 instruction sequences with random operands), tables with kernel
+// pointers, mangled symbol names and zero filled padding up to page boundaries.
+
+static uint32_t gSeed = 1;
+
+static uint32_t nextRandom(void)
+{
+	gSeed = ((gSeed * 1103515245) + 12345);
+
+	return (gSeed >> 8);
+}
+
+static uint32_t generateCorpus(uint8_t * out, uint32_t size)
+{
+	static const char * code[] =
+	{
+		"\x55\x48\x89\xE5", "\x41\x57\x41\x56\x41\x55\x41\x54\x53", "\x48\x83\xEC", "\x48\x8B\x45", "\x48\x89\x45",
+		"\x8B\x45", "\x89\x45", "\x48\x8B\x7D", "\xE8", "\x48\x85\xC0", "\x74", "\x75", "\x0F\x84", "\x0F\x85",
+		"\x31\xC0", "\x5B\x41\x5C\x41\x5D\x41\x5E\x41\x5F\x5D\xC3", "\x48\x8D\x3D", "\x48\x8B\x05", "\x4C\x89\xF7",
+		"\x48\x89\xDF", "\xFF\x90", "\x48\x8B\x07", "\x83\xF8", "\xEB", "\x0F\x1F\x44\x00\x00", "\xC7\x45"
+	};
+
+	static const char * words[] =
+	{
+		"IOService", "OSObject", "IOPCIDevice", "IORegistryEntry", "getProperty", "setProperty", "start", "stop",
+		"probe", "init", "free", "OSDictionary", "OSString", "withCString", "IOWorkLoop", "IOInterruptEventSource",
+		"IOMemoryDescriptor", "prepare", "complete", "IOBufferMemoryDescriptor", "metaClass", "superClass"
+	};
+
+	uint8_t * p = out;
+	uint8_t * end = (out + size);
+	uint32_t i, n, kind;
+	uint64_t pointer;
+
+	while (p < end - 0x10000)
+	{
+		kind = (nextRandom() % 8);
+
+		if (kind < 4)			// Code.
+		{
+			for (n = (0x400 + (nextRandom() % 0x2000)); n; n--)
+			{
+				const char * insn = code[nextRandom() % (sizeof(code) / sizeof(code[0]))];
+
+				memcpy(p, insn, strlen(insn));
+				p += strlen(insn);
+
+				// Operand: displacement or immediate, or a call target.
+				if (insn[0] == '\xE8' || insn[0] == '\x0F')
+				{
+					i = nextRandom();
+					memcpy(p, &i, 4);
+					p += 4;
+				}
+				else if ((nextRandom() % 3) == 0)
+				{
+					*p++ = ((nextRandom() % 32) * 8);
+				}
+			}
+		}
+		else if (kind == 4)		// Pointer tables (vtables, relocations).
+		{
+			pointer = (0xFFFFFF8000200000ULL + ((nextRandom() % 0x1000000) & ~7));
+
+			for (n = (0x40 + (nextRandom() % 0x200)); n; n--)
+			{
+				pointer += ((nextRandom() % 64) * 8);
+				memcpy(p, &pointer, 8);
+				p += 8;
+			}
+		}
+		else if (kind == 5)		// Symbol names.
+		{
+			for (n = (0x40 + (nextRandom() % 0x200)); n; n--)
+			{
+				i = (nextRandom() % (sizeof(words) / sizeof(words[0])));
+				p += sprintf((char *)p, "__ZN%lu%s%lu%sEv", (unsigned long)strlen(words[i]), words[i],
+							 (unsigned long)strlen(words[n % 22]), words[n % 22]) + 1;
+			}
+		}
+		else if (kind == 6)		// Random data (already compressed resources and such).
+		{
+			for (n = (0x100 + (nextRandom() % 0x800)); n; n--)
+			{
+				*p++ = nextRandom();
+			}
+		}
+		else					// Padding up to the next page.
+		{
+			n = (0x1000 - ((p - out) & 0xFFF));
+			memset(p, 0, n);
+			p += n;
+		}
+	}
+
+	return (uint32_t)(p - out);
+}
+
+
+//==============================================================================
+
+static double now(void)
+{
+	return ((double)clock() / CLOCKS_PER_SEC);
+}
+
+
+//==============================================================================
+// Decodes the data in chunks of random sizes, with a window that wraps (like
+// decodeKernel) and compares the result with the expected output.
+
+static int checkStream(uint8_t * compressed, uint32_t compressedSize, uint8_t * expected, uint32_t size)
+{
+	uint32_t windowSize = (0x10001 + (nextRandom() % 0x40000));
+	uint8_t * window = malloc(windowSize + kPadding);
+	uint32_t windowOffset = 0, length, flushed = 0;
+	int status;
+
+	DecodeStream stream;
+
+	bzero(&stream, sizeof(stream));
+
+	stream.adler32	= 1;
+	stream.src		= compressed;
+	stream.srcEnd	= compressed;
+	stream.dst		= window;
+	stream.dstStart	= window;
+
+	for (;;)
+	{
+		stream.dstEnd = (window + min(windowSize, size - windowOffset));
+		status = lzvn_decode_stream(&stream);
+
+		if (status == kDecodeError)
+		{
+			break;
+		}
+
+		if ((status == kDecodeNeedInput) && (stream.srcEnd < (compressed + compressedSize)))
+		{
+			stream.srcEnd = min((stream.srcEnd + 1 + (nextRandom() % 0x2000)), (compressed + compressedSize));
+			continue;
+		}
+
+		length = (stream.dst - window);
+
+		if (memcmp(window + flushed, expected + windowOffset + flushed, length - flushed))
+		{
+			break;
+		}
+
+		flushed = length;
+
+		if ((status != kDecodeNeedOutput) || ((windowOffset + length) == size))
+		{
+			free(window);
+
+			return (((windowOffset + length) == size) && (stream.adler32 == Adler32(1, expected, size))) ? 0 : -1;
+		}
+
+		// Keep the last 64 KB (the largest match distance) like decodeKernel() does.
+		memmove(window, window + length - 0x10000, 0x10000);
+		windowOffset += (length - 0x10000);
+		stream.dst = (window + 0x10000);
+		flushed = 0x10000;
+	}
+
+	free(window);
+
+	return -1;
+}
+
+
+//==============================================================================
+
+static int benchmark(const char * name, uint8_t * compressed, uint32_t compressedSize, uint8_t * expected, uint32_t size, int runs)
+{
+	uint8_t * output = malloc(size + kPadding);
+	double start, reference = 1e9, decoder = 1e9;
+	int i;
+
+	for (i = 0; i < runs; i++)
+	{
+		memset(output, 0, size);
+		start = now();
+
+		// The reference decoder may stop short of a match that ends at the very end of
+		// the buffer, so we give it a little room (it stops at the end of stream anyway).
+		if (lzvn_decode_reference(output, size + kPadding, compressed, compressedSize) != size)
+		{
+			printf("%s: reference decoder failed!\n", name);
+			return -1;
+		}
+
+		reference = min(reference, (now() - start));
+
+		if (expected == NULL)
+		{
+			expected = malloc(size);
+			memcpy(expected, output, size);
+		}
+		else if (memcmp(output, expected, size))
+		{
+			printf("%s: reference decoder output mismatch!\n", name);
+			return -1;
+		}
+
+		memset(output, 0, size);
+		start = now();
+
+		if (lzvn_decode(output, size, compressed, compressedSize) != size)
+		{
+			printf("%s: lzvn_decode failed!\n", name);
+			return -1;
+		}
+
+		decoder = min(decoder, (now() - start));
+
+		if (memcmp(output, expected, size))
+		{
+			printf("%s: lzvn_decode output mismatch!\n", name);
+			return -1;
+		}
+	}
+
+	for (i = 0; i < 8; i++)
+	{
+		if (checkStream(compressed, compressedSize, expected, size))
+		{
+			printf("%s: lzvn_decode_stream output mismatch!\n", name);
+			return -1;
+		}
+	}
+
+	printf("%s: %u -> %u bytes, reference %.1f MB/s, lzvn_decode %.1f MB/s (%.2fx)\n", name, compressedSize, size,
+		   (size / reference / 1e6), (size / decoder / 1e6), (reference / decoder));
+
+	free(output);
+
+	return 0;
+}
+
+
+//==============================================================================
+
+int main(int argc, char * argv[])
+{
+	uint8_t * data, * compressed;
+	uint32_t size, compressedSize;
+	int i = 1, runs = 20, failed = 0;
+	FILE * file;
+
+	if ((argc > 2) && (strcmp(argv[1], "-r") == 0))
+	{
+		runs = atoi(argv[2]);
+		i = 3;
+	}
+
+	if (i == argc)
+	{
+		size = (32 << 20);
+		data = malloc(size + 0x20000);
+		size = generateCorpus(data, size);
+		compressed = malloc(size + (size / 8) + kPadding);
+		compressedSize = lzvn_encode(compressed, data, size);
+
+		failed = benchmark("corpus", compressed, compressedSize, data, size, runs);
+
+		free(compressed);
+		free(data);
+
+		return (failed ? 1 : 0);
+	}
+
+	for (; i < argc; i++)
+	{
+		if ((file = fopen(argv[i], "rb")) == NULL)
+		{
+			printf("%s: cannot open file!\n", argv[i]);
+			failed = 1;
+			continue;
+		}
+
+		fseek(file, 0, SEEK_END);
+		size = (uint32_t)ftell(file);
+		rewind(file);
+
+		data = calloc(1, size + kPadding);
+
+		if (fread(data, 1, size, file) != size)
+		{
+			printf("%s: read error!\n", argv[i]);
+			failed = 1;
+		}
+		else if ((size > 0x180) && (OSSwapBigToHostInt32(*(uint32_t *)data) == 'comp') && (OSSwapBigToHostInt32(*(uint32_t *)(data + 4)) == 'lzvn'))
+		{
+			// compressed_kernel_header: signature, compressType, adler32, uncompressedSize,
+			// compressedSize, reserved[11], platformName[64], rootPath[256], data[].
+			compressedSize = OSSwapBigToHostInt32(*(uint32_t *)(data + 16));
+			size = OSSwapBigToHostInt32(*(uint32_t *)(data + 12));
+
+			failed |= benchmark(argv[i], data + 0x180, compressedSize, NULL, size, runs);
+		}
+		else
+		{
+			compressed = malloc(size + (size / 8) + kPadding);
+			compressedSize = lzvn_encode(compressed, data, size);
+
+			failed |= benchmark(argv[i], compressed, compressedSize, data, size, runs);
+			free(compressed);
+		}
+
+		fclose(file);
+		free(data);
+	}
+
+	return failed;
+}